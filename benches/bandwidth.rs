@@ -0,0 +1,39 @@
+//! Achieved memory bandwidth of the fused residual add + RMSNorm forward pass, the bandwidth bound
+//! case of a transformer block, per hidden size and as a percent of the peak HBM bandwidth of the
+//! device. The row count is chosen so that every shape moves the same number of bytes, large
+//! enough to run the persistent kernel.
+//!
+//! cargo bench --bench bandwidth
+mod common;
+
+use candle_core::{DType, Device, Result, Tensor};
+use candle_layer_norm::fused_add_rms_norm;
+use common::{peak_gb_per_s, time};
+
+const ELEMENTS: usize = 64 << 20;
+const ITERS: usize = 100;
+
+fn main() -> Result<()> {
+    let device = Device::new_cuda(0)?;
+    let peak = peak_gb_per_s(&device)?;
+    println!("peak HBM bandwidth {peak:.0} GB/s");
+    println!("dtype cols   rows |      us    GB/s  % peak");
+    for dtype in [DType::F16, DType::BF16] {
+        for cols in [1024, 2048, 4096, 5120, 8192] {
+            let rows = ELEMENTS / cols;
+            let x = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(dtype)?;
+            let r = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(dtype)?;
+            let gamma = Tensor::randn(0f32, 1., cols, &device)?.to_dtype(dtype)?;
+
+            let us = time(ITERS, || Ok(fused_add_rms_norm(&x, &r, &gamma, None, 1e-5)?.0))?;
+            // x and the residual are read, the output and the sum are written.
+            let bytes = (4 * rows * cols + cols) * dtype.size_in_bytes();
+            let gb_per_s = bytes as f64 / us / 1e3;
+            println!(
+                "{dtype:?} {cols:5} {rows:6} | {us:7.1} {gb_per_s:7.0} {:6.1}%",
+                100. * gb_per_s / peak
+            );
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,40 @@
+//! Timing and device helpers shared by the benches.
+#![allow(dead_code)] // Each bench uses some of them.
+use candle_core::cuda_backend::cudarc::driver::result::mem_get_info;
+use candle_core::cuda_backend::cudarc::driver::sys::CUdevice_attribute::{
+    CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH, CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE,
+};
+use candle_core::cuda_backend::WrapErr;
+use candle_core::{DType, Device, Result, Tensor};
+use std::time::Instant;
+
+/// Peak HBM bandwidth in GB/s from the memory clock (kHz, double data rate) and the bus width.
+pub fn peak_gb_per_s(device: &Device) -> Result<f64> {
+    let Device::Cuda(dev) = device else {
+        candle_core::bail!("the benches need a cuda device")
+    };
+    let clock_khz = dev.attribute(CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE).w()? as f64;
+    let bus_bits = dev.attribute(CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH).w()? as f64;
+    Ok(2. * clock_khz * 1e3 * bus_bits / 8. / 1e9)
+}
+
+/// Free device memory in bytes.
+pub fn free_bytes(device: &Device) -> Result<usize> {
+    let Device::Cuda(dev) = device else {
+        candle_core::bail!("the benches need a cuda device")
+    };
+    dev.bind_to_thread().w()?;
+    Ok(mem_get_info().w()?.0)
+}
+
+/// Mean time of iters calls of f in microseconds. Copying a scalar back waits for the stream.
+pub fn time(iters: usize, f: impl Fn() -> Result<Tensor>) -> Result<f64> {
+    f()?.sum_all()?.to_dtype(DType::F32)?.to_scalar::<f32>()?;
+    let start = Instant::now();
+    let mut out = f()?;
+    for _ in 1..iters {
+        out = f()?;
+    }
+    out.sum_all()?.to_dtype(DType::F32)?.to_scalar::<f32>()?;
+    Ok(start.elapsed().as_secs_f64() * 1e6 / iters as f64)
+}
@@ -0,0 +1,71 @@
+//! RMSNorm reduces only the sum of squares of a row, one scalar per shuffle step. Before, it ran
+//! the LayerNorm reduction, merging the per-warp mean and M2 (Chan), and added mu * mu back to the
+//! variance. This compares the time of both RMSNorm forward passes at the same shapes, and their
+//! max abs error against an f64 reference.
+//!
+//! The old path is reproduced from the LayerNorm kernel, whose reduction it ran: its time is that
+//! of the LayerNorm forward pass without statistics, and its output is recomputed from the saved
+//! mu and rs, with rs_old = rsqrt(1 / rs^2 + mu^2) = rsqrt(m2 / cols + eps + mu^2).
+//!
+//! cargo bench --bench rms_norm
+mod common;
+
+use candle_core::{DType, Device, Result, Tensor};
+use candle_layer_norm::{layer_norm, rms_norm, LayerNorm, LayerNormStats};
+use common::time;
+
+const ROWS: usize = 8192;
+const ITERS: usize = 200;
+
+fn reference(x: &Tensor, gamma: &Tensor, epsilon: f64) -> Result<Tensor> {
+    let x = x.to_dtype(DType::F64)?;
+    let ms = x.sqr()?.mean_keepdim(1)?;
+    x.broadcast_div(&(ms + epsilon)?.sqrt()?)?
+        .broadcast_mul(&gamma.to_dtype(DType::F64)?)
+}
+
+/// RMSNorm through the Welford statistics of the LayerNorm kernel, in f32 like the kernel.
+fn welford_rms_norm(ln: &LayerNorm, x: &Tensor) -> Result<Tensor> {
+    let out = ln.forward(x, None)?;
+    let Some((mu, rs)) = out.stats else {
+        candle_core::bail!("the LayerNorm forward pass returns its statistics")
+    };
+    let rs = (rs.sqr()?.recip()? + mu.sqr()?)?.sqrt()?.recip()?;
+    x.to_dtype(DType::F32)?
+        .broadcast_mul(&rs.unsqueeze(1)?)?
+        .broadcast_mul(&ln.gamma.to_dtype(DType::F32)?)?
+        .to_dtype(x.dtype())
+}
+
+fn max_abs_err(a: &Tensor, b: &Tensor) -> Result<f64> {
+    (a.to_dtype(DType::F64)? - b)?
+        .abs()?
+        .flatten_all()?
+        .max(0)?
+        .to_scalar::<f64>()
+}
+
+fn main() -> Result<()> {
+    let device = Device::new_cuda(0)?;
+    let epsilon = 1e-5;
+    println!("dtype cols | new us  err      | welford us  err");
+    for dtype in [DType::F16, DType::BF16, DType::F32] {
+        for cols in [1024, 4096, 8192] {
+            // An offset mean makes the difference between the two reductions visible.
+            let x = (Tensor::randn(0f32, 1., (ROWS, cols), &device)? + 4.)?.to_dtype(dtype)?;
+            let gamma = Tensor::randn(0f32, 1., cols, &device)?.to_dtype(dtype)?;
+            let mut welford = LayerNorm::new(gamma.clone(), None, epsilon, false)?;
+            welford.stats = LayerNormStats::Return;
+
+            let new_us = time(ITERS, || rms_norm(&x, &gamma, None, epsilon))?;
+            let old_us = time(ITERS, || layer_norm(&x, &gamma, None, epsilon))?;
+            let expected = reference(&x, &gamma, epsilon as f64)?;
+            let new_err = max_abs_err(&rms_norm(&x, &gamma, None, epsilon)?, &expected)?;
+            let old_err = max_abs_err(&welford_rms_norm(&welford, &x)?, &expected)?;
+            println!(
+                "{dtype:?} {cols:5} | {new_us:7.1} {new_err:.2e} | {old_us:7.1} {old_err:.2e}"
+            );
+        }
+    }
+    Ok(())
+}
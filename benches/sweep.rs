@@ -0,0 +1,142 @@
+//! Sweep of the forward pass over the compiled hidden sizes, the (weight, input, residual) dtypes
+//! of FWD_DTYPES, row counts from 1 to 256k, LayerNorm and RMSNorm with and without the residual
+//! add. Residuals of another dtype than the input are updated in place, the only API that takes
+//! them. Every shape reports the time, the achieved bandwidth and its percent of the device peak,
+//! and the speedup over the same computation with candle-nn, an add in the residual dtype followed
+//! by candle_nn::ops::{layer_norm, rms_norm}.
+//!
+//! cargo bench --bench sweep [-- <filter>]
+//!
+//! The filter is a substring of the shape labels, e.g. `rms+residual bf16/bf16/f32`.
+//! Shapes that do not fit in the free device memory are listed as skipped.
+mod common;
+
+use candle_core::{DType, Device, Result, Tensor};
+use candle_layer_norm::{
+    compiled_dtypes, compiled_hidden_sizes, fused_add_layer_norm, fused_add_layer_norm_inplace,
+    fused_add_rms_norm, fused_add_rms_norm_inplace, layer_norm, rms_norm, FWD_DTYPES,
+};
+use common::{free_bytes, peak_gb_per_s, time};
+use std::cell::RefCell;
+
+const ROWS: [usize; 6] = [1, 16, 256, 4096, 65536, 262144];
+const EPSILON: f32 = 1e-5;
+/// Tensors of the shape of x that a measurement holds at a time: x, the residual and the f32
+/// random values they are drawn from, the outputs and sum of both passes, with some slack.
+const LIVE_TENSORS: usize = 10;
+
+fn main() -> Result<()> {
+    let filter = std::env::args()
+        .skip(1)
+        .find(|arg| !arg.starts_with("--"))
+        .unwrap_or_default();
+    let device = Device::new_cuda(0)?;
+    let peak = peak_gb_per_s(&device)?;
+    println!("peak HBM bandwidth {peak:.0} GB/s");
+    println!(
+        "{:<16} {:<14} {:>5} {:>6} | {:>8} {:>7} {:>6} | {:>9} {:>7}",
+        "mode", "w/x/r type", "cols", "rows", "fused us", "GB/s", "% peak", "candle us", "speedup"
+    );
+
+    for (rms, residual) in [(false, false), (false, true), (true, false), (true, true)] {
+        let mode = match (rms, residual) {
+            (false, false) => "layer",
+            (false, true) => "layer+residual",
+            (true, false) => "rms",
+            (true, true) => "rms+residual",
+        };
+        for (wtype, dtype, rtype) in FWD_DTYPES {
+            if !compiled_dtypes().contains(&dtype) {
+                continue;
+            }
+            // Without the residual add, the residual dtype is that of the input.
+            if !residual && rtype != dtype {
+                continue;
+            }
+            let types = format!("{}/{}/{}", wtype.as_str(), dtype.as_str(), rtype.as_str());
+            for cols in compiled_hidden_sizes() {
+                for rows in ROWS {
+                    let label = format!("{mode:<16} {types:<14} {cols:5} {rows:6}");
+                    if !label.contains(filter.as_str()) {
+                        continue;
+                    }
+                    let needed = LIVE_TENSORS * rows * cols * 4;
+                    let free = free_bytes(&device)?;
+                    if needed > free {
+                        println!(
+                            "{label} | skipped, needs {} MiB of {} MiB free",
+                            needed >> 20,
+                            free >> 20
+                        );
+                        continue;
+                    }
+                    let x = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(dtype)?;
+                    let r = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(rtype)?;
+                    let gamma = Tensor::randn(0f32, 1., cols, &device)?.to_dtype(wtype)?;
+                    let beta = Tensor::zeros(cols, wtype, &device)?;
+                    // candle-nn normalizes in the dtype of its input, the sum in the residual dtype.
+                    let ntype = if residual { rtype } else { dtype };
+                    let (gamma_nn, beta_nn) = (gamma.to_dtype(ntype)?, beta.to_dtype(ntype)?);
+
+                    // x, the residual, gamma and the LayerNorm beta are read, the output and the
+                    // sum are written. RMSNorm runs without beta, like candle_nn::ops::rms_norm.
+                    let rows_bytes = if residual {
+                        2 * dtype.size_in_bytes() + 2 * rtype.size_in_bytes()
+                    } else {
+                        2 * dtype.size_in_bytes()
+                    };
+                    let weights = if rms { 1 } else { 2 };
+                    let bytes = rows * cols * rows_bytes + weights * cols * wtype.size_in_bytes();
+                    let iters = ((1usize << 30) / bytes).clamp(10, 1000);
+
+                    // The in-place residual accumulates x over the iterations, which stays finite.
+                    let r_inplace = RefCell::new(r.copy()?);
+                    let fused_us = time(iters, || match (rms, residual) {
+                        (false, false) => layer_norm(&x, &gamma, Some(&beta), EPSILON),
+                        (true, false) => rms_norm(&x, &gamma, None, EPSILON),
+                        (false, true) if rtype != dtype => fused_add_layer_norm_inplace(
+                            &x,
+                            &mut r_inplace.borrow_mut(),
+                            &gamma,
+                            Some(&beta),
+                            EPSILON,
+                        ),
+                        (true, true) if rtype != dtype => fused_add_rms_norm_inplace(
+                            &x,
+                            &mut r_inplace.borrow_mut(),
+                            &gamma,
+                            None,
+                            EPSILON,
+                        ),
+                        (false, true) => {
+                            Ok(fused_add_layer_norm(&x, &r, &gamma, Some(&beta), EPSILON)?.0)
+                        }
+                        (true, true) => Ok(fused_add_rms_norm(&x, &r, &gamma, None, EPSILON)?.0),
+                    })?;
+                    drop(r_inplace);
+                    let candle_us = time(iters, || {
+                        let x = if residual {
+                            (x.to_dtype(rtype)? + &r)?
+                        } else {
+                            x.clone()
+                        };
+                        let out = if rms {
+                            candle_nn::ops::rms_norm(&x, &gamma_nn, EPSILON)
+                        } else {
+                            candle_nn::ops::layer_norm(&x, &gamma_nn, &beta_nn, EPSILON)
+                        }?;
+                        out.to_dtype(dtype)
+                    })?;
+
+                    let gb_per_s = bytes as f64 / fused_us / 1e3;
+                    println!(
+                        "{label} | {fused_us:8.1} {gb_per_s:7.0} {:6.1} | {candle_us:9.1} {:6.2}x",
+                        100. * gb_per_s / peak,
+                        candle_us / fused_us
+                    );
+                }
+            }
+        }
+    }
+    Ok(())
+}
@@ -1,13 +1,86 @@
 // Build script to run nvcc and generate the C glue code for launching the layer-norm kernel.
 // The cuda build time is very long so one can set the CANDLE_LAYER_NORM_BUILD_DIR environment
 // variable in order to cache the compiled artifacts and avoid recompiling too often.
+//
+// The launchers of each hidden size are in their own ln_fwd_<size>.cu and ln_bwd_<size>.cu files,
+// compiled in parallel. CANDLE_LAYER_NORM_HIDDEN_SIZES (e.g. "2048,4096") and
+// CANDLE_LAYER_NORM_DTYPES (e.g. "bf16", out of f32, f16 and bf16) restrict the build to the
+// kernel sizes and input dtypes that a deployment uses, all of them are compiled by default.
+// The telemetry feature builds the NVTX ranges and launch counters of ln_api.cu.
 use anyhow::{Context, Result};
 use rayon::prelude::*;
 use std::env;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use std::str::FromStr;
 
-const KERNEL_FILES: [&str; 1] = ["ln_api.cu"];
+const KERNEL_FILES: [&str; 3] = ["ln_api.cu", "ln_bwd_api.cu", "ln_autotune.cu"];
+
+/// Input dtypes with their kernel type names.
+const DTYPES: [(&str, &str); 3] = [("f32", "fp32"), ("f16", "fp16"), ("bf16", "bf16")];
+
+/// Returns the hidden sizes of the kernels/ln_{kind}_<size>.cu files.
+fn kernel_sizes(kernel_dir: &Path, kind: &str) -> Result<Vec<usize>> {
+    let prefix = format!("ln_{kind}_");
+    let mut sizes = Vec::new();
+    for entry in kernel_dir.read_dir()? {
+        let name = entry?.file_name();
+        let name = name.to_string_lossy();
+        if let Some(size) = name
+            .strip_prefix(&prefix)
+            .and_then(|n| n.strip_suffix(".cu"))
+            .and_then(|n| n.parse::<usize>().ok())
+        {
+            sizes.push(size)
+        }
+    }
+    sizes.sort();
+    Ok(sizes)
+}
+
+/// Parses a comma separated env var, None when it is not set.
+fn env_list(name: &str) -> Option<Vec<String>> {
+    println!("cargo:rerun-if-env-changed={name}");
+    let list = std::env::var(name).ok()?;
+    Some(
+        list.split(',')
+            .map(|s| s.trim().to_string())
+            .filter(|s| !s.is_empty())
+            .collect(),
+    )
+}
+
+/// The source of register_{fwd,bwd}_launchers, that call the registration functions of the
+/// compiled hidden sizes.
+fn registry_source(
+    fwd_sizes: &[usize],
+    bwd_sizes: &[usize],
+    dtypes: &[&str],
+    defines: &[String],
+) -> String {
+    let mut src = String::from("// Generated by build.rs, do not edit.\n");
+    src.push_str(&format!("// Input dtypes: {}\n", dtypes.join(",")));
+    src.push_str(&format!("// Defines: {}\n", defines.join(" ")));
+    src.push_str("#include \"ln.h\"\n\nnamespace layer_norm {\n\n");
+    for (kind, registry, sizes) in [
+        ("fwd", "FwdRegistry", fwd_sizes),
+        ("bwd", "BwdRegistry", bwd_sizes),
+    ] {
+        for size in sizes {
+            src.push_str(&format!(
+                "void register_{kind}_{size}({registry} &registry);\n"
+            ));
+        }
+        src.push_str(&format!(
+            "\nvoid register_{kind}_launchers({registry} &registry) {{\n"
+        ));
+        for size in sizes {
+            src.push_str(&format!("    register_{kind}_{size}(registry);\n"));
+        }
+        src.push_str("}\n\n");
+    }
+    src.push_str("}  // namespace layer_norm\n");
+    src
+}
 
 fn main() -> Result<()> {
     let num_cpus = std::env::var("RAYON_NUM_THREADS").map_or_else(
@@ -25,7 +98,9 @@ fn main() -> Result<()> {
         println!("cargo:rerun-if-changed=kernels/{kernel_file}");
     }
     println!("cargo:rerun-if-changed=kernels/**.cu");
+    println!("cargo:rerun-if-changed=kernels");
     println!("cargo:rerun-if-changed=kernels/ln_fwd_kernels.cuh");
+    println!("cargo:rerun-if-changed=kernels/ln_bwd_kernels.cuh");
     println!("cargo:rerun-if-changed=kernels/ln_kernel_traits.h");
     println!("cargo:rerun-if-changed=kernels/ln_utils.cuh");
     println!("cargo:rerun-if-changed=kernels/static_switch.h");
@@ -50,7 +125,20 @@ fn main() -> Result<()> {
     let ccbin_env = std::env::var("NVCC_CCBIN");
     println!("cargo:rerun-if-env-changed=NVCC_CCBIN");
 
-    let compute_cap = compute_cap()?;
+    // One cubin per compute cap, plus the PTX of the highest one for newer GPUs. The launchers
+    // tuned for a generation are only registered when it is built for, see ln_fwd_<size>.cu.
+    let compute_caps = compute_caps()?;
+    let max_compute_cap = *compute_caps.last().unwrap();
+    let mut arch_args: Vec<String> = compute_caps
+        .iter()
+        .map(|c| format!("--generate-code=arch=compute_{c},code=sm_{c}"))
+        .collect();
+    arch_args.push(format!(
+        "--generate-code=arch=compute_{max_compute_cap},code=compute_{max_compute_cap}"
+    ));
+    if max_compute_cap >= 90 {
+        arch_args.push("-DLN_BUILD_SM90".to_string());
+    }
 
     let out_file = if cfg!(target_os = "windows") {
         build_dir.join("layernorm.lib")
@@ -59,17 +147,105 @@ fn main() -> Result<()> {
     };
 
     let kernel_dir = PathBuf::from("kernels");
+
+    // Select the hidden sizes and the input dtypes to compile
+    let all_sizes = kernel_sizes(&kernel_dir, "fwd")?;
+    let fwd_sizes = match env_list("CANDLE_LAYER_NORM_HIDDEN_SIZES") {
+        None => all_sizes.clone(),
+        Some(sizes) => {
+            let sizes = sizes
+                .iter()
+                .map(|s| {
+                    s.parse::<usize>()
+                        .with_context(|| format!("invalid hidden size {s}"))
+                })
+                .collect::<Result<Vec<_>>>()?;
+            if let Some(size) = sizes.iter().find(|s| !all_sizes.contains(s)) {
+                anyhow::bail!(
+                    "no kernels for hidden size {size}, the kernel sizes are {all_sizes:?}"
+                )
+            }
+            all_sizes
+                .iter()
+                .copied()
+                .filter(|s| sizes.contains(s))
+                .collect()
+        }
+    };
+    let bwd_sizes: Vec<_> = kernel_sizes(&kernel_dir, "bwd")?
+        .into_iter()
+        .filter(|s| fwd_sizes.contains(s))
+        .collect();
+    let dtypes: Vec<&str> = match env_list("CANDLE_LAYER_NORM_DTYPES") {
+        None => DTYPES.iter().map(|d| d.0).collect(),
+        Some(dtypes) => {
+            if let Some(d) = dtypes
+                .iter()
+                .find(|d| !DTYPES.iter().any(|t| t.0 == d.as_str()))
+            {
+                anyhow::bail!("unsupported dtype {d}, expected f32, f16 or bf16")
+            }
+            DTYPES
+                .iter()
+                .map(|d| d.0)
+                .filter(|d| dtypes.iter().any(|t| t == d))
+                .collect()
+        }
+    };
+    let disabled_dtypes: Vec<_> = DTYPES
+        .iter()
+        .filter(|d| !dtypes.contains(&d.0))
+        .map(|d| format!("-DLN_DISABLE_ITYPE_{}", d.1))
+        .collect();
+    let mut feature_defines = Vec::new();
+    if env::var("CARGO_FEATURE_TELEMETRY").is_ok() {
+        feature_defines.push("-DLN_TELEMETRY".to_string());
+    }
+
+    // The Rust side rejects the launches of kernels that are left out
+    let join = |sizes: &[usize]| {
+        sizes
+            .iter()
+            .map(|s| s.to_string())
+            .collect::<Vec<_>>()
+            .join(",")
+    };
+    println!(
+        "cargo:rustc-env=CANDLE_LAYER_NORM_COMPILED_HIDDEN_SIZES={}",
+        join(&fwd_sizes)
+    );
+    println!(
+        "cargo:rustc-env=CANDLE_LAYER_NORM_COMPILED_DTYPES={}",
+        dtypes.join(",")
+    );
+
+    // The registry is only rewritten when the selection or the features change, which triggers a
+    // rebuild
+    let registry_file = build_dir.join("ln_registry.cu");
+    let registry = registry_source(&fwd_sizes, &bwd_sizes, &dtypes, &feature_defines);
+    let registry_changed = std::fs::read_to_string(&registry_file).map_or(true, |r| r != registry);
+    if registry_changed {
+        std::fs::write(&registry_file, &registry)?;
+    }
+
     let cu_files: Vec<_> = KERNEL_FILES
         .iter()
-        .map(|f| {
-            let mut obj_file = out_dir.join(f);
+        .map(|f| f.to_string())
+        .chain(fwd_sizes.iter().map(|s| format!("ln_fwd_{s}.cu")))
+        .chain(bwd_sizes.iter().map(|s| format!("ln_bwd_{s}.cu")))
+        .map(|f| kernel_dir.join(f))
+        .chain(std::iter::once(registry_file.clone()))
+        .map(|cu_file| {
+            let mut obj_file = out_dir.join(cu_file.file_name().unwrap());
             obj_file.set_extension("o");
-            (kernel_dir.join(f), obj_file)
+            (cu_file, obj_file)
         })
         .collect();
 
     let out_modified: Result<_, _> = out_file.metadata().and_then(|m| m.modified());
-    let should_compile = if out_file.exists() {
+    let should_compile = if registry_changed {
+        true
+    } else if out_file.exists() {
         kernel_dir
             .read_dir()
             .expect("kernels folder should exist")
@@ -103,7 +279,10 @@ fn main() -> Result<()> {
                     .arg("-U__CUDA_NO_BFLOAT16_CONVERSIONS__")
                     .arg("-U__CUDA_NO_BFLOAT162_OPERATORS__")
                     .arg("-U__CUDA_NO_BFLOAT162_CONVERSIONS__")
-                    .arg(format!("--gpu-architecture=sm_{compute_cap}"))
+                    .args(&disabled_dtypes)
+                    .args(&feature_defines)
+                    .arg(format!("-I{}", kernel_dir.display()))
+                    .args(&arch_args)
                     .arg("-c")
                     .args(["-o", obj_file.to_str().unwrap()])
                     .args(["--default-stream", "per-thread"])
@@ -203,18 +382,25 @@ fn set_cuda_include_dir() -> Result<()> {
     Ok(())
 }
 
+/// The compute caps to build for: the comma separated list of CUDA_COMPUTE_CAP (e.g. "80,89,90"),
+/// or the distinct compute caps of the GPUs of the build host.
 #[allow(unused)]
-fn compute_cap() -> Result<usize> {
+fn compute_caps() -> Result<Vec<usize>> {
     println!("cargo:rerun-if-env-changed=CUDA_COMPUTE_CAP");
 
+    let parse_cap = |cap: &str| {
+        let cap = cap.trim().replace('.', "");
+        cap.parse::<usize>()
+            .with_context(|| format!("cannot parse as int {cap}"))
+    };
     // Try to parse compute caps from env
-    let mut compute_cap = if let Ok(compute_cap_str) = std::env::var("CUDA_COMPUTE_CAP") {
-        println!("cargo:rustc-env=CUDA_COMPUTE_CAP={compute_cap_str}");
+    let mut compute_caps = if let Ok(compute_cap_str) = std::env::var("CUDA_COMPUTE_CAP") {
         compute_cap_str
-            .parse::<usize>()
-            .context("Could not parse code")?
+            .split(',')
+            .map(parse_cap)
+            .collect::<Result<Vec<_>>>()?
     } else {
-        // Use nvidia-smi to get the current compute cap
+        // Use nvidia-smi to get the compute caps of the GPUs of this host
         let out = std::process::Command::new("nvidia-smi")
             .arg("--query-gpu=compute_cap")
             .arg("--format=csv")
@@ -226,16 +412,20 @@ fn compute_cap() -> Result<usize> {
             lines.next().context("missing line in stdout")?,
             "compute_cap"
         );
-        let cap = lines
-            .next()
-            .context("missing line in stdout")?
-            .replace('.', "");
-        let cap = cap
-            .parse::<usize>()
-            .with_context(|| format!("cannot parse as int {cap}"))?;
-        println!("cargo:rustc-env=CUDA_COMPUTE_CAP={cap}");
-        cap
+        let caps = lines.map(parse_cap).collect::<Result<Vec<_>>>()?;
+        if caps.is_empty() {
+            anyhow::bail!("missing line in stdout")
+        }
+        caps
     };
+    compute_caps.sort();
+    compute_caps.dedup();
+    let caps_str = compute_caps
+        .iter()
+        .map(|c| c.to_string())
+        .collect::<Vec<_>>()
+        .join(",");
+    println!("cargo:rustc-env=CUDA_COMPUTE_CAP={caps_str}");
 
     // Grab available GPU codes from nvcc and select the highest one
     let (supported_nvcc_codes, max_nvcc_code) = {
@@ -260,17 +450,19 @@ fn compute_cap() -> Result<usize> {
         (codes, max_nvcc_code)
     };
 
-    // Check that nvcc supports the asked compute cap
-    if !supported_nvcc_codes.contains(&compute_cap) {
-        anyhow::bail!(
-            "nvcc cannot target gpu arch {compute_cap}. Available nvcc targets are {supported_nvcc_codes:?}."
-        );
-    }
-    if compute_cap > max_nvcc_code {
-        anyhow::bail!(
-            "CUDA compute cap {compute_cap} is higher than the highest gpu code from nvcc {max_nvcc_code}"
-        );
+    // Check that nvcc supports the asked compute caps
+    for &compute_cap in compute_caps.iter() {
+        if !supported_nvcc_codes.contains(&compute_cap) {
+            anyhow::bail!(
+                "nvcc cannot target gpu arch {compute_cap}. Available nvcc targets are {supported_nvcc_codes:?}."
+            );
+        }
+        if compute_cap > max_nvcc_code {
+            anyhow::bail!(
+                "CUDA compute cap {compute_cap} is higher than the highest gpu code from nvcc {max_nvcc_code}"
+            );
+        }
     }
 
-    Ok(compute_cap)
+    Ok(compute_caps)
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <unordered_map>
+#include <vector>
 #include <cuda_fp16.h>
 #include <cuda_bf16.h>
+#include <cuda_fp8.h>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -18,6 +21,8 @@ namespace layer_norm {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+struct FwdGroupParams;
+
 template<typename Params>
 struct LaunchParams{
 
@@ -27,12 +32,68 @@ struct LaunchParams{
 
     int multi_processor_count;
 
+    // Grid of the persistent forward kernel, 0 if the specialization has none.
+    int persistent_ctas = 0;
+
+    // Grid of the last forward launch, set by the launchers.
+    int grid_ctas = 0;
+
+    // Status of the last forward launch, set by the launchers, e.g. the error of a cooperative grid
+    // that does not fit on the device.
+    cudaError_t status = cudaSuccess;
+
     cudaStream_t stream;
 
     Params params;
 
+    // Grouped forward launches only. params is then the first tensor of the group and only
+    // selects the configuration, params.ctas_per_col is the CTA budget per tensor.
+    const FwdGroupParams *group = nullptr;
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The result of the configure pass of a launcher. It only depends on the kernel specialization
+// and on the device, so it is computed once and reused for every subsequent launch.
+struct LaunchPlan {
+    int ctas_per_col;
+    size_t workspace_bytes;
+    size_t barrier_size;
+    int multi_processor_count;
+    int persistent_ctas;
+};
+
+// A plan of a launch plan table, null until the first launch of its specialization. The slots are
+// written once and only loaded afterwards, see configure_launch.
+using PlanSlot = std::atomic<const LaunchPlan *>;
+
+struct PlanKey {
+    // The launcher key, see Types2Key.
+    uint64_t launcher_key;
+    // Bitmask of the BOOL_SWITCH specializations selected at launch time.
+    uint32_t flags;
+    int device;
+    // LaunchShape::packed() of the launcher, a key can have several of them.
+    uint32_t shape;
+
+    bool operator==(const PlanKey &other) const {
+        return launcher_key == other.launcher_key && flags == other.flags && device == other.device
+            && shape == other.shape;
+    }
 };
 
+struct PlanKeyHash {
+    size_t operator()(const PlanKey &key) const {
+        // The type key only uses 11 bits above the hidden size, the upper bits are free.
+        return key.launcher_key ^ (uint64_t(key.flags) << 44) ^ (uint64_t(key.device) << 56)
+            ^ (uint64_t(key.shape) * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+template<typename Value = LaunchPlan>
+using PlanCache = std::unordered_map<PlanKey, Value, PlanKeyHash>;
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 struct ParamsBase {
@@ -66,6 +127,7 @@ struct ParamsBase {
     void *x0;
     void *x1;
     void *residual;
+    // May alias residual: every thread loads its residual elements before storing the sum.
     void *x;
     void *dmask;
     void *dmask1;
@@ -104,6 +166,28 @@ struct FwdParams : public ParamsBase {
         , beta(nullptr)
         , beta1(nullptr)
         , epsilon(0.f)
+        , z_scale(nullptr)
+        , quant_scale(nullptr)
+        , x0_row_stride(0)
+        , residual_row_stride(0)
+        , x_row_stride(0)
+        , z_row_stride(0)
+        , heads(1)
+        , x0_head_stride(0)
+        , residual_head_stride(0)
+        , x_head_stride(0)
+        , z_head_stride(0)
+        , rope_cos(nullptr)
+        , rope_sin(nullptr)
+        , rope_pos(nullptr)
+        , rope_interleaved(false)
+        , philox_seed(0)
+        , philox_offset(0)
+        , x0_bias(nullptr)
+        , x0_subset_rows(0)
+        , z_subset_rows(0)
+        , rows_ptr(nullptr)
+        , work_counter(nullptr)
     {
     }
 
@@ -114,23 +198,165 @@ struct FwdParams : public ParamsBase {
     void *beta1;
     float epsilon;
 
-    // Random state.
-    // at::PhiloxCudaState philox_args;
+    // Quantized outputs only: z = quantize(ln(x) / scale). With z_scale, the scale is computed per
+    // row from the absolute maximum and written out, otherwise it is read from quant_scale[0].
+    float *z_scale;
+    const float *quant_scale;
+
+    // Distance in elements between consecutive rows of x0, residual, x and z. They must be
+    // multiples of the elements per load, rows of x may alias residual in place.
+    int x0_row_stride;
+    int residual_row_stride;
+    int x_row_stride;
+    int z_row_stride;
+
+    // Per-head layouts: the rows are tokens * heads and row r starts at
+    // (r / heads) * row_stride + (r % heads) * head_stride, so the row strides are token strides.
+    int heads;
+    int x0_head_stride;
+    int residual_head_stride;
+    int x_head_stride;
+    int z_head_stride;
+
+    // Rotary embedding of z over the whole row, when rope_cos is set. The caches hold cols / 2
+    // frequencies per position, in the input type, and token r / heads is at position
+    // rope_pos[r / heads], or at its index without rope_pos. Pairs are (2i, 2i + 1) when
+    // interleaved, (i, i + cols / 2) otherwise.
+    const void *rope_cos;
+    const void *rope_sin;
+    const uint32_t *rope_pos;
+    bool rope_interleaved;
+
+    // Dropout of x0 when dropout_keep_p < 1, from a Philox generator keyed by the seed and counting
+    // from the offset in 4-element groups of the dense [rows, cols] index. The keep bits are written
+    // to dmask when set, bit-packed in 32-bit words.
+    uint64_t philox_seed;
+    uint64_t philox_offset;
+
+    // Per-column bias of x0 in the weight type, e.g. the bias of the projection that produced x0.
+    // x0 + x0_bias takes the place of x0 in the row scale, dropout and residual add.
+    void *x0_bias;
+
+    // Row subsets only: the rows of x0 and z. Indices beyond them skip the row like 0 does, which
+    // keeps the bounds check on the device.
+    int x0_subset_rows;
+    int z_subset_rows;
+
+    // Graph-safe launches: the number of rows is read from the device, and rows is the largest
+    // one that the grid is sized for. A captured launch then serves every row count up to rows.
+    const uint32_t *rows_ptr;
+
+    // Two zero-initialized counters in gmem for the persistent kernel: the next block of rows and
+    // the CTAs that are done. The last CTA resets both, so they are zero again after a launch.
+    int *work_counter;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The descriptors of a grouped forward launch, passed by value as kernel arguments which bounds
+// the number of tensors per launch.
+constexpr int MAX_GROUPED_TENSORS = 8;
+
+struct FwdGroupParams {
+    int num_tensors;
+    // First CTA of each tensor, the last entry is the grid size.
+    int cta_offsets[MAX_GROUPED_TENSORS + 1];
+    FwdParams tensors[MAX_GROUPED_TENSORS];
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-using FwdFunction = std::function<void(LaunchParams<FwdParams>&, const bool)>;
+struct BwdParams : public ParamsBase {
+    BwdParams()
+        : ParamsBase()
+        , dz(nullptr)
+        , dx(nullptr)
+        , dbeta_part(nullptr)
+        , dgamma_part(nullptr)
+        , dx0(nullptr)
+        , dresidual(nullptr)
+        , dbeta(nullptr)
+        , dgamma(nullptr)
+    {
+    }
+
+    // Input: gradient wrt. LN FWD output.
+    void *dz;
+    // Input: gradient wrt. the residual sum output (pre-norm), optional.
+    void *dx;
+
+    // Workspace for Wgrad pre-reduction.
+    void *dbeta_part;
+    void *dgamma_part;
+
+    // Output: Dgrad.
+    void *dx0;
+    void *dresidual;
+    // Output: Wgrad.
+    void *dbeta;
+    void *dgamma;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The launchers are plain functions, a launch is a single indirect call.
+using FwdFunction = void (*)(LaunchParams<FwdParams>&, const bool);
+using BwdFunction = void (*)(LaunchParams<BwdParams>&, const bool);
 using FunctionKey = uint64_t;
-using FwdRegistry = std::unordered_map<FunctionKey, FwdFunction>;
 
-extern FwdRegistry FWD_FUNCS;
+// The Kernel_traits parameters of a launcher, warps_n is 0 for the sub-warp kernels.
+struct LaunchShape {
+    int ctas_per_row;
+    int warps_m;
+    int warps_n;
+    int bytes_per_ldg;
+
+    uint32_t packed() const {
+        return uint32_t(ctas_per_row) | (uint32_t(warps_m) << 8) | (uint32_t(warps_n) << 16)
+            | (uint32_t(bytes_per_ldg) << 24);
+    }
+
+    bool operator==(const LaunchShape &other) const {
+        return packed() == other.packed();
+    }
+};
+
+// A launch configuration tuned for the devices of compute capability min_sm (major * 10 + minor)
+// and above. A key can have several of them, the default one with the highest min_sm that the
+// device reaches is used. Candidates are only launched when the autotuner picked them.
+template<typename Function>
+struct SmLauncher {
+    int min_sm;
+    Function launcher;
+    LaunchShape shape;
+    bool candidate;
+};
+
+using FwdRegistry = std::unordered_map<FunctionKey, std::vector<SmLauncher<FwdFunction>>>;
+using BwdRegistry = std::unordered_map<FunctionKey, std::vector<SmLauncher<BwdFunction>>>;
+
+// Each ln_{fwd,bwd}_<hidden size>.cu defines a register_{fwd,bwd}_<hidden size> function, and the
+// ln_registry.cu generated by build.rs calls those of the hidden sizes selected for the build. The
+// registries are filled on the first lookup.
+void register_fwd_launchers(FwdRegistry &registry);
+void register_bwd_launchers(BwdRegistry &registry);
+
+uint64_t get_key(uint32_t wtype, uint32_t itype, uint32_t rtype, uint32_t otype, uint32_t ctype, uint64_t hidden_size);
+
+// Forward launch shapes picked by the autotuner, per device model, launcher key, specialization
+// flags and power of two bucket of rows, see ln_autotune.cu.
+uint32_t rows_bucket(uint32_t rows);
+bool autotune_enabled();
+bool find_tuned_shape(int device, uint64_t launcher_key, uint32_t flags, uint32_t rows, LaunchShape &shape);
+void store_tuned_shape(int device, uint64_t launcher_key, uint32_t flags, uint32_t rows, const LaunchShape &shape);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 using fp32 = float;
 using fp16 = half;
 using bf16 = nv_bfloat16;
+using fp8e4m3 = __nv_fp8_e4m3;
+using int8 = int8_t;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -152,6 +378,17 @@ struct TypeId<fp32>{
     constexpr static uint32_t Value = 2;
 };
 
+// Output only types, the output key is 3 bits wide.
+template<>
+struct TypeId<fp8e4m3>{
+    constexpr static uint32_t Value = 3;
+};
+
+template<>
+struct TypeId<int8>{
+    constexpr static uint32_t Value = 4;
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename T, int S>
@@ -174,7 +411,7 @@ template<typename T>
 struct OutputType2Key : public Type2Key<T, 6>{};
 
 template<typename T>
-struct ComputeType2Key : public Type2Key<T, 8>{};
+struct ComputeType2Key : public Type2Key<T, 9>{};
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -189,14 +426,4 @@ struct Types2Key{
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<typename W, typename I, typename R, typename O, typename C, uint64_t HIDDEN_SIZE>
-struct FwdRegistrar{
-    FwdRegistrar(FwdFunction f){
-        uint64_t key = Types2Key<W,I,R,O,C>::get(HIDDEN_SIZE);
-        FWD_FUNCS.insert({ key, f });
-    }
-};
-
-////////////////////////////////////////////////////////////////////////////////////////////////////
-
 }  // namespace layer_norm
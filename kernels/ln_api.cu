@@ -1,200 +1,308 @@
+#include <memory>
+
 #include "ln.h"
 #include "ln_fwd_kernels.cuh"
 
-/*
-Ada
+#ifdef LN_TELEMETRY
+#include <atomic>
+#include <chrono>
+#include <nvtx3/nvToolsExt.h>
+#endif
 
-Supported Type combinations:
+/*
+Supported Type combinations, the FWD_DTYPES of lib.rs:
 
 input  residual   compute   weights   output
 ============================================
 fp32     fp32      fp32      fp32      fp32
+fp32     fp32      fp32      fp16      fp32
 fp16     fp32      fp32      fp32      fp16
+fp16     fp32      fp32      fp16      fp16
 fp16     fp16      fp32      fp32      fp16
 bf16     fp32      fp32      fp32      bf16
+bf16     fp32      fp32      bf16      bf16
 bf16     bf16      fp32      fp32      bf16
 fp16     fp16      fp32      fp16      fp16
 bf16     bf16      fp32      bf16      bf16
+fp16     fp16      fp32      fp16      fp8e4m3, int8
+bf16     bf16      fp32      bf16      fp8e4m3, int8
 
 Remarks:
-Output type = Input type
-Compute always in FP32
+Output type = Input type, or the quantized fp8e4m3 and int8 outputs of the uniform fp16 and bf16 rows
+Compute in FP32, or for the uniform fp16 and bf16 rows of hidden sizes 4096 to 8192 optionally in
+packed pairs of the 16-bit type with the reductions in FP32, see Kernel_traits_packed
 
 */
 
 namespace layer_norm {
 
-FwdRegistry FWD_FUNCS;
-
 uint64_t get_key(uint32_t wtype, uint32_t itype, uint32_t rtype, uint32_t otype, uint32_t ctype, uint64_t hidden_size) {
     using namespace layer_norm;
-    uint64_t type_key = wtype | (itype << 2) | (rtype << 4) | (otype << 6) | (ctype << 8);
+    uint64_t type_key = wtype | (itype << 2) | (rtype << 4) | (otype << 6) | (ctype << 9);
     uint64_t launcher_key = (type_key << 32) | hidden_size;
     return launcher_key;
 }
 
 }
 
-layer_norm::FwdFunction & get_fwd_launcher(uint32_t wtype, uint32_t itype, uint32_t rtype, uint32_t otype, uint32_t ctype, uint32_t hidden_size) {
-    auto iter = layer_norm::FWD_FUNCS.find(layer_norm::get_key(wtype, itype, rtype, otype, ctype, hidden_size));
-    return iter->second;
+using FwdEntry = layer_norm::SmLauncher<layer_norm::FwdFunction>;
+
+layer_norm::FwdRegistry & fwd_registry() {
+    static layer_norm::FwdRegistry funcs = [] {
+        layer_norm::FwdRegistry funcs;
+        layer_norm::register_fwd_launchers(funcs);
+        return funcs;
+    }();
+    return funcs;
+}
+
+// A launcher of a key and its launch plans on the device of its handle, one per specialization.
+struct FwdLauncher {
+    FwdEntry *entry;
+    layer_norm::PlanSlot plans[1 << FWD_SPECIALIZATION_FLAG_BITS];
+
+    explicit FwdLauncher(FwdEntry *entry) : entry(entry) {
+        for( auto &plan : plans ) {
+            plan.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Number of values of layer_norm::rows_bucket for 32-bit row counts.
+constexpr int FWD_ROWS_BUCKETS = 33;
+
+// The launchers of a key for a device, resolved once by ln_fwd_resolve and passed back to every
+// run_ln. The handles are never freed, like the registry entries they point to.
+struct FwdHandle {
+    uint64_t launcher_key;
+    int device;
+    // The default launcher first, then the other shapes that can run on the device, see
+    // tuned_fwd_launcher.
+    std::vector<std::unique_ptr<FwdLauncher>> launchers;
+    // Index + 1 into launchers of the choice of a (specializations, rows bucket) pair, 0 until its
+    // first launch. Only allocated when there is a choice.
+    std::unique_ptr<std::atomic<uint8_t>[]> choices;
+
+    bool tunable() const { return launchers.size() > 1; }
+};
+
+// The type key only uses 11 bits above the hidden size, the device goes in the upper bits.
+inline uint64_t fwd_handle_key(uint64_t launcher_key, int device) {
+    return launcher_key | (uint64_t(device) << 56);
+}
+
+// Returns the handle of a key for a device, or nullptr when the key is not registered. The handles
+// of every key and device are built on the first call, the map is read-only afterwards so that the
+// launches that resolve their kernel every time do not take a lock.
+FwdHandle *resolve_fwd_handle(uint64_t launcher_key, int device) {
+    static const std::unordered_map<uint64_t, std::unique_ptr<FwdHandle>> handles = [] {
+        std::unordered_map<uint64_t, std::unique_ptr<FwdHandle>> handles;
+        int num_devices;
+        CHECK_CUDA(cudaGetDeviceCount(&num_devices));
+        for( auto &funcs : fwd_registry() ) {
+            for( int it = 0; it < num_devices; it++ ) {
+                // No entry when the key only has candidates, or defaults for newer SMs.
+                auto entry = layer_norm::select_launcher(fwd_registry(), funcs.first, it);
+                if( entry == nullptr ) {
+                    continue;
+                }
+                auto handle = std::make_unique<FwdHandle>();
+                handle->launcher_key = funcs.first;
+                handle->device = it;
+                handle->launchers.push_back(std::make_unique<FwdLauncher>(entry));
+                for( auto other : layer_norm::eligible_launchers(fwd_registry(), funcs.first, it) ) {
+                    if( other != entry ) {
+                        handle->launchers.push_back(std::make_unique<FwdLauncher>(other));
+                    }
+                }
+                if( handle->tunable() ) {
+                    const size_t num_choices = size_t(FWD_ROWS_BUCKETS) << FWD_SPECIALIZATION_FLAG_BITS;
+                    handle->choices.reset(new std::atomic<uint8_t>[num_choices]);
+                    for( size_t choice = 0; choice < num_choices; choice++ ) {
+                        handle->choices[choice].store(0, std::memory_order_relaxed);
+                    }
+                }
+                handles.insert({ fwd_handle_key(funcs.first, it), std::move(handle) });
+            }
+        }
+        return handles;
+    }();
+
+    auto iter = handles.find(fwd_handle_key(launcher_key, device));
+    return iter == handles.end() ? nullptr : iter->second.get();
+}
+
+// Resolves the forward launcher of a kernel for a device. Returns 0 and sets handle on success, 1
+// when the kernel is not compiled in.
+extern "C" int ln_fwd_resolve(
+    uint32_t hidden_size_rounded,
+    int32_t device,
+
+    uint32_t wtype,
+    uint32_t itype,
+    uint32_t rtype,
+    uint32_t otype,
+    uint32_t ctype,
+
+    const void **handle
+) {
+    const uint64_t launcher_key = layer_norm::get_key(wtype, itype, rtype, otype, ctype, hidden_size_rounded);
+    *handle = resolve_fwd_handle(launcher_key, device);
+    return *handle == nullptr ? 1 : 0;
+}
+
+// Average time of a forward launch in ms, after a warm-up launch.
+float time_fwd_launch(FwdLauncher &launcher, layer_norm::LaunchParams<layer_norm::FwdParams> launch_params,
+                      const int device, const uint32_t flags) {
+    constexpr int TUNING_ITERATIONS = 20;
+
+    auto &entry = *launcher.entry;
+    layer_norm::configure_launch(entry.launcher, launch_params, device, launcher.plans[flags]);
+    entry.launcher(launch_params, false);
+
+    cudaEvent_t start, stop;
+    CHECK_CUDA(cudaEventCreate(&start));
+    CHECK_CUDA(cudaEventCreate(&stop));
+    CHECK_CUDA(cudaEventRecord(start, launch_params.stream));
+    for( int it = 0; it < TUNING_ITERATIONS; it++ ) {
+        entry.launcher(launch_params, false);
+    }
+    CHECK_CUDA(cudaEventRecord(stop, launch_params.stream));
+    CHECK_CUDA(cudaEventSynchronize(stop));
+    float ms;
+    CHECK_CUDA(cudaEventElapsedTime(&ms, start, stop));
+    CHECK_CUDA(cudaEventDestroy(start));
+    CHECK_CUDA(cudaEventDestroy(stop));
+    return ms / TUNING_ITERATIONS;
+}
+
+// Returns the launcher of the shape tuned for the launch, or the default one. With
+// CANDLE_LAYER_NORM_AUTOTUNE set, the first launch of a (key, specializations, rows bucket) on a
+// device model benchmarks the candidates on the launch buffers and records the fastest. The
+// in-place launches and the ones captured in a graph do not benchmark, running the kernel twice
+// would add the input to the residual twice and the tuning synchronizes the stream. The choices
+// are kept in the handle so that steady-state launches only load one, and the keys with a single
+// launcher for the device skip it. Launches with fewer columns than the hidden size always run the
+// default, the wider candidates would leave the warps past the last column without elements.
+FwdLauncher & tuned_fwd_launcher(FwdHandle &handle, const layer_norm::LaunchParams<layer_norm::FwdParams> &launch_params,
+                                 const uint32_t flags) {
+    constexpr uint32_t EVEN_COLS_FLAG = 1u << 3;
+    FwdLauncher &default_launcher = *handle.launchers[0];
+    if( !handle.tunable() || (flags & EVEN_COLS_FLAG) == 0 ) {
+        return default_launcher;
+    }
+
+    const auto &params = launch_params.params;
+    auto &slot = handle.choices[(size_t(flags) * FWD_ROWS_BUCKETS) + layer_norm::rows_bucket(params.rows)];
+    const uint8_t chosen = slot.load(std::memory_order_acquire);
+    if( chosen != 0 ) {
+        return *handle.launchers[chosen - 1];
+    }
+
+    // Only the first launches of a pair get here, they tune one at a time.
+    static std::mutex tuning_mutex;
+    std::lock_guard<std::mutex> lock(tuning_mutex);
+    const uint8_t tuned = slot.load(std::memory_order_acquire);
+    if( tuned != 0 ) {
+        return *handle.launchers[tuned - 1];
+    }
+
+    size_t choice = 0;
+    layer_norm::LaunchShape shape;
+    if( layer_norm::find_tuned_shape(handle.device, handle.launcher_key, flags, params.rows, shape) ) {
+        // Shapes of the tuning cache that are not compiled anymore fall back to the default.
+        for( size_t it = 0; it < handle.launchers.size(); it++ ) {
+            if( handle.launchers[it]->entry->shape == shape ) {
+                choice = it;
+            }
+        }
+    } else if( layer_norm::autotune_enabled() ) {
+        cudaStreamCaptureStatus capture_status;
+        CHECK_CUDA(cudaStreamIsCapturing(launch_params.stream, &capture_status));
+        const bool in_place = params.residual != nullptr && params.residual == params.x;
+        if( in_place || capture_status != cudaStreamCaptureStatusNone ) {
+            // A later launch of the same bucket can still tune.
+            return default_launcher;
+        }
+
+        float best_ms = time_fwd_launch(default_launcher, launch_params, handle.device, flags);
+        for( size_t it = 1; it < handle.launchers.size(); it++ ) {
+            const float ms = time_fwd_launch(*handle.launchers[it], launch_params, handle.device, flags);
+            if( ms < best_ms ) {
+                choice = it;
+                best_ms = ms;
+            }
+        }
+        layer_norm::store_tuned_shape(handle.device, handle.launcher_key, flags, params.rows,
+                                      handle.launchers[choice]->entry->shape);
+    }
+    slot.store(uint8_t(choice + 1), std::memory_order_release);
+    return *handle.launchers[choice];
+}
+
+#ifdef LN_TELEMETRY
+
+// Counters of the forward launches of run_ln since the start of the process or the last reset.
+struct FwdTelemetry {
+    std::atomic<uint64_t> calls{ 0 };
+    std::atomic<uint64_t> dispatch_ns{ 0 };
+    std::atomic<uint64_t> ctas{ 0 };
+    std::atomic<uint64_t> last_ctas{ 0 };
+};
+
+FwdTelemetry &fwd_telemetry() {
+    static FwdTelemetry telemetry;
+    return telemetry;
+}
+
+// Tags a forward launch with an NVTX range, so that its kernel can be attributed in a profile,
+// and adds its host time and its grid to the counters.
+struct FwdTelemetryScope {
+    std::chrono::steady_clock::time_point start;
+    int grid_ctas = 0;
+
+    FwdTelemetryScope(const uint64_t launcher_key, const uint32_t rows, const bool is_rms_norm, const bool has_residual)
+        : start(std::chrono::steady_clock::now()) {
+        char message[96];
+        snprintf(message, sizeof(message), "ln_fwd %s%s hidden=%u types=%llx rows=%u", is_rms_norm ? "rms" : "ln",
+                 has_residual ? "+residual" : "", uint32_t(launcher_key), (unsigned long long)(launcher_key >> 32), rows);
+        nvtxRangePushA(message);
+    }
+
+    ~FwdTelemetryScope() {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        auto &telemetry = fwd_telemetry();
+        telemetry.calls.fetch_add(1, std::memory_order_relaxed);
+        telemetry.dispatch_ns.fetch_add(uint64_t(ns), std::memory_order_relaxed);
+        telemetry.ctas.fetch_add(uint64_t(grid_ctas), std::memory_order_relaxed);
+        telemetry.last_ctas.store(uint64_t(grid_ctas), std::memory_order_relaxed);
+        nvtxRangePop();
+    }
+};
+
+#define LN_FWD_TELEMETRY_SCOPE(launcher_key, rows, is_rms_norm, has_residual) \
+    FwdTelemetryScope telemetry_scope(launcher_key, rows, is_rms_norm, has_residual)
+#define LN_FWD_TELEMETRY_GRID(ctas) telemetry_scope.grid_ctas = (ctas)
+
+// Copies the counters to values, in the order calls, dispatch_ns, ctas and last_ctas, and resets
+// them if reset is set.
+extern "C" void ln_fwd_telemetry(uint64_t *values, int reset) {
+    auto &telemetry = fwd_telemetry();
+    std::atomic<uint64_t> *counters[] = { &telemetry.calls, &telemetry.dispatch_ns, &telemetry.ctas, &telemetry.last_ctas };
+    for( int it = 0; it < 4; it++ ) {
+        values[it] = reset ? counters[it]->exchange(0, std::memory_order_relaxed) : counters[it]->load(std::memory_order_relaxed);
+    }
 }
 
-REGISTER_FWD_LAUNCHER(  256, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  256, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER(  512, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  512, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER(  768, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER(  768, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 1024, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1024, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 1280, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1280, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 1536, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 1536, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 2048, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 2560, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
-REGISTER_FWD_LAUNCHER( 2560, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
-
-REGISTER_FWD_LAUNCHER( 3072, fp32, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp16, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 3072, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-
-REGISTER_FWD_LAUNCHER( 4096, fp32, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp16, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-
-REGISTER_FWD_LAUNCHER( 5120, fp32, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp16, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-
-REGISTER_FWD_LAUNCHER( 6144, fp32, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp16, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp32, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp16, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp32, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp32, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, bf16, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp32, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, fp16, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 6144, bf16, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
-
-REGISTER_FWD_LAUNCHER( 7168, fp32, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp16, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
-REGISTER_FWD_LAUNCHER( 7168, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
-
-REGISTER_FWD_LAUNCHER( 8192, fp32, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp16, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp32, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp32, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp32, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp32, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
-REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
-
-extern "C" void run_ln(
+#else
+
+#define LN_FWD_TELEMETRY_SCOPE(launcher_key, rows, is_rms_norm, has_residual)
+#define LN_FWD_TELEMETRY_GRID(ctas)
+
+#endif
+
+// Returns 0 on success or the CUDA error of the launch.
+extern "C" int run_ln(
     void *x,
     void *residual,
     void *gamma,
@@ -203,36 +311,72 @@ extern "C" void run_ln(
     void *dst,
     void *mu,
     void *rsigma,
+    float *z_scale,
+    const float *quant_scale,
+    void *workspace,
+    int *barrier,
+    int *work_counter,
 
     float epsilon,
 
     uint32_t hidden_size_rounded,
     uint32_t rows,
     uint32_t cols,
-    int32_t multi_processor_count,
-
-    uint32_t wtype,
-    uint32_t itype,
-    uint32_t rtype,
-    uint32_t otype,
-    uint32_t ctype,
+    uint32_t x_row_stride,
+    uint32_t residual_row_stride,
+    uint32_t dst_add_row_stride,
+    uint32_t dst_row_stride,
+    uint32_t heads,
+    uint32_t x_head_stride,
+    uint32_t residual_head_stride,
+    uint32_t dst_add_head_stride,
+    uint32_t dst_head_stride,
+    const void *rope_cos,
+    const void *rope_sin,
+    const uint32_t *rope_pos,
+    int rope_interleaved,
+    void *dmask,
+    float dropout_p,
+    uint64_t philox_seed,
+    uint64_t philox_offset,
+    const void *rowscale,
+    const void *colscale,
+    const uint32_t *x0_subset,
+    const uint32_t *z_subset,
+    uint32_t x0_subset_rows,
+    uint32_t z_subset_rows,
+    float rowscale_const,
+    const void *x0_bias,
+    const uint32_t *rows_ptr,
+    int32_t device,
+
+    cudaStream_t stream,
+
+    // See ln_fwd_resolve.
+    const void *fwd_handle,
 
     int is_rms_norm
 ) {
     layer_norm::LaunchParams<layer_norm::FwdParams> launch_params;
 
-    launch_params.multi_processor_count = multi_processor_count;
-    launch_params.stream = 0;
+    launch_params.stream = stream;
 
-    launch_params.params.dropout_keep_p = 1.f;
+    launch_params.params.dropout_keep_p = 1.f - dropout_p;
     launch_params.params.residual = residual;
-    launch_params.params.rowscale = nullptr;
-    launch_params.params.colscale = nullptr;
-    launch_params.params.x0_subset = nullptr;
-    launch_params.params.z_subset = nullptr;
-
-    // Request the kernel launcher.
-    auto launcher = get_fwd_launcher(wtype, itype, rtype, otype, ctype, hidden_size_rounded);
+    // Row subsets are 1-based indices into x and z, 0 or an index beyond the rows of x or z skips
+    // the load or the store of a row, and replace the per-row scales by rowscale_const.
+    launch_params.params.rowscale = const_cast<void *>(rowscale);
+    launch_params.params.colscale = const_cast<void *>(colscale);
+    launch_params.params.x0_subset = const_cast<uint32_t *>(x0_subset);
+    launch_params.params.z_subset = const_cast<uint32_t *>(z_subset);
+    launch_params.params.x0_subset_rows = x0_subset_rows;
+    launch_params.params.z_subset_rows = z_subset_rows;
+    launch_params.params.x0_bias = const_cast<void *>(x0_bias);
+    launch_params.params.rows_ptr = rows_ptr;
+
+    // The kernel launcher was resolved by the caller.
+    FwdHandle &handle = *static_cast<FwdHandle *>(const_cast<void *>(fwd_handle));
+    LN_FWD_TELEMETRY_SCOPE(handle.launcher_key, rows, is_rms_norm, residual != nullptr);
 
     // Set the kernel runtime parameters.
     layer_norm::FwdParams &params = launch_params.params;
@@ -241,21 +385,142 @@ extern "C" void run_ln(
     params.cols = cols;
     params.x0 = x;
     params.x = dst_add;
-    params.dmask = nullptr;
+    params.dmask = dmask;
     params.mu = mu;
     params.rs = rsigma;
     params.gamma = gamma;
     params.beta = beta;
     params.z = dst;
     params.epsilon = epsilon;
-    params.dropout_scale = 1.f;
+    params.dropout_scale = 1.f / params.dropout_keep_p;
+    params.philox_seed = philox_seed;
+    params.philox_offset = philox_offset;
     params.inverse_cols = 1.f / float(params.cols);
-    params.rowscale_const = 1.f;
+    params.rowscale_const = rowscale_const;
     params.is_rms_norm = is_rms_norm;
-
-    // Query the kernel-specific launch parameters.
-    launcher(launch_params, true);
+    params.workspace = workspace;
+    params.barrier = barrier;
+    params.work_counter = work_counter;
+    params.z_scale = z_scale;
+    params.quant_scale = quant_scale;
+    params.x0_row_stride = x_row_stride;
+    params.residual_row_stride = residual_row_stride;
+    params.x_row_stride = dst_add_row_stride;
+    params.z_row_stride = dst_row_stride;
+    params.heads = heads;
+    params.x0_head_stride = x_head_stride;
+    params.residual_head_stride = residual_head_stride;
+    params.x_head_stride = dst_add_head_stride;
+    params.z_head_stride = dst_head_stride;
+    params.rope_cos = rope_cos;
+    params.rope_sin = rope_sin;
+    params.rope_pos = rope_pos;
+    params.rope_interleaved = rope_interleaved;
+
+    // Pick the launch shape, then query the kernel-specific launch parameters or reuse the ones of
+    // the handle.
+    const uint32_t flags = fwd_specialization_flags(params, hidden_size_rounded);
+    auto &launcher = tuned_fwd_launcher(handle, launch_params, flags);
+    layer_norm::configure_launch(launcher.entry->launcher, launch_params, handle.device, launcher.plans[flags]);
 
     // Launch the kernel.
-    launcher(launch_params, false);
-}
\ No newline at end of file
+    launcher.entry->launcher(launch_params, false);
+    LN_FWD_TELEMETRY_GRID(launch_params.grid_ctas);
+    return launch_params.status;
+}
+
+// Normalizes several independent tensors with one launch per MAX_GROUPED_TENSORS tensors. The
+// arrays are host arrays with one entry per tensor, all tensors share the data types and run the
+// kernel of hidden_size_rounded, that must be at least the largest number of columns. The
+// statistics are not saved. Returns 0 on success, 1 when the kernel is not compiled in.
+extern "C" int run_ln_grouped(
+    uint32_t num_tensors,
+
+    void *const *x,
+    void *const *residual,
+    void *const *gamma,
+    void *const *beta,
+    void *const *dst_add,
+    void *const *dst,
+
+    const float *epsilon,
+
+    const uint32_t *rows,
+    const uint32_t *cols,
+    const uint32_t *x_row_stride,
+    const uint32_t *residual_row_stride,
+    const int *is_rms_norm,
+
+    uint32_t hidden_size_rounded,
+    int32_t device,
+
+    cudaStream_t stream,
+
+    uint32_t wtype,
+    uint32_t itype,
+    uint32_t rtype,
+    uint32_t otype,
+    uint32_t ctype
+) {
+    // Request the kernel launcher.
+    const uint64_t launcher_key = layer_norm::get_key(wtype, itype, rtype, otype, ctype, hidden_size_rounded);
+    // Grouped launches are not tuned, the tensors have different numbers of rows.
+    auto handle = resolve_fwd_handle(launcher_key, device);
+    if( handle == nullptr ) {
+        return 1;
+    }
+    auto &launcher = *handle->launchers[0];
+
+    for( uint32_t first = 0; first < num_tensors; first += layer_norm::MAX_GROUPED_TENSORS ) {
+        layer_norm::FwdGroupParams group;
+        group.num_tensors = std::min<uint32_t>(num_tensors - first, layer_norm::MAX_GROUPED_TENSORS);
+
+        // Set the kernel runtime parameters of every tensor.
+        for( int it = 0; it < group.num_tensors; it++ ) {
+            const uint32_t t = first + it;
+            layer_norm::FwdParams &params = group.tensors[it];
+
+            params.dropout_keep_p = 1.f;
+            params.residual = residual[t];
+            params.rowscale = nullptr;
+            params.colscale = nullptr;
+            params.x0_subset = nullptr;
+            params.z_subset = nullptr;
+            params.x0_bias = nullptr;
+            params.rows_ptr = nullptr;
+
+            params.rows = rows[t];
+            params.cols = cols[t];
+            params.x0 = x[t];
+            params.x = dst_add[t];
+            params.dmask = nullptr;
+            params.mu = nullptr;
+            params.rs = nullptr;
+            params.gamma = gamma[t];
+            params.beta = beta[t];
+            params.z = dst[t];
+            params.epsilon = epsilon[t];
+            params.dropout_scale = 1.f;
+            params.inverse_cols = 1.f / float(params.cols);
+            params.rowscale_const = 1.f;
+            params.is_rms_norm = is_rms_norm[t];
+            params.x0_row_stride = x_row_stride[t];
+            params.residual_row_stride = residual_row_stride[t];
+            params.x_row_stride = cols[t];
+            params.z_row_stride = cols[t];
+        }
+
+        layer_norm::LaunchParams<layer_norm::FwdParams> launch_params;
+        launch_params.stream = stream;
+        launch_params.params = group.tensors[0];
+
+        // The CTA budget per tensor is the one of an ungrouped launch.
+        const uint32_t flags = fwd_specialization_flags(launch_params.params, hidden_size_rounded);
+        layer_norm::configure_launch(launcher.entry->launcher, launch_params, device, launcher.plans[flags]);
+
+        // Launch the kernel.
+        launch_params.group = &group;
+        launcher.entry->launcher(launch_params, false);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "ln.h"
+#include "ln_utils.cuh"
+
+/*
+The forward launch shapes picked by the autotuner of ln_api.cu.
+
+CANDLE_LAYER_NORM_AUTOTUNE=1 enables the benchmarks. CANDLE_LAYER_NORM_TUNING_CACHE names a text
+file that is loaded on the first lookup and that every new choice is appended to, so that a
+restarted process, or another host with the same GPU model, reuses them. The lines are
+
+    <device name> <launcher key> <flags> <rows bucket> <ctas per row> <warps m> <warps n> <bytes per ldg>
+
+with the spaces of the device name replaced by underscores and the key and flags in hex. A later
+line overrides an earlier one of the same key.
+*/
+
+namespace layer_norm {
+
+namespace {
+
+struct TuningCache {
+    std::mutex mutex;
+    bool loaded = false;
+    std::string path;
+    std::unordered_map<std::string, LaunchShape> shapes;
+};
+
+TuningCache &tuning_cache() {
+    static TuningCache cache;
+    return cache;
+}
+
+std::string device_name(const int device) {
+    static std::unordered_map<int, std::string> names;
+    auto iter = names.find(device);
+    if( iter == names.end() ) {
+        cudaDeviceProp props;
+        CHECK_CUDA(cudaGetDeviceProperties(&props, device));
+        std::string name = props.name;
+        for( auto &c : name ) {
+            if( c == ' ' ) {
+                c = '_';
+            }
+        }
+        iter = names.insert({ device, name }).first;
+    }
+    return iter->second;
+}
+
+std::string tuning_key(const std::string &name, const uint64_t launcher_key, const uint32_t flags, const uint32_t bucket) {
+    char key[64];
+    snprintf(key, sizeof(key), " %llx %x %u", (unsigned long long)launcher_key, flags, bucket);
+    return name + key;
+}
+
+// Called with the cache mutex held.
+void load_tuning_cache(TuningCache &cache) {
+    cache.loaded = true;
+    const char *path = getenv("CANDLE_LAYER_NORM_TUNING_CACHE");
+    if( path == nullptr || path[0] == '\0' ) {
+        return;
+    }
+    cache.path = path;
+
+    FILE *file = fopen(path, "r");
+    if( file == nullptr ) {
+        return;
+    }
+    char name[256];
+    unsigned long long launcher_key;
+    unsigned int flags;
+    unsigned int bucket;
+    LaunchShape shape;
+    while( fscanf(file, "%255s %llx %x %u %d %d %d %d", name, &launcher_key, &flags, &bucket, &shape.ctas_per_row,
+                  &shape.warps_m, &shape.warps_n, &shape.bytes_per_ldg) == 8 ) {
+        cache.shapes[tuning_key(name, launcher_key, flags, bucket)] = shape;
+    }
+    fclose(file);
+}
+
+}  // namespace
+
+// Index of the smallest power of two that is at least rows.
+uint32_t rows_bucket(const uint32_t rows) {
+    uint32_t bucket = 0;
+    while( (uint64_t(1) << bucket) < rows ) {
+        bucket++;
+    }
+    return bucket;
+}
+
+bool autotune_enabled() {
+    static const bool enabled = [] {
+        const char *value = getenv("CANDLE_LAYER_NORM_AUTOTUNE");
+        return value != nullptr && value[0] != '\0' && std::string(value) != "0";
+    }();
+    return enabled;
+}
+
+bool find_tuned_shape(int device, uint64_t launcher_key, uint32_t flags, uint32_t rows, LaunchShape &shape) {
+    auto &cache = tuning_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if( !cache.loaded ) {
+        load_tuning_cache(cache);
+    }
+    auto iter = cache.shapes.find(tuning_key(device_name(device), launcher_key, flags, rows_bucket(rows)));
+    if( iter == cache.shapes.end() ) {
+        return false;
+    }
+    shape = iter->second;
+    return true;
+}
+
+void store_tuned_shape(int device, uint64_t launcher_key, uint32_t flags, uint32_t rows, const LaunchShape &shape) {
+    auto &cache = tuning_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if( !cache.loaded ) {
+        load_tuning_cache(cache);
+    }
+    const std::string name = device_name(device);
+    const uint32_t bucket = rows_bucket(rows);
+    cache.shapes[tuning_key(name, launcher_key, flags, bucket)] = shape;
+    if( cache.path.empty() ) {
+        return;
+    }
+
+    // A cache that cannot be written only costs a new tuning after a restart.
+    FILE *file = fopen(cache.path.c_str(), "a");
+    if( file == nullptr ) {
+        return;
+    }
+    fprintf(file, "%s %llx %x %u %d %d %d %d\n", name.c_str(), (unsigned long long)launcher_key, flags, bucket,
+            shape.ctas_per_row, shape.warps_m, shape.warps_n, shape.bytes_per_ldg);
+    fclose(file);
+}
+
+}  // namespace layer_norm
@@ -0,0 +1,131 @@
+#include "ln.h"
+#include "ln_bwd_kernels.cuh"
+
+/*
+Supported Type combinations: same as the forward pass, see ln_api.cu.
+
+The weight gradients are reduced in two stages: ln_bwd_kernel writes one partial dgamma/dbeta row
+per CTA group (ctas_per_col rows in total) and ln_bwd_finalize_kernel sums them.
+*/
+
+// Returns the launcher of a key with the launch configuration tuned for the device, or nullptr when
+// the key is not registered.
+layer_norm::BwdFunction *get_bwd_launcher(uint64_t launcher_key, int device) {
+    static layer_norm::BwdRegistry funcs = [] {
+        layer_norm::BwdRegistry funcs;
+        layer_norm::register_bwd_launchers(funcs);
+        return funcs;
+    }();
+    auto entry = layer_norm::select_launcher(funcs, launcher_key, device);
+    return entry == nullptr ? nullptr : &entry->launcher;
+}
+
+// Sets ctas_per_col to the number of partial dgamma/dbeta rows that run_ln_bwd writes, so that the
+// caller can allocate the dgamma_part/dbeta_part workspaces with (ctas_per_col, cols) elements.
+// Returns 0 on success, 1 when the kernel is not compiled in.
+extern "C" int run_ln_bwd_ctas_per_col(
+    uint32_t hidden_size_rounded,
+    uint32_t cols,
+    int32_t device,
+
+    uint32_t wtype,
+    uint32_t itype,
+    uint32_t rtype,
+    uint32_t otype,
+    uint32_t ctype,
+
+    uint32_t *ctas_per_col
+) {
+    layer_norm::LaunchParams<layer_norm::BwdParams> launch_params;
+    launch_params.params.cols = cols;
+
+    const uint64_t launcher_key = layer_norm::get_key(wtype, itype, rtype, otype, ctype, hidden_size_rounded);
+    auto launcher = get_bwd_launcher(launcher_key, device);
+    if( launcher == nullptr ) {
+        return 1;
+    }
+
+    const layer_norm::PlanKey plan_key{
+        launcher_key, bwd_specialization_flags(launch_params.params, hidden_size_rounded), device
+    };
+    layer_norm::configure_launch(*launcher, launch_params, plan_key);
+    *ctas_per_col = launch_params.params.ctas_per_col;
+    return 0;
+}
+
+// Returns 0 on success, 1 when the kernel is not compiled in.
+extern "C" int run_ln_bwd(
+    void *dz,
+    void *x,
+    void *dx,
+    void *mu,
+    void *rsigma,
+    void *gamma,
+    void *dx0,
+    void *dresidual,
+    const void *dmask,
+    float dropout_p,
+    void *dgamma,
+    void *dbeta,
+    void *dgamma_part,
+    void *dbeta_part,
+
+    uint32_t hidden_size_rounded,
+    uint32_t rows,
+    uint32_t cols,
+    int32_t device,
+
+    cudaStream_t stream,
+
+    uint32_t wtype,
+    uint32_t itype,
+    uint32_t rtype,
+    uint32_t otype,
+    uint32_t ctype,
+
+    int is_rms_norm
+) {
+    layer_norm::LaunchParams<layer_norm::BwdParams> launch_params;
+
+    launch_params.stream = stream;
+
+    // Request the kernel launcher.
+    const uint64_t launcher_key = layer_norm::get_key(wtype, itype, rtype, otype, ctype, hidden_size_rounded);
+    auto launcher = get_bwd_launcher(launcher_key, device);
+    if( launcher == nullptr ) {
+        return 1;
+    }
+
+    // Set the kernel runtime parameters.
+    layer_norm::BwdParams &params = launch_params.params;
+
+    params.rows = rows;
+    params.cols = cols;
+    params.x = x;
+    params.mu = mu;
+    params.rs = rsigma;
+    params.gamma = gamma;
+    params.dz = dz;
+    params.dx = dx;
+    params.dx0 = dx0;
+    params.dresidual = dresidual;
+    params.dmask = const_cast<void *>(dmask);
+    params.dropout_keep_p = 1.f - dropout_p;
+    params.dropout_scale = 1.f / params.dropout_keep_p;
+    params.dgamma = dgamma;
+    params.dbeta = dbeta;
+    params.dgamma_part = dgamma_part;
+    params.dbeta_part = dbeta_part;
+    params.inverse_cols = 1.f / float(params.cols);
+    params.is_rms_norm = is_rms_norm;
+
+    // Query the kernel-specific launch parameters, or reuse the cached ones.
+    const layer_norm::PlanKey plan_key{
+        launcher_key, bwd_specialization_flags(params, hidden_size_rounded), device
+    };
+    layer_norm::configure_launch(*launcher, launch_params, plan_key);
+
+    // Launch the kernels.
+    (*launcher)(launch_params, false);
+    return 0;
+}
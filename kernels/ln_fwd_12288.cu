@@ -0,0 +1,22 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 12288, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_12288(FwdRegistry &registry) {
+    // Multi-CTA per row: cooperative launches, only for cols == HIDDEN_SIZE.
+    REGISTER_FWD_LAUNCHER(12288, fp32, fp32, fp32, fp32, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp16, fp32, fp32, fp32, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp32, fp16, fp32, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp16, fp16, fp32, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp32, fp16, fp16, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp32, bf16, fp32, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, bf16, bf16, fp32, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp32, bf16, bf16, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, fp16, fp16, fp16, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(12288, bf16, bf16, bf16, bf16, fp32, 2, 1, 4, 16);
+}
+
+}  // namespace layer_norm
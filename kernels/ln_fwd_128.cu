@@ -0,0 +1,22 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 128, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_128(FwdRegistry &registry) {
+    // Per-head sizes: a row is handled by a group of lanes, only for cols == HIDDEN_SIZE.
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp32, fp32, fp32, fp32, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp16, fp32, fp32, fp32, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp32, fp16, fp32, fp16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp16, fp16, fp32, fp16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp32, fp16, fp16, fp16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp32, bf16, fp32, bf16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, bf16, bf16, fp32, bf16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp32, bf16, bf16, bf16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, fp16, fp16, fp16, fp16, fp32, 4, 16);
+    REGISTER_FWD_SUBWARP_LAUNCHER(  128, bf16, bf16, bf16, bf16, fp32, 4, 16);
+}
+
+}  // namespace layer_norm
@@ -0,0 +1,22 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 18432, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_18432(FwdRegistry &registry) {
+    // Multi-CTA per row: cooperative launches, only for cols == HIDDEN_SIZE.
+    REGISTER_FWD_LAUNCHER(18432, fp32, fp32, fp32, fp32, fp32, 4, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp16, fp32, fp32, fp32, fp32, 4, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp32, fp16, fp32, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp16, fp16, fp32, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp32, fp16, fp16, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp32, bf16, fp32, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, bf16, bf16, fp32, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp32, bf16, bf16, bf16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, fp16, fp16, fp16, fp16, fp32, 2, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER(18432, bf16, bf16, bf16, bf16, fp32, 2, 1, 4, 16);
+}
+
+}  // namespace layer_norm
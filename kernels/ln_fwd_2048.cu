@@ -0,0 +1,33 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 2048, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_2048(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER( 2048, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 16);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp16, fp8e4m3, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, bf16, fp8e4m3, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, fp16, fp16, fp16, int8, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER( 2048, bf16, bf16, bf16, int8, fp32, 1, 4, 1, 16);
+
+    // Alternative shapes benchmarked by the autotuner, see ln_api.cu.
+    REGISTER_FWD_CANDIDATE( 2048, fp16, fp16, fp16, fp16, fp32, 1, 4, 16);
+    REGISTER_FWD_CANDIDATE( 2048, fp16, fp16, fp16, fp16, fp32, 1, 8, 16);
+    REGISTER_FWD_CANDIDATE( 2048, bf16, bf16, bf16, bf16, fp32, 1, 4, 16);
+    REGISTER_FWD_CANDIDATE( 2048, bf16, bf16, bf16, bf16, fp32, 1, 8, 16);
+}
+
+}  // namespace layer_norm
@@ -0,0 +1,27 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 3840, the supported type combinations are listed in
+// ln_api.cu. Exact width kernels, see EXACT_HIDDEN_SIZES in lib.rs.
+
+namespace layer_norm {
+
+void register_fwd_3840(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER( 3840, fp32, fp32, fp32, fp32, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp16, fp32, fp32, fp32, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp32, fp16, fp32, fp16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp16, fp16, fp32, fp16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp32, fp16, fp16, fp16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp32, bf16, fp32, bf16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, bf16, bf16, fp32, bf16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp32, bf16, bf16, bf16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp16, fp16, fp16, fp16, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, bf16, bf16, bf16, bf16, fp32, 1, 1, 5, 16);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER( 3840, fp16, fp16, fp16, fp8e4m3, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, bf16, bf16, bf16, fp8e4m3, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, fp16, fp16, fp16, int8, fp32, 1, 1, 5, 16);
+    REGISTER_FWD_LAUNCHER( 3840, bf16, bf16, bf16, int8, fp32, 1, 1, 5, 16);
+}
+
+}  // namespace layer_norm
@@ -0,0 +1,45 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 4096, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_4096(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER( 4096, fp32, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp16, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
+
+    // 16-bit compute of the normalization, see Kernel_traits_packed.
+    REGISTER_FWD_PACKED_LAUNCHER( 4096, fp16, 1, 4, 16);
+    REGISTER_FWD_PACKED_LAUNCHER( 4096, bf16, 1, 4, 16);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp16, fp8e4m3, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, bf16, fp8e4m3, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, fp16, fp16, fp16, int8, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 4096, bf16, bf16, bf16, int8, fp32, 1, 1, 4, 16);
+
+    // Alternative shapes benchmarked by the autotuner, see ln_api.cu.
+    REGISTER_FWD_CANDIDATE( 4096, fp16, fp16, fp16, fp16, fp32, 1, 8, 16);
+    REGISTER_FWD_CANDIDATE( 4096, fp16, fp16, fp16, fp16, fp32, 2, 4, 16);
+    REGISTER_FWD_CANDIDATE( 4096, bf16, bf16, bf16, bf16, fp32, 1, 8, 16);
+    REGISTER_FWD_CANDIDATE( 4096, bf16, bf16, bf16, bf16, fp32, 2, 4, 16);
+
+#ifdef LN_BUILD_SM90
+    // Hopper keeps more loads in flight per SM, 8 warps per row halve the LDGs of each thread. They
+    // are not measured to beat the defaults, the autotuner picks them where they do. The uniform
+    // 16-bit rows have this shape as a candidate on every SM.
+    REGISTER_FWD_CANDIDATE_SM(90, 4096, fp16, fp16, fp32, fp16, fp32, 1, 8, 16);
+    REGISTER_FWD_CANDIDATE_SM(90, 4096, bf16, bf16, fp32, bf16, fp32, 1, 8, 16);
+#endif
+}
+
+}  // namespace layer_norm
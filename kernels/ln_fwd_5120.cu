@@ -0,0 +1,31 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 5120, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_5120(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER( 5120, fp32, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp16, fp32, fp32, fp32, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp32, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp32, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp32, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp32, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, fp32, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp32, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp16, fp16, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, bf16, bf16, fp32, 1, 1, 4, 16);
+
+    // 16-bit compute of the normalization, see Kernel_traits_packed.
+    REGISTER_FWD_PACKED_LAUNCHER( 5120, fp16, 1, 4, 16);
+    REGISTER_FWD_PACKED_LAUNCHER( 5120, bf16, 1, 4, 16);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp16, fp8e4m3, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, bf16, fp8e4m3, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, fp16, fp16, fp16, int8, fp32, 1, 1, 4, 16);
+    REGISTER_FWD_LAUNCHER( 5120, bf16, bf16, bf16, int8, fp32, 1, 1, 4, 16);
+}
+
+}  // namespace layer_norm
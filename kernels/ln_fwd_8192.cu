@@ -0,0 +1,37 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 8192, the supported type combinations are listed in
+// ln_api.cu.
+
+namespace layer_norm {
+
+void register_fwd_8192(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER( 8192, fp32, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp16, fp32, fp32, fp32, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp32, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp32, fp16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp32, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp32, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, fp32, bf16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp32, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp16, fp16, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, bf16, bf16, fp32, 1, 1, 8, 16);
+
+    // 16-bit compute of the normalization, see Kernel_traits_packed.
+    REGISTER_FWD_PACKED_LAUNCHER( 8192, fp16, 1, 8, 16);
+    REGISTER_FWD_PACKED_LAUNCHER( 8192, bf16, 1, 8, 16);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp16, fp8e4m3, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, bf16, fp8e4m3, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, fp16, fp16, fp16, int8, fp32, 1, 1, 8, 16);
+    REGISTER_FWD_LAUNCHER( 8192, bf16, bf16, bf16, int8, fp32, 1, 1, 8, 16);
+
+    // Alternative shapes benchmarked by the autotuner, see ln_api.cu.
+    REGISTER_FWD_CANDIDATE( 8192, fp16, fp16, fp16, fp16, fp32, 1, 4, 16);
+    REGISTER_FWD_CANDIDATE( 8192, fp16, fp16, fp16, fp16, fp32, 1, 16, 16);
+    REGISTER_FWD_CANDIDATE( 8192, bf16, bf16, bf16, bf16, fp32, 1, 4, 16);
+    REGISTER_FWD_CANDIDATE( 8192, bf16, bf16, bf16, bf16, fp32, 1, 16, 16);
+}
+
+}  // namespace layer_norm
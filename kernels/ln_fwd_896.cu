@@ -0,0 +1,29 @@
+#include "ln_fwd_kernels.cuh"
+
+// Forward launchers of hidden size 896, the supported type combinations are listed in
+// ln_api.cu. Exact width kernels, see EXACT_HIDDEN_SIZES in lib.rs.
+// The rows of 896 16-bit elements are not a multiple of a warp of 16-byte loads, they use 8-byte
+// loads.
+
+namespace layer_norm {
+
+void register_fwd_896(FwdRegistry &registry) {
+    REGISTER_FWD_LAUNCHER(  896, fp32, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER(  896, fp16, fp32, fp32, fp32, fp32, 1, 4, 1, 16);
+    REGISTER_FWD_LAUNCHER(  896, fp32, fp16, fp32, fp16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp16, fp16, fp32, fp16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp32, fp16, fp16, fp16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp32, bf16, fp32, bf16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, bf16, bf16, fp32, bf16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp32, bf16, bf16, bf16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp16, fp16, fp16, fp16, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, bf16, bf16, bf16, bf16, fp32, 1, 4, 1, 8);
+
+    // Quantized outputs with a per-row or per-tensor scale, single CTA per row.
+    REGISTER_FWD_LAUNCHER(  896, fp16, fp16, fp16, fp8e4m3, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, bf16, bf16, bf16, fp8e4m3, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, fp16, fp16, fp16, int8, fp32, 1, 4, 1, 8);
+    REGISTER_FWD_LAUNCHER(  896, bf16, bf16, bf16, int8, fp32, 1, 4, 1, 8);
+}
+
+}  // namespace layer_norm
@@ -16,9 +16,57 @@
 
 namespace layer_norm {
 
-template<typename Ktraits, bool Is_dropout, bool Has_colscale, bool Has_subset, bool Is_even_cols>
-__global__ __launch_bounds__(Ktraits::THREADS_PER_CTA) 
-void ln_fwd_kernel(FwdParams params) {
+// Element offset of a row of a tensor with the given strides, see FwdParams::heads.
+inline __device__ uint32_t row_offset(const FwdParams &params, const uint32_t row, const int row_stride, const int head_stride) {
+    return (row / params.heads) * row_stride + (row % params.heads) * head_stride;
+}
+
+// The rows of a launch, see FwdParams::rows_ptr.
+inline __device__ int active_rows(const FwdParams &params) {
+    return params.rows_ptr == nullptr ? params.rows : min(params.rows, int(*params.rows_ptr));
+}
+
+// Rotary embedding of NUM_ELTS normalized values v of row row, starting at column col, see
+// FwdParams::rope_cos. partner holds the values at col +- cols / 2 for the half-split variant.
+template<typename input_t, typename compute_t, int NUM_ELTS>
+inline __device__ void apply_rope(const FwdParams &params, const uint32_t row, const int col,
+                                  compute_t (&v)[NUM_ELTS], const compute_t (&partner)[NUM_ELTS]) {
+    static_assert(NUM_ELTS % 2 == 0);
+    const int half = params.cols / 2;
+    const uint32_t token = row / params.heads;
+    const uint32_t pos = params.rope_pos == nullptr ? token : params.rope_pos[token];
+    const input_t *cos = static_cast<const input_t *>(params.rope_cos) + pos * half;
+    const input_t *sin = static_cast<const input_t *>(params.rope_sin) + pos * half;
+    compute_t out[NUM_ELTS];
+    #pragma unroll
+    for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+        const int col_j = col + jt;
+        if (params.rope_interleaved) {
+            const compute_t cos_j = compute_t(cos[col_j / 2]);
+            const compute_t sin_j = compute_t(sin[col_j / 2]);
+            out[jt] = jt % 2 == 0 ? v[jt] * cos_j - v[jt ^ 1] * sin_j : v[jt] * cos_j + v[jt ^ 1] * sin_j;
+        } else {
+            const int freq = col_j < half ? col_j : col_j - half;
+            const compute_t cos_j = compute_t(cos[freq]);
+            const compute_t sin_j = compute_t(sin[freq]);
+            out[jt] = col_j < half ? v[jt] * cos_j - partner[jt] * sin_j : v[jt] * cos_j + partner[jt] * sin_j;
+        }
+    }
+    #pragma unroll
+    for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+        v[jt] = out[jt];
+    }
+}
+
+// The row loop of a CTA. bidm is the CTA group, that processes every params.ctas_per_col-th
+// block of rows, and bidn the CTA within the group. Is_rms_norm, Has_beta, Has_residual and
+// Has_x0_bias replace params.is_rms_norm and the null checks of params.beta, params.residual and
+// params.x0_bias. Without
+// Save_stats the stores of the statistics are compiled out, with it they still check params.mu,
+// see launch_. Is_persistent CTAs take their blocks of rows from params.work_counter instead.
+template<typename Ktraits, bool Is_dropout, bool Has_colscale, bool Has_subset, bool Is_even_cols, bool Save_stats,
+         bool Is_rms_norm, bool Has_beta, bool Has_residual, bool Has_x0_bias, bool Is_persistent>
+inline __device__ void ln_fwd_rows(const FwdParams &params, const uint32_t bidm, const uint32_t bidn) {
 
     enum { ROWS_PER_CTA = Ktraits::ROWS_PER_CTA };
     enum { WARPS_N = Ktraits::WARPS_N };
@@ -46,14 +94,19 @@ void ln_fwd_kernel(FwdParams params) {
     using Stats = typename Ktraits::Stats;
     using stats_t = typename Stats::stats_t;
 
-    const bool has_residual = params.residual != nullptr;
-    const bool save_x = has_residual || Is_dropout || Has_colscale || (params.rowscale != nullptr) || Has_subset || !(std::is_same<input_t, residual_t>::value);
+    // The registers of the result of the residual add of a row, see Kernel_traits_packed.
+    constexpr bool Is_packed = Ktraits::IS_PACKED;
+    using row_t = typename Ktraits::row_t;
+    enum { ROW_REGS = Ktraits::ROW_REGS };
+
+    const bool save_stats = Save_stats && params.mu != nullptr;
+
+    const bool save_x = Has_residual || Is_dropout || Has_colscale || Has_x0_bias || (params.rowscale != nullptr) || Has_subset
+                      || !(std::is_same<input_t, residual_t>::value);
 
     extern __shared__ char smem_[];
 
     const index_t tidx = threadIdx.x;
-    const index_t bidn = blockIdx.x % CTAS_PER_ROW;
-    const index_t bidm = blockIdx.x / CTAS_PER_ROW;
     const index_t lane = tidx % THREADS_PER_WARP;
     const index_t warp = tidx / THREADS_PER_WARP;
     const index_t warp_m = warp / WARPS_N;
@@ -63,6 +116,18 @@ void ln_fwd_kernel(FwdParams params) {
     const index_t c = bidn * THREADS_PER_ROW + warp_n * THREADS_PER_WARP + lane;
 
     Stats stats(params, bidm, bidn, warp_m, warp_n, lane, smem_);
+    // RMSNorm only reduces the sum of squares, in the shared memory and workspace of the stats.
+    using Rms_reducer = typename Ktraits::Rms_reducer;
+    Rms_reducer rms_reducer(params, bidm, bidn, warp_m, warp_n, lane, smem_);
+
+    using Quantize = layer_norm::Quantize<output_t>;
+    using Amax_reducer = typename Ktraits::Amax_reducer;
+    Amax_reducer amax_reducer(params, bidm, bidn, warp_m, warp_n, lane, smem_ + Stats::SMEM_BYTES);
+    // A static per-tensor scale is applied as a multiplication by its inverse.
+    compute_t inv_quant_scale = 1.f;
+    if constexpr (Ktraits::IS_QUANTIZED) {
+        if (params.z_scale == nullptr) { inv_quant_scale = 1.f / params.quant_scale[0]; }
+    }
 
     compute_t *mu_ptr = static_cast<compute_t *>(params.mu);
     compute_t *rs_ptr = static_cast<compute_t *>(params.rs);
@@ -71,78 +136,161 @@ void ln_fwd_kernel(FwdParams params) {
     const index_t *x0_subset = static_cast<index_t *>(params.x0_subset);
     const index_t *z_subset = static_cast<index_t *>(params.z_subset);
 
-    // https://github.com/pytorch/pytorch/blob/master/aten/src/ATen/native/cuda/Dropout.cu
-    // curandStatePhilox4_32_10_t state;
-    // if (Is_dropout) {
-    //    auto seeds = at::cuda::philox::unpack(params.philox_args);
-    //    const index_t tidx_global = blockIdx.x * blockDim.x + threadIdx.x;
-    //    curand_init(std::get<0>(seeds), tidx_global, std::get<1>(seeds), &state);
-    //}
-
     const index_t num_valid_ldgs = ((params.cols / Ktraits::ELTS_PER_LDG) - 1 - c + VEC_COLS_PER_LDG) / VEC_COLS_PER_LDG;
 
     Wvec gamma[LDGS];
-    Wvec beta[LDGS];
+    Wvec beta[Has_beta ? LDGS : 1];
     Wvec colscale[LDGS];
+    Wvec x0_bias[Has_x0_bias ? LDGS : 1];
     index_t idx = c;
     #pragma unroll
     for( int it = 0; it < LDGS; it++ ) {
         if (Is_even_cols || (it < num_valid_ldgs)) {
             gamma[it].load_from(params.gamma, idx);
-            if (params.beta != nullptr) {
-                beta[it].load_from(params.beta, idx);
-            } else {
-                beta[it].zero_();
-            }
+            if constexpr (Has_beta) { beta[it].load_from(params.beta, idx); }
             if (Has_colscale) { colscale[it].load_from(params.colscale, idx); }
+            if constexpr (Has_x0_bias) { x0_bias[it].load_from(params.x0_bias, idx); }
             idx += VEC_COLS_PER_LDG;
         }
     }
 
-    for( int row = r; row < params.rows; row += params.ctas_per_col * ROWS_PER_CTA ) {
+    const int rows = active_rows(params);
+
+    // The x0 and residual vectors of a row. The persistent kernel loads them during the reductions
+    // of the previous row, from sm80 on with cp.async into the staging area of the shared memory.
+    // From sm90 on, rows of 16-byte vectors are bulk copied by the TMA unit instead: the staging
+    // area of a row has the layout of the row in gmem, so a single copy per tensor fills it.
+    constexpr bool Stage_in_smem = Is_persistent && LN_HAS_CP_ASYNC;
+    constexpr bool Stage_in_bulk = Stage_in_smem && LN_HAS_BULK_COPY && sizeof(Ivec) % 16 == 0 && sizeof(Rvec) % 16 == 0;
+    Ivec x0_in[LDGS];
+    Rvec residual_in[LDGS];
+    Ivec *x0_stage_row = reinterpret_cast<Ivec *>(smem_ + Ktraits::SMEM_BYTES_STAGE_OFFSET) + warp_m * LDGS * THREADS_PER_ROW;
+    Rvec *residual_stage_row = reinterpret_cast<Rvec *>(smem_ + Ktraits::SMEM_BYTES_STAGE_OFFSET + Ktraits::SMEM_BYTES_STAGE_X0)
+                             + warp_m * LDGS * THREADS_PER_ROW;
+    Ivec *x0_stage = x0_stage_row + c;
+    Rvec *residual_stage = residual_stage_row + c;
+    // The bulk copies of a row complete on its barrier, one phase per row.
+    __shared__ uint64_t stage_bar[Stage_in_bulk ? ROWS_PER_CTA : 1];
+    uint32_t stage_phase = 0;
+
+    auto load_row = [&](const int row) {
+        const int row_x0 = !Has_subset ? row + 1 : x0_subset[row];
+        const bool load_x0 = !Has_subset || (row_x0 > 0 && row_x0 <= params.x0_subset_rows);
+        index_t idx_r = row_offset(params, row, params.residual_row_stride, params.residual_head_stride) / Ktraits::ELTS_PER_LDG + c;
+        index_t idx_x0 = row_offset(params, !Has_subset ? row : (load_x0 ? row_x0 - 1 : 0), params.x0_row_stride, params.x0_head_stride) / Ktraits::ELTS_PER_LDG + c;
+        if constexpr (Stage_in_bulk) {
+            static_assert(!Has_subset && Is_even_cols);
+            // The threads of the row are done reading the staging area of the previous one. With
+            // WARPS_N > 1, the CTA holds a single row, so that all its threads load it or none.
+            static_assert(WARPS_M == 1 || WARPS_N == 1, "the CTA does not load its rows together");
+            if( WARPS_N == 1 ) {
+                __syncwarp();
+            } else {
+                __syncthreads();
+            }
+            if( warp_n == 0 && lane == 0 ) {
+                fence_proxy_async();
+                constexpr uint32_t RESIDUAL_BYTES_PER_ROW = Ktraits::COLS * sizeof(residual_t);
+                mbarrier_expect_tx(&stage_bar[warp_m], BYTES_PER_ROW + (Has_residual ? RESIDUAL_BYTES_PER_ROW : 0));
+                bulk_copy_to_smem(x0_stage_row, static_cast<const Ivec *>(params.x0) + (idx_x0 - c), BYTES_PER_ROW, &stage_bar[warp_m]);
+                if (Has_residual) {
+                    bulk_copy_to_smem(residual_stage_row, static_cast<const Rvec *>(params.residual) + (idx_r - c),
+                                      RESIDUAL_BYTES_PER_ROW, &stage_bar[warp_m]);
+                }
+            }
+            return;
+        }
+        #pragma unroll
+        for( int it = 0; it < LDGS; it++ ) {
+            if (Is_even_cols || (it < num_valid_ldgs)) {
+                if constexpr (Stage_in_smem) {
+                    if (load_x0) { x0_stage[it * THREADS_PER_ROW].load_async_from(params.x0, idx_x0); }
+                    if (Has_residual) { residual_stage[it * THREADS_PER_ROW].load_async_from(params.residual, idx_r); }
+                } else {
+                    if (load_x0) { x0_in[it].load_from(params.x0, idx_x0); }
+                    if (Has_residual) { residual_in[it].load_from(params.residual, idx_r); }
+                }
+                idx_r += VEC_COLS_PER_LDG;
+                idx_x0 += VEC_COLS_PER_LDG;
+            }
+        }
+    };
+
+    // Waits for the staged loads of load_row. With cp.async every thread reads back its own vectors
+    // only, the bulk copies are waited for on the barrier of the row.
+    auto land_row = [&]() {
+        if constexpr (Stage_in_bulk) {
+            mbarrier_wait(&stage_bar[warp_m], stage_phase);
+            stage_phase ^= 1;
+        } else if constexpr (Stage_in_smem) {
+            cp_async_wait_all();
+        }
+        if constexpr (Stage_in_smem) {
+            #pragma unroll
+            for( int it = 0; it < LDGS; it++ ) {
+                if (Is_even_cols || (it < num_valid_ldgs)) {
+                    x0_in[it] = x0_stage[it * THREADS_PER_ROW];
+                    if (Has_residual) { residual_in[it] = residual_stage[it * THREADS_PER_ROW]; }
+                }
+            }
+        }
+    };
+
+    // x = x0 + residual with the optional bias, scales and dropout, x is stored if requested.
+    auto combine_row = [&](const int row, row_t (&xf)[ROW_REGS]) {
         const compute_t rowscale_val = !Has_subset ? (params.rowscale == nullptr ? 1.0f : compute_t(rowscale[row])) : params.rowscale_const;
         const int row_x0 = !Has_subset ? row + 1 : x0_subset[row];
-        const int row_z = !Has_subset ? row + 1 : z_subset[row];
-        const bool load_x0 = !Has_subset || row_x0 > 0;
-        index_t idx_x = row * params.cols / Ktraits::ELTS_PER_LDG + c;
-        index_t idx_x0 = !Has_subset ? idx_x : (load_x0 ? (row_x0 - 1) * params.cols / Ktraits::ELTS_PER_LDG + c : 0);
-        compute_t xf[LDGS * NUM_ELTS];
+        const bool load_x0 = !Has_subset || (row_x0 > 0 && row_x0 <= params.x0_subset_rows);
+        index_t idx_x = row_offset(params, row, params.x_row_stride, params.x_head_stride) / Ktraits::ELTS_PER_LDG + c;
         #pragma unroll
         for( int it = 0; it < LDGS; it++ ) {
             if (Is_even_cols || (it < num_valid_ldgs)) {
-                Ivec x0;
-                Rvec residual;
                 Rvec x;
-                Mvec dmask;
-                if (load_x0) { x0.load_from(params.x0, !Has_subset ? idx_x : idx_x0); }
-                if (has_residual) { residual.load_from(params.residual, idx_x); }
+                // Dense index of the first element, the mask and the random numbers follow x0.
+                const uint64_t elt = uint64_t(!Has_subset ? row : (load_x0 ? row_x0 - 1 : 0)) * params.cols
+                                   + uint64_t(c + it * VEC_COLS_PER_LDG) * NUM_ELTS;
+                uint32_t keep_bits = 0;
+                uint4 rand;
                 #pragma unroll
                 for( int jt = 0; jt < NUM_ELTS; jt++ ) {
-                    // TD [2022-04-22]: We're memory bound, not compute bound, so we don't need to use
-                    // the more efficient curand_uniform4.
                     compute_t x_ij;
                     if (load_x0) {
-                        //mask_t keep = !Is_dropout ? true : curand_uniform(&state) <= params.dropout_keep_p;
-                        mask_t keep = false;
-                        // if (Is_dropout) { dmask.data.elt[jt] = keep; }
-                        compute_t x0_ij = compute_t(x0.data.elt[jt]) * rowscale_val;
-                        // x0_ij = keep ? (Is_dropout ? x0_ij * params.dropout_scale : x0_ij) : 0.0f;
+                        if (Is_dropout && jt % 4 == 0) {
+                            rand = dropout_rand4(params.philox_seed, params.philox_offset, (elt + jt) / 4);
+                        }
+                        const uint32_t rand_j = jt % 4 == 0 ? rand.x : jt % 4 == 1 ? rand.y : jt % 4 == 2 ? rand.z : rand.w;
+                        const bool keep = !Is_dropout || compute_t(rand_j) * 2.3283064365386963e-10f < params.dropout_keep_p;
+                        keep_bits |= uint32_t(keep) << jt;
+                        compute_t x0_ij = compute_t(x0_in[it].data.elt[jt]);
+                        if constexpr (Has_x0_bias) { x0_ij += compute_t(x0_bias[it].data.elt[jt]); }
+                        x0_ij *= rowscale_val;
+                        x0_ij = keep ? (Is_dropout ? x0_ij * params.dropout_scale : x0_ij) : 0.0f;
                         if (Has_colscale) { x0_ij *= compute_t(colscale[it].data.elt[jt]); }
-                        x_ij = has_residual ? x0_ij + compute_t(residual.data.elt[jt]) : x0_ij;
+                        x_ij = Has_residual ? x0_ij + compute_t(residual_in[it].data.elt[jt]) : x0_ij;
                     } else {
-                        x_ij = has_residual ? compute_t(residual.data.elt[jt]) : 0.f;
+                        x_ij = Has_residual ? compute_t(residual_in[it].data.elt[jt]) : 0.f;
                     }
                     if (save_x) { x.data.elt[jt] = x_ij; }
-                    xf[it * NUM_ELTS + jt] = x_ij;
+                    if constexpr (Is_packed) {
+                        // Rounded like the stored sum of a separate residual add.
+                        auto &pair = xf[(it * NUM_ELTS + jt) / 2];
+                        if (jt % 2 == 0) { pair.x = residual_t(x_ij); } else { pair.y = residual_t(x_ij); }
+                    } else {
+                        xf[it * NUM_ELTS + jt] = x_ij;
+                    }
                 }
                 if (save_x) { x.store_to(params.x, idx_x); }
-                // if (Is_dropout && load_x0) { dmask.store_to(params.dmask, !Has_subset ? idx_x : idx_x0); }
+                if (Is_dropout && load_x0 && params.dmask != nullptr) {
+                    store_mask_bits<NUM_ELTS>(params.dmask, elt, keep_bits);
+                }
                 idx_x += VEC_COLS_PER_LDG;
-                idx_x0 += VEC_COLS_PER_LDG;
             }
         }
+    };
 
-        static_assert(CTAS_PER_ROW == 1, "Don't support multiple CTAs per row for now");
+    // The statistics, the normalization and the stores of z.
+    auto finish_row = [&](const int row, row_t (&xf)[ROW_REGS]) {
+        const int row_z = !Has_subset ? row + 1 : z_subset[row];
         const index_t num_vecs = params.cols / Ktraits::ELTS_PER_LDG;
         const index_t num_full_ldgs = num_vecs / Ktraits::VEC_COLS_PER_LDG;
         const index_t remaining_vecs = num_vecs % Ktraits::VEC_COLS_PER_LDG;
@@ -153,43 +301,422 @@ void ln_fwd_kernel(FwdParams params) {
                         int(THREADS_PER_WARP));
             return (num_full_ldgs * THREADS_PER_WARP + valid_partial_vecs_in_warp) * NUM_ELTS;
         };
-        stats_t s = stats.template compute<Is_even_cols>(
-            xf, params.inverse_cols, valid_elts_in_warp_fn, num_valid_ldgs * NUM_ELTS
-        );
-
-        compute_t mu = layer_norm::Get<0>::of<stats_t, compute_t>(s);
-        compute_t m2 = layer_norm::Get<1>::of<stats_t, compute_t>(s);
+        // For RMSNorm, mu is 0 and m2 the sum of squares.
+        compute_t mu = 0.f;
+        compute_t m2 = 0.f;
+        if constexpr (Is_packed) {
+            // Both passes convert the pairs back to fp32 one at a time.
+            using Packed = Packed2<residual_t>;
+            auto sum = Sum<compute_t>();
+            if constexpr (!Is_rms_norm) {
+                #pragma unroll
+                for( int it = 0; it < LDGS; it++ ) {
+                    if (Is_even_cols || (it < num_valid_ldgs)) {
+                        #pragma unroll
+                        for( int jt = 0; jt < NUM_ELTS; jt += 2 ) {
+                            const float2 v = Packed::to_float2(xf[(it * NUM_ELTS + jt) / 2]);
+                            mu += v.x + v.y;
+                        }
+                    }
+                }
+                mu = rms_reducer.allreduce(mu, sum) * params.inverse_cols;
+            }
+            #pragma unroll
+            for( int it = 0; it < LDGS; it++ ) {
+                if (Is_even_cols || (it < num_valid_ldgs)) {
+                    #pragma unroll
+                    for( int jt = 0; jt < NUM_ELTS; jt += 2 ) {
+                        const float2 v = Packed::to_float2(xf[(it * NUM_ELTS + jt) / 2]);
+                        const compute_t dx = v.x - mu;
+                        const compute_t dy = v.y - mu;
+                        m2 += dx * dx + dy * dy;
+                    }
+                }
+            }
+            m2 = rms_reducer.allreduce(m2, sum);
+        } else if constexpr (Is_rms_norm) {
+            #pragma unroll
+            for( int it = 0; it < LDGS; it++ ) {
+                if (Is_even_cols || (it < num_valid_ldgs)) {
+                    #pragma unroll
+                    for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                        m2 += xf[it * NUM_ELTS + jt] * xf[it * NUM_ELTS + jt];
+                    }
+                }
+            }
+            auto sum = Sum<compute_t>();
+            m2 = rms_reducer.allreduce(m2, sum);
+        } else {
+            stats_t s = stats.template compute<Is_even_cols>(
+                xf, params.inverse_cols, valid_elts_in_warp_fn, num_valid_ldgs * NUM_ELTS
+            );
+            mu = layer_norm::Get<0>::of<stats_t, compute_t>(s);
+            m2 = layer_norm::Get<1>::of<stats_t, compute_t>(s);
+        }
 
-        if( bidn == 0 && warp_n == 0 && lane == 0 ) {
+        if( save_stats && bidn == 0 && warp_n == 0 && lane == 0 ) {
             mu_ptr[row] = mu;
         }
 
-        compute_t rs = rsqrtf(m2 * params.inverse_cols + params.epsilon + (!params.is_rms_norm ? 0.f : mu * mu));
+        compute_t rs = rsqrtf(m2 * params.inverse_cols + params.epsilon);
 
-        if( bidn == 0 && warp_n == 0 && lane == 0 ) {
+        if( save_stats && bidn == 0 && warp_n == 0 && lane == 0 ) {
             rs_ptr[row] = rs;
         }
 
-        const bool save_z = !Has_subset || row_z > 0;
-        if (save_z) {
-            index_t idx_z = (!Has_subset ? row : (row_z - 1)) * params.cols / Ktraits::ELTS_PER_LDG + c;
+        const bool save_z = !Has_subset || (row_z > 0 && row_z <= params.z_subset_rows);
+        if constexpr (Is_packed) {
+            // The normalization and the affine transform of the pairs, with mu and rs rounded to the
+            // 16-bit type. With u the unit roundoff of the type (2^-11 for fp16, 2^-8 for bf16) and
+            // y = (x - mu) * rs, the outputs are to first order within
+            //     u * (|z| + |gamma| * (4 * |y| + 2 * rs * |mu|))
+            // of those of the fp32 compute, mu being 0 for RMSNorm. rs is clamped to the largest
+            // finite value of the type, for fp16 the bound only holds while var + eps >= 2.4e-10
+            // and rows of a smaller variance get smaller outputs, instead of inf * 0 = NaN.
+            using Packed = Packed2<residual_t>;
+            if (save_z) {
+                const row_t mu2 = Packed::splat(mu);
+                const row_t rs2 = Packed::splat(fminf(rs, Packed::max_finite()));
+                index_t idx_z = row_offset(params, !Has_subset ? row : (row_z - 1), params.z_row_stride, params.z_head_stride) / Ktraits::ELTS_PER_LDG + c;
+                #pragma unroll
+                for( int it = 0; it < LDGS; it++ ) {
+                    if (Is_even_cols || (it < num_valid_ldgs)) {
+                        Ovec z;
+                        #pragma unroll
+                        for( int jt = 0; jt < NUM_ELTS; jt += 2 ) {
+                            const row_t x2 = xf[(it * NUM_ELTS + jt) / 2];
+                            const row_t y2 = __hmul2(Is_rms_norm ? x2 : __hsub2(x2, mu2), rs2);
+                            const row_t g2(gamma[it].data.elt[jt], gamma[it].data.elt[jt + 1]);
+                            row_t z2;
+                            if constexpr (Has_beta) {
+                                z2 = __hfma2(g2, y2, row_t(beta[it].data.elt[jt], beta[it].data.elt[jt + 1]));
+                            } else {
+                                z2 = __hmul2(g2, y2);
+                            }
+                            z.data.elt[jt] = z2.x;
+                            z.data.elt[jt + 1] = z2.y;
+                        }
+                        z.store_to(params.z, idx_z);
+                        idx_z += VEC_COLS_PER_LDG;
+                    }
+                }
+            }
+        } else if (save_z) {
+            // The normalized values replace the inputs in registers, so the quantized outputs can
+            // get their per-row scale before being written out.
+            compute_t amax = 0.f;
             #pragma unroll
             for( int it = 0; it < LDGS; it++ ) {
                 if (Is_even_cols || (it < num_valid_ldgs)) {
-                    Ovec z;
                     #pragma unroll
                     for( int jt = 0; jt < NUM_ELTS; jt++ ) {
-                        compute_t y_ij = compute_t(rs * (xf[it * NUM_ELTS + jt] - (!params.is_rms_norm ? mu : 0.f)));
+                        compute_t y_ij = compute_t(rs * (Is_rms_norm ? xf[it * NUM_ELTS + jt] : xf[it * NUM_ELTS + jt] - mu));
                         compute_t g_ij = gamma[it].data.elt[jt];
-                        compute_t b_ij = beta[it].data.elt[jt];
-                        z.data.elt[jt] = output_t(g_ij * y_ij + b_ij);
+                        if constexpr (Has_beta) {
+                            xf[it * NUM_ELTS + jt] = g_ij * y_ij + compute_t(beta[it].data.elt[jt]);
+                        } else {
+                            xf[it * NUM_ELTS + jt] = g_ij * y_ij;
+                        }
+                    }
+                }
+            }
+
+            if constexpr (Is_even_cols && (Ktraits::ROPE_PAIRS_IN_THREAD || Ktraits::ROPE_PAIRS_IN_WARP)) {
+                if (params.rope_cos != nullptr) {
+                    compute_t zf[LDGS * NUM_ELTS];
+                    #pragma unroll
+                    for( int it = 0; it < LDGS; it++ ) {
+                        compute_t v[NUM_ELTS];
+                        compute_t partner[NUM_ELTS];
+                        #pragma unroll
+                        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                            v[jt] = xf[it * NUM_ELTS + jt];
+                            if constexpr (Ktraits::ROPE_PAIRS_IN_THREAD) {
+                                partner[jt] = xf[((it + LDGS / 2) % LDGS) * NUM_ELTS + jt];
+                            } else {
+                                partner[jt] = __shfl_xor_sync(uint32_t(-1), v[jt], THREADS_PER_ROW / 2);
+                            }
+                        }
+                        apply_rope<input_t>(params, row, (c + it * VEC_COLS_PER_LDG) * NUM_ELTS, v, partner);
+                        #pragma unroll
+                        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                            zf[it * NUM_ELTS + jt] = v[jt];
+                        }
+                    }
+                    #pragma unroll
+                    for( int i = 0; i < LDGS * NUM_ELTS; i++ ) {
+                        xf[i] = zf[i];
+                    }
+                }
+            }
+
+            if constexpr (Ktraits::IS_QUANTIZED) {
+                #pragma unroll
+                for( int it = 0; it < LDGS; it++ ) {
+                    if (Is_even_cols || (it < num_valid_ldgs)) {
+                        #pragma unroll
+                        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                            amax = fmaxf(amax, fabsf(xf[it * NUM_ELTS + jt]));
+                        }
+                    }
+                }
+            }
+
+            compute_t inv_scale = 1.f;
+            if constexpr (Ktraits::IS_QUANTIZED) {
+                inv_scale = inv_quant_scale;
+                if (params.z_scale != nullptr) {
+                    auto max = Max<compute_t>();
+                    amax = amax_reducer.allreduce(amax, max);
+                    // All zero rows keep a unit scale.
+                    const compute_t scale = amax > 0.f ? amax / Quantize::MAX_VALUE : 1.f;
+                    inv_scale = 1.f / scale;
+                    if( warp_n == 0 && lane == 0 ) {
+                        params.z_scale[!Has_subset ? row : (row_z - 1)] = scale;
+                    }
+                }
+            }
+
+            index_t idx_z = row_offset(params, !Has_subset ? row : (row_z - 1), params.z_row_stride, params.z_head_stride) / Ktraits::ELTS_PER_LDG + c;
+            #pragma unroll
+            for( int it = 0; it < LDGS; it++ ) {
+                if (Is_even_cols || (it < num_valid_ldgs)) {
+                    Ovec z;
+                    #pragma unroll
+                    for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                        z.data.elt[jt] = Quantize::convert(xf[it * NUM_ELTS + jt] * inv_scale);
                     }
                     z.store_to(params.z, idx_z);
                     idx_z += VEC_COLS_PER_LDG;
                 }
             }
         }
+    };
+
+    if constexpr (Is_persistent) {
+        static_assert(CTAS_PER_ROW == 1);
+        // The warps without a row in the last block skip it and wait at the next fetch. The
+        // reductions over several warps per row synchronize the CTA, so with several rows per CTA
+        // too they would meet the __syncthreads of the fetch instead.
+        static_assert(WARPS_M == 1 || WARPS_N == 1, "the row loop is not uniform over the CTA");
+        // The blocks of rows are handed out by params.work_counter. The next block is fetched and
+        // its loads are issued before the current one is normalized. Both slots of next_block are
+        // in use at a time, the __syncthreads of a fetch orders the reads of the previous one.
+        __shared__ int next_block[2];
+        if constexpr (Stage_in_bulk) {
+            // Made visible to the other threads by the __syncthreads of the first fetch.
+            if( tidx == 0 ) {
+                for( int it = 0; it < ROWS_PER_CTA; it++ ) {
+                    mbarrier_init(&stage_bar[it]);
+                }
+                fence_proxy_async();
+            }
+        }
+        auto fetch_block = [&](const int slot) {
+            if( tidx == 0 ) {
+                next_block[slot] = atomicAdd(params.work_counter, 1);
+            }
+            __syncthreads();
+            return next_block[slot];
+        };
+
+        int block = fetch_block(0);
+        if( block * ROWS_PER_CTA + warp_m < rows ) {
+            load_row(block * ROWS_PER_CTA + warp_m);
+        }
+        for( int slot = 1; block * ROWS_PER_CTA < rows; slot ^= 1 ) {
+            const int row = block * ROWS_PER_CTA + warp_m;
+            const int next = fetch_block(slot);
+            if( row < rows ) {
+                row_t xf[ROW_REGS];
+                land_row();
+                combine_row(row, xf);
+                if( next * ROWS_PER_CTA + warp_m < rows ) {
+                    load_row(next * ROWS_PER_CTA + warp_m);
+                }
+                finish_row(row, xf);
+            }
+            block = next;
+        }
 
+        // The last CTA to run out of rows resets the counters for the next launch.
+        if( tidx == 0 ) {
+            __threadfence();
+            if( atomicAdd(params.work_counter + 1, 1) == gridDim.x - 1 ) {
+                params.work_counter[0] = 0;
+                params.work_counter[1] = 0;
+            }
+        }
+    } else {
+        for( int row = r; row < rows; row += params.ctas_per_col * ROWS_PER_CTA ) {
+            row_t xf[ROW_REGS];
+            load_row(row);
+            combine_row(row, xf);
+            finish_row(row, xf);
+        }
+    }
+}
+
+template<typename Ktraits, bool Is_dropout, bool Has_colscale, bool Has_subset, bool Is_even_cols,
+         bool Is_rms_norm, bool Has_beta, bool Has_residual, bool Has_x0_bias>
+__global__ __launch_bounds__(Ktraits::THREADS_PER_CTA) 
+void ln_fwd_kernel(FwdParams params) {
+    ln_fwd_rows<Ktraits, Is_dropout, Has_colscale, Has_subset, Is_even_cols, true, Is_rms_norm, Has_beta, Has_residual, Has_x0_bias, false>(
+        params, blockIdx.x / Ktraits::CTAS_PER_ROW, blockIdx.x % Ktraits::CTAS_PER_ROW);
+}
+
+// Large row counts with a single CTA per row, see launch_: the grid is one wave of CTAs that are
+// fed blocks of rows until none are left. Dropout, colscale and subsets stay on ln_fwd_kernel.
+template<typename Ktraits, bool Save_stats, bool Is_rms_norm, bool Has_beta, bool Has_residual, bool Has_x0_bias>
+__global__ __launch_bounds__(Ktraits::THREADS_PER_CTA)
+void ln_fwd_persistent_kernel(FwdParams params) {
+    ln_fwd_rows<Ktraits, false, false, false, true, Save_stats, Is_rms_norm, Has_beta, Has_residual, Has_x0_bias, true>(params, 0, 0);
+}
+
+// Several independent tensors in one launch, each one gets a contiguous range of CTAs. The
+// tensors may have fewer columns than HIDDEN_SIZE and are run with the uneven columns path.
+template<typename Ktraits>
+__global__ __launch_bounds__(Ktraits::THREADS_PER_CTA)
+void ln_fwd_grouped_kernel(FwdGroupParams group) {
+    static_assert(Ktraits::CTAS_PER_ROW == 1);
+    int tensor = 0;
+    while( tensor + 1 < group.num_tensors && int(blockIdx.x) >= group.cta_offsets[tensor + 1] ) {
+        tensor++;
+    }
+    FwdParams params = group.tensors[tensor];
+    params.ctas_per_col = group.cta_offsets[tensor + 1] - group.cta_offsets[tensor];
+    // The branches are uniform over the CTA, the tensors of a group may mix norms and arguments.
+    BOOL_SWITCH(params.is_rms_norm, IsRmsNormConst, [&] {
+        BOOL_SWITCH(params.beta != nullptr, HasBetaConst, [&] {
+            BOOL_SWITCH(params.residual != nullptr, HasResidualConst, [&] {
+                ln_fwd_rows<Ktraits, false, false, false, false, false, IsRmsNormConst, HasBetaConst, HasResidualConst, false, false>(
+                    params, blockIdx.x - group.cta_offsets[tensor], 0);
+            });
+        });
+    });
+}
+
+// Small hidden sizes, see Kernel_traits_subwarp: no dropout, colscale, rowscale or subset, and the
+// hidden size is exact. The row loop is warp-uniform so that every lane takes part in the shuffles.
+template<typename Ktraits, bool Save_stats, bool Is_rms_norm, bool Has_beta, bool Has_residual>
+__global__ __launch_bounds__(Ktraits::THREADS_PER_CTA)
+void ln_fwd_subwarp_kernel(FwdParams params) {
+
+    enum { THREADS_PER_ROW = Ktraits::THREADS_PER_ROW };
+    enum { ROWS_PER_WARP = Ktraits::ROWS_PER_WARP };
+    enum { ROWS_PER_CTA = Ktraits::ROWS_PER_CTA };
+    enum { NUM_ELTS = Ktraits::NUM_ELTS };
+
+    using residual_t = typename Ktraits::residual_t;
+    using output_t = typename Ktraits::output_t;
+    using index_t = typename Ktraits::index_t;
+    using compute_t = typename Ktraits::compute_t;
+    using Ivec = typename Ktraits::Ivec;
+    using Rvec = typename Ktraits::Rvec;
+    using Ovec = typename Ktraits::Ovec;
+    using Wvec = typename Ktraits::Wvec;
+    using Reducer = Subwarp_reducer<compute_t, THREADS_PER_ROW>;
+
+    const bool save_x = Has_residual || !(std::is_same<typename Ktraits::input_t, residual_t>::value);
+
+    const index_t lane = threadIdx.x % THREADS_PER_WARP;
+    const index_t warp = threadIdx.x / THREADS_PER_WARP;
+    const index_t c = lane % THREADS_PER_ROW;
+    const index_t row_in_warp = lane / THREADS_PER_ROW;
+
+    compute_t *mu_ptr = static_cast<compute_t *>(params.mu);
+    compute_t *rs_ptr = static_cast<compute_t *>(params.rs);
+
+    Wvec gamma;
+    Wvec beta;
+    gamma.load_from(params.gamma, c);
+    if constexpr (Has_beta) { beta.load_from(params.beta, c); }
+
+    auto sum = Sum<compute_t>();
+    const index_t first_row = (blockIdx.x * Ktraits::WARPS_M + warp) * ROWS_PER_WARP;
+    const index_t rows = active_rows(params);
+    for( index_t warp_row = first_row; warp_row < rows; warp_row += params.ctas_per_col * ROWS_PER_CTA ) {
+        const index_t row = warp_row + row_in_warp;
+        const bool is_valid = row < rows;
+
+        compute_t xf[NUM_ELTS];
+        if (is_valid) {
+            Ivec x0;
+            Rvec residual;
+            Rvec x;
+            x0.load_from(params.x0, row_offset(params, row, params.x0_row_stride, params.x0_head_stride) / NUM_ELTS + c);
+            if (Has_residual) {
+                residual.load_from(params.residual, row_offset(params, row, params.residual_row_stride, params.residual_head_stride) / NUM_ELTS + c);
+            }
+            #pragma unroll
+            for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                compute_t x_ij = compute_t(x0.data.elt[jt]);
+                if (Has_residual) { x_ij += compute_t(residual.data.elt[jt]); }
+                if (save_x) { x.data.elt[jt] = x_ij; }
+                xf[jt] = x_ij;
+            }
+            if (save_x) { x.store_to(params.x, row_offset(params, row, params.x_row_stride, params.x_head_stride) / NUM_ELTS + c); }
+        } else {
+            #pragma unroll
+            for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                xf[jt] = 0.f;
+            }
+        }
+
+        // For RMSNorm, mu is 0 and m2 the sum of squares.
+        compute_t mu = 0.f;
+        if constexpr (!Is_rms_norm) {
+            #pragma unroll
+            for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                mu += xf[jt];
+            }
+            mu = Reducer::allreduce(mu, sum) * params.inverse_cols;
+        }
+
+        compute_t m2 = 0.f;
+        #pragma unroll
+        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+            compute_t diff = xf[jt] - mu;
+            m2 += diff * diff;
+        }
+        m2 = Reducer::allreduce(m2, sum);
+
+        compute_t rs = rsqrtf(m2 * params.inverse_cols + params.epsilon);
+
+        #pragma unroll
+        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+            compute_t y_ij = compute_t(rs * (Is_rms_norm ? xf[jt] : xf[jt] - mu));
+            compute_t g_ij = gamma.data.elt[jt];
+            if constexpr (Has_beta) {
+                xf[jt] = g_ij * y_ij + compute_t(beta.data.elt[jt]);
+            } else {
+                xf[jt] = g_ij * y_ij;
+            }
+        }
+
+        // The half-split pairs are half a row group apart, the shuffle needs the invalid rows too.
+        if (params.rope_cos != nullptr) {
+            compute_t partner[NUM_ELTS];
+            #pragma unroll
+            for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+                partner[jt] = __shfl_xor_sync(uint32_t(-1), xf[jt], THREADS_PER_ROW / 2);
+            }
+            if (is_valid) { apply_rope<typename Ktraits::input_t>(params, row, c * NUM_ELTS, xf, partner); }
+        }
+
+        if (!is_valid) { continue; }
+
+        if( Save_stats && c == 0 ) {
+            mu_ptr[row] = mu;
+            rs_ptr[row] = rs;
+        }
+
+        Ovec z;
+        #pragma unroll
+        for( int jt = 0; jt < NUM_ELTS; jt++ ) {
+            z.data.elt[jt] = output_t(xf[jt]);
+        }
+        z.store_to(params.z, row_offset(params, row, params.z_row_stride, params.z_head_stride) / NUM_ELTS + c);
     }
 }
 
@@ -197,6 +724,51 @@ void ln_fwd_kernel(FwdParams params) {
 
 using namespace layer_norm;
 
+// Bitmask of the specializations selected by the BOOL_SWITCH nest in launch_, the statistics bit
+// only switches the persistent kernel, whose occupancy is part of the plan, and the sub-warp
+// kernels. It keys the launch plan cache and the tuning cache, so it must be kept in sync with the
+// switches below.
+inline uint32_t fwd_specialization_flags(const FwdParams &params, const uint32_t hidden_size) {
+    return uint32_t(params.dropout_keep_p < 1.f)
+         | uint32_t(params.colscale != nullptr) << 1
+         | uint32_t(params.x0_subset != nullptr) << 2
+         | uint32_t(params.cols == int(hidden_size)) << 3
+         | uint32_t(params.mu != nullptr) << 4
+         | uint32_t(params.is_rms_norm) << 5
+         | uint32_t(params.beta != nullptr) << 6
+         | uint32_t(params.residual != nullptr) << 7
+         | uint32_t(params.x0_bias != nullptr) << 8;
+}
+
+// Number of bits of fwd_specialization_flags, the plan tables of ln_api.cu have a slot per value.
+constexpr int FWD_SPECIALIZATION_FLAG_BITS = 9;
+
+// The persistent kernel takes over once every CTA of ln_fwd_kernel would loop over this many blocks
+// of rows: the atomic work counter then balances the tail and the loads of the next rows overlap
+// the reductions of the current ones.
+constexpr int PERSISTENT_MIN_ROW_LOOPS = 4;
+
+// Partitions the grid between the tensors of a group: each tensor gets one CTA per block of rows,
+// up to the CTA budget of the configure pass.
+template<typename Kernel_traits>
+void launch_grouped_(LaunchParams<FwdParams> &launch_params) {
+    FwdGroupParams group = *launch_params.group;
+    group.cta_offsets[0] = 0;
+    for( int it = 0; it < group.num_tensors; it++ ) {
+        const int ctas = std::min(int(DIVUP(group.tensors[it].rows, Kernel_traits::ROWS_PER_CTA)),
+                                  launch_params.params.ctas_per_col);
+        group.cta_offsets[it + 1] = group.cta_offsets[it] + std::max(ctas, 1);
+    }
+
+    auto kernel = &ln_fwd_grouped_kernel<Kernel_traits>;
+    if( Kernel_traits::SMEM_BYTES_FWD >= 48 * 1024 ) {
+        CHECK_CUDA(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, Kernel_traits::SMEM_BYTES_FWD));
+    }
+    const int ctas = group.cta_offsets[group.num_tensors];
+    launch_params.grid_ctas = ctas;
+    kernel<<<ctas, Kernel_traits::THREADS_PER_CTA, Kernel_traits::SMEM_BYTES_FWD, launch_params.stream>>>(group);
+}
+
 template<
     typename weight_t,
     typename input_t,
@@ -208,11 +780,12 @@ template<
     int CTAS_PER_ROW,
     int WARPS_M,
     int WARPS_N,
-    int BYTES_PER_LDG
+    int BYTES_PER_LDG,
+    bool Is_packed = false
 >
 void launch_(LaunchParams<FwdParams> &launch_params, const bool configure_params){
 
-    using Kernel_traits = Kernel_traits<weight_t,
+    using Base_traits = Kernel_traits<weight_t,
                                         input_t,
                                         residual_t,
                                         output_t,
@@ -224,14 +797,42 @@ void launch_(LaunchParams<FwdParams> &launch_params, const bool configure_params
                                         WARPS_N,
                                         BYTES_PER_LDG
                                         >;
+    using Kernel_traits = std::conditional_t<Is_packed, Kernel_traits_packed<Base_traits>, Base_traits>;
+    // The grouped launches always use fp32 compute.
+    if constexpr (CTAS_PER_ROW == 1 && !Is_packed) {
+        if( launch_params.group != nullptr && !configure_params ) {
+            launch_grouped_<Kernel_traits>(launch_params);
+            return;
+        }
+    }
     bool has_colscale = launch_params.params.colscale != nullptr;
     bool has_subset = launch_params.params.x0_subset != nullptr;
     bool is_even_cols = launch_params.params.cols == HIDDEN_SIZE;
+    bool is_rms_norm = launch_params.params.is_rms_norm;
+    bool has_beta = launch_params.params.beta != nullptr;
+    bool has_residual = launch_params.params.residual != nullptr;
+    bool has_x0_bias = launch_params.params.x0_bias != nullptr;
+    bool save_stats = launch_params.params.mu != nullptr;
+    // ln_fwd_kernel does not take SaveStatsConst, its stores stay a runtime branch, so that the
+    // switch only doubles the persistent kernels.
     BOOL_SWITCH(launch_params.params.dropout_keep_p < 1.f, IsDropoutConst, [&] {
         BOOL_SWITCH(has_colscale, HasColscaleConst, [&] {
             BOOL_SWITCH(has_subset, HasSubsetConst, [&] {
-                    BOOL_SWITCH(is_even_cols, IsEvenColsConst, [&] {
-                        auto kernel = &ln_fwd_kernel<Kernel_traits, IsDropoutConst, HasColscaleConst, HasSubsetConst, IsEvenColsConst>;
+                BOOL_SWITCH(is_even_cols, IsEvenColsConst, [&] {
+                    BOOL_SWITCH(is_rms_norm, IsRmsNormConst, [&] {
+                    BOOL_SWITCH(has_beta, HasBetaConst, [&] {
+                    BOOL_SWITCH(has_residual, HasResidualConst, [&] {
+                    BOOL_SWITCH(has_x0_bias, HasX0BiasConst, [&] {
+                    BOOL_SWITCH(save_stats, SaveStatsConst, [&] {
+                        auto kernel = &ln_fwd_kernel<Kernel_traits, IsDropoutConst, HasColscaleConst, HasSubsetConst, IsEvenColsConst,
+                                                     IsRmsNormConst, HasBetaConst, HasResidualConst, HasX0BiasConst>;
+                        // See the row loop of the persistent kernel for the shapes with several warps in both
+                        // directions.
+                        constexpr bool Has_persistent = Kernel_traits::CTAS_PER_ROW == 1 && !IsDropoutConst && !HasColscaleConst
+                                                     && !HasSubsetConst && IsEvenColsConst
+                                                     && (Kernel_traits::WARPS_M == 1 || Kernel_traits::WARPS_N == 1);
+                        constexpr int persistent_smem_bytes = Kernel_traits::SMEM_BYTES_STAGE_OFFSET + Kernel_traits::SMEM_BYTES_STAGE_X0
+                                                            + (HasResidualConst ? Kernel_traits::SMEM_BYTES_STAGE_RESIDUAL : 0);
                     if( configure_params ) {
                         int ctas_per_sm;
                         CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
@@ -249,6 +850,17 @@ void launch_(LaunchParams<FwdParams> &launch_params, const bool configure_params
                                                           * sizeof(typename Kernel_traits::Stats::stats_t)
                                                           * 2;
                         }
+                        launch_params.persistent_ctas = 0;
+                        if constexpr (Has_persistent) {
+                            auto persistent_kernel = &ln_fwd_persistent_kernel<Kernel_traits, SaveStatsConst, IsRmsNormConst, HasBetaConst, HasResidualConst, HasX0BiasConst>;
+                            if( persistent_smem_bytes >= 48 * 1024 ) {
+                                CHECK_CUDA(cudaFuncSetAttribute(persistent_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, persistent_smem_bytes));
+                            }
+                            int persistent_ctas_per_sm;
+                            CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+                                &persistent_ctas_per_sm, persistent_kernel, Kernel_traits::THREADS_PER_CTA, persistent_smem_bytes));
+                            launch_params.persistent_ctas = launch_params.multi_processor_count * persistent_ctas_per_sm;
+                        }
                         return;
                     }
 
@@ -258,16 +870,94 @@ void launch_(LaunchParams<FwdParams> &launch_params, const bool configure_params
                     auto stream = launch_params.stream;
                     auto ctas_per_col = launch_params.params.ctas_per_col;
 
+                    if constexpr (Has_persistent) {
+                        if( launch_params.persistent_ctas > 0 && launch_params.params.work_counter != nullptr
+                            && size_t(launch_params.params.rows) >= size_t(PERSISTENT_MIN_ROW_LOOPS) * ctas_per_col * Kernel_traits::ROWS_PER_CTA ) {
+                            auto persistent_kernel = &ln_fwd_persistent_kernel<Kernel_traits, SaveStatsConst, IsRmsNormConst, HasBetaConst, HasResidualConst, HasX0BiasConst>;
+                            if( persistent_smem_bytes >= 48 * 1024 ) {
+                                CHECK_CUDA(cudaFuncSetAttribute(persistent_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, persistent_smem_bytes));
+                            }
+                            launch_params.grid_ctas = launch_params.persistent_ctas;
+                            persistent_kernel<<<launch_params.persistent_ctas, Kernel_traits::THREADS_PER_CTA, persistent_smem_bytes, stream>>>(launch_params.params);
+                            launch_params.status = cudaGetLastError();
+                            return;
+                        }
+                    }
+                    launch_params.grid_ctas = Kernel_traits::CTAS_PER_ROW * ctas_per_col;
                     if( Kernel_traits::CTAS_PER_ROW == 1 ) {
                         kernel<<<ctas_per_col, Kernel_traits::THREADS_PER_CTA, Kernel_traits::SMEM_BYTES_FWD, stream>>>(launch_params.params);
+                        launch_params.status = cudaGetLastError();
                     } else {
                         dim3 grid(Kernel_traits::CTAS_PER_ROW * ctas_per_col);
                         dim3 block(Kernel_traits::THREADS_PER_CTA);
                         void *params_ = (void *)&launch_params.params;
-                        cudaLaunchCooperativeKernel((void *)kernel, grid, block, (void **)&params_, Kernel_traits::SMEM_BYTES_FWD, stream);
+                        // The barriers are not back to zero after a launch if a CTA group ran a
+                        // number of rows that is not a multiple of 4, so reset them every launch.
+                        CHECK_CUDA(cudaMemsetAsync(launch_params.params.barrier, 0, launch_params.barrier_size * sizeof(int), stream));
+                        launch_params.status = cudaLaunchCooperativeKernel((void *)kernel, grid, block, (void **)&params_, Kernel_traits::SMEM_BYTES_FWD, stream);
                     }
+                    });
+                    });
+                    });
+                    });
+                    });
                 });
             });
         });
     });
 }
+
+template<
+    typename weight_t,
+    typename input_t,
+    typename residual_t,
+    typename output_t,
+    typename compute_t,
+    typename index_t,
+    int HIDDEN_SIZE,
+    int WARPS_M,
+    int BYTES_PER_LDG
+>
+void launch_subwarp_(LaunchParams<FwdParams> &launch_params, const bool configure_params){
+
+    using Kernel_traits = Kernel_traits_subwarp<weight_t,
+                                                input_t,
+                                                residual_t,
+                                                output_t,
+                                                compute_t,
+                                                index_t,
+                                                HIDDEN_SIZE,
+                                                WARPS_M,
+                                                BYTES_PER_LDG
+                                                >;
+    bool save_stats = launch_params.params.mu != nullptr;
+    bool is_rms_norm = launch_params.params.is_rms_norm;
+    bool has_beta = launch_params.params.beta != nullptr;
+    bool has_residual = launch_params.params.residual != nullptr;
+    BOOL_SWITCH(save_stats, SaveStatsConst, [&] {
+    BOOL_SWITCH(is_rms_norm, IsRmsNormConst, [&] {
+    BOOL_SWITCH(has_beta, HasBetaConst, [&] {
+    BOOL_SWITCH(has_residual, HasResidualConst, [&] {
+        auto kernel = &ln_fwd_subwarp_kernel<Kernel_traits, SaveStatsConst, IsRmsNormConst, HasBetaConst, HasResidualConst>;
+        if( configure_params ) {
+            int ctas_per_sm;
+            CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+                &ctas_per_sm, kernel, Kernel_traits::THREADS_PER_CTA, Kernel_traits::SMEM_BYTES_FWD));
+            launch_params.params.ctas_per_col = launch_params.multi_processor_count * ctas_per_sm;
+            launch_params.elts_per_thread = 0;
+            launch_params.barrier_size = 0;
+            launch_params.workspace_bytes = 0;
+            return;
+        }
+
+        // The decode step only has a few rows per head, do not launch CTAs that have no rows.
+        auto &params = launch_params.params;
+        params.ctas_per_col = std::max(1, std::min(params.ctas_per_col, int(DIVUP(params.rows, Kernel_traits::ROWS_PER_CTA))));
+        launch_params.grid_ctas = params.ctas_per_col;
+        kernel<<<params.ctas_per_col, Kernel_traits::THREADS_PER_CTA, Kernel_traits::SMEM_BYTES_FWD, launch_params.stream>>>(params);
+        launch_params.status = cudaGetLastError();
+    });
+    });
+    });
+    });
+}
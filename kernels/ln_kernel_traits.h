@@ -151,7 +151,11 @@ struct Kernel_traits : public Base {
     enum { ELTS_PER_LDG = BYTES_PER_LDG / sizeof(input_t) };
 
     // Assume that each thread can handle the same number of elements in the output and weights as in the input.
-    static_assert(sizeof(input_t) == sizeof(output_t));
+    // The quantized outputs are narrower, their stores are BYTES_PER_LDG * sizeof(output_t) / sizeof(input_t) wide.
+    enum { IS_QUANTIZED = layer_norm::Quantize<output_t>::IS_QUANTIZED };
+    static_assert(sizeof(input_t) == sizeof(output_t) || IS_QUANTIZED);
+    // The per-row scale is reduced within a CTA.
+    static_assert(CTAS_PER_ROW == 1 || !IS_QUANTIZED);
     static_assert(sizeof(input_t) <= sizeof(residual_t));
     // The number of columns fetched per load from input: one per thread.
     enum { VEC_COLS_PER_LDG =  CTAS_PER_ROW * THREADS_PER_ROW };
@@ -161,10 +165,105 @@ struct Kernel_traits : public Base {
     enum { LDGS = VEC_COLS / VEC_COLS_PER_LDG };
     static_assert(LDGS * VEC_COLS_PER_LDG  == VEC_COLS);
     //static_assert(LDGS * BYTES_PER_ROW_PER_CTA * CTAS_PER_ROW == BYTES_PER_ROW, "");
+    // The half-split rotary pairs of an exact row are in the same thread with an even number of
+    // loads, or in the same warp with a single one. Other shapes do not support rotary embedding.
+    enum { ROPE_PAIRS_IN_THREAD = CTAS_PER_ROW == 1 && LDGS % 2 == 0 };
+    enum { ROPE_PAIRS_IN_WARP = CTAS_PER_ROW == 1 && WARPS_N == 1 && LDGS == 1 };
 
     using Stats = layer_norm::Stats<compute_t, CTAS_PER_ROW, WARPS_M, WARPS_N>;
-    enum { SMEM_BYTES_FWD = Stats::SMEM_BYTES };
+    // Reduces the sum of squares of a row for RMSNorm, in place of the stats.
+    using Rms_reducer = layer_norm::Reducer<compute_t, CTAS_PER_ROW, WARPS_M, WARPS_N>;
+    static_assert(Rms_reducer::SMEM_BYTES <= Stats::SMEM_BYTES);
+    // Reduces the absolute maximum of a row for the per-row scale of the quantized outputs.
+    using Amax_reducer = layer_norm::Reducer<compute_t, 1, WARPS_M, WARPS_N>;
+    enum { SMEM_BYTES_FWD = Stats::SMEM_BYTES + (IS_QUANTIZED ? Amax_reducer::SMEM_BYTES : 0) };
+    // The persistent kernel stages the x0 and residual vectors of the next rows after the reducers.
+    enum { SMEM_BYTES_STAGE_OFFSET = (SMEM_BYTES_FWD + 15) / 16 * 16 };
+    enum { SMEM_BYTES_STAGE_X0 = ROWS_PER_CTA * LDGS * THREADS_PER_ROW * sizeof(Ivec) };
+    enum { SMEM_BYTES_STAGE_RESIDUAL = ROWS_PER_CTA * LDGS * THREADS_PER_ROW * sizeof(Rvec) };
+
+    // The result of the residual add of a row is kept in fp32 registers, see Kernel_traits_packed.
+    enum { IS_PACKED = 0 };
+    using row_t = compute_t;
+    enum { ROW_REGS = LDGS * NUM_ELTS };
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The 16-bit compute variant of a forward kernel. The result of the residual add is kept in pairs
+// of the 16-bit type, which halves the registers that hold a row through the reductions, and the
+// normalization and the affine transform run on the pairs. The statistics are still reduced in
+// fp32 from the rounded sums, see ln_fwd_rows for the accuracy.
+template<typename Base>
+struct Kernel_traits_packed : public Base {
+    using input_t = typename Base::input_t;
+    static_assert(std::is_same<typename Base::weight_t, input_t>::value && std::is_same<typename Base::residual_t, input_t>::value
+                  && std::is_same<typename Base::output_t, input_t>::value);
+    static_assert(sizeof(input_t) == 2 && Base::CTAS_PER_ROW == 1 && Base::NUM_ELTS % 2 == 0);
+
+    enum { IS_PACKED = 1 };
+    using row_t = typename layer_norm::Packed2<input_t>::Type;
+    enum { ROW_REGS = Base::LDGS * Base::NUM_ELTS / 2 };
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Hidden sizes narrower than a warp-wide load, e.g. per-head norms. Each thread does a single load
+// per row, so a row is handled by a group of THREADS_PER_ROW lanes and a warp handles ROWS_PER_WARP
+// rows. Only exact hidden sizes are supported.
+template<
+    typename weight_t_,
+    typename input_t_,
+    typename residual_t_,
+    typename output_t_,
+    typename compute_t_,
+    typename index_t_,
+    uint32_t HIDDEN_SIZE_,
+    uint32_t WARPS_M_,
+    uint32_t BYTES_PER_LDG_ = 16,
+    typename Base = Kernel_traits_base<
+        HIDDEN_SIZE_,
+        weight_t_,
+        input_t_,
+        residual_t_,
+        output_t_,
+        compute_t_,
+        index_t_,
+        WARPS_M_*THREADS_PER_WARP
+        >
+>
+struct Kernel_traits_subwarp : public Base {
+
+    using input_t = typename Base::input_t;
+    using residual_t = typename Base::residual_t;
+    using weight_t = typename Base::weight_t;
+    using compute_t = typename Base::compute_t;
+    using output_t = typename Base::output_t;
+    using index_t = typename Base::index_t;
+
+    enum { WARPS_M = WARPS_M_ };
+    enum { HIDDEN_SIZE = HIDDEN_SIZE_ };
+    enum { BYTES_PER_LDG = BYTES_PER_LDG_ };
+    enum { NUM_ELTS = BYTES_PER_LDG / sizeof(input_t) };
+    enum { ELTS_PER_LDG = NUM_ELTS };
+
+    enum { THREADS_PER_ROW = HIDDEN_SIZE / NUM_ELTS };
+    static_assert(THREADS_PER_ROW * NUM_ELTS == HIDDEN_SIZE);
+    // The lane groups of a row must tile the warp for the shuffle reductions.
+    static_assert(THREADS_PER_ROW <= THREADS_PER_WARP && THREADS_PER_WARP % THREADS_PER_ROW == 0);
+    enum { ROWS_PER_WARP = THREADS_PER_WARP / THREADS_PER_ROW };
+    enum { THREADS_PER_CTA = WARPS_M * THREADS_PER_WARP };
+    enum { ROWS_PER_CTA = WARPS_M * ROWS_PER_WARP };
+    enum { SMEM_BYTES_FWD = 0 };
+
+    using Ivec = layer_norm::Vec<input_t, NUM_ELTS>;
+    using Rvec = layer_norm::Vec<residual_t, NUM_ELTS>;
+    using Ovec = layer_norm::Vec<output_t, NUM_ELTS>;
+    using Wvec = layer_norm::Vec<weight_t, NUM_ELTS>;
 
+    static_assert(sizeof(input_t) == sizeof(output_t));
+    static_assert(sizeof(input_t) <= sizeof(residual_t));
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
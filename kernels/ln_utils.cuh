@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <mutex>
 
 #include <cuda_bf16.h>
 #include <cuda_fp16.h>
@@ -31,14 +34,108 @@ inline void check_cuda_(cudaError_t status, const char *file, int line) {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Asynchronous copies from global to shared memory, see Vec::load_async_from. The host pass and
+// the older architectures see 0.
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+#define LN_HAS_CP_ASYNC 1
+#else
+#define LN_HAS_CP_ASYNC 0
+#endif
+
+// Bulk copies of whole rows through the TMA unit, completed on an mbarrier, see bulk_copy_to_smem.
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 900
+#define LN_HAS_BULK_COPY 1
+#else
+#define LN_HAS_BULK_COPY 0
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Input types left out of the build by build.rs get -DLN_DISABLE_ITYPE_<type>, their registrations
+// expand to nothing and the kernels are not instantiated.
+#ifdef LN_DISABLE_ITYPE_fp32
+#define LN_IF_ITYPE_ENABLED_fp32(...)
+#else
+#define LN_IF_ITYPE_ENABLED_fp32(...) __VA_ARGS__
+#endif
+#ifdef LN_DISABLE_ITYPE_fp16
+#define LN_IF_ITYPE_ENABLED_fp16(...)
+#else
+#define LN_IF_ITYPE_ENABLED_fp16(...) __VA_ARGS__
+#endif
+#ifdef LN_DISABLE_ITYPE_bf16
+#define LN_IF_ITYPE_ENABLED_bf16(...)
+#else
+#define LN_IF_ITYPE_ENABLED_bf16(...) __VA_ARGS__
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The registrations are statements of the register_{fwd,bwd}_<hidden size> functions, that add
+// the launchers to `registry`. The defaults are the same on all devices, the candidates are the
+// alternative shapes that the autotuner benchmarks against them. The _SM candidates are only
+// benchmarked on the devices of compute capability MIN_SM and above.
+#define REGISTER_FWD_LAUNCHER_ENTRY(MIN_SM, CANDIDATE, HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG) \
+    LN_IF_ITYPE_ENABLED_##ITYPE(registry[Types2Key<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE>::get(HIDDEN_SIZE)].push_back({                       \
+        MIN_SM,                                                                                                                            \
+        &launch_<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, uint32_t, HIDDEN_SIZE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG>,                 \
+        { CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG },                                                                                 \
+        CANDIDATE                                                                                                                          \
+    }))
+
 #define REGISTER_FWD_LAUNCHER(HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG)                 \
-    void ln_fwd_##HIDDEN_SIZE##_##WTYPE##_##ITYPE##_##RTYPE##_##OTYPE##_##CTYPE(LaunchParams<FwdParams> &launch_params,                      \
-                                                                                const bool configure_params) {                               \
-        launch_<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, uint32_t, HIDDEN_SIZE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG>(                    \
-            launch_params, configure_params);                                                                                                \
-    }                                                                                                                                        \
-    static FwdRegistrar<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, HIDDEN_SIZE> reg_##HIDDEN_SIZE##_##WTYPE##_##ITYPE##_##RTYPE##_##OTYPE##_##CTYPE( \
-        ln_fwd_##HIDDEN_SIZE##_##WTYPE##_##ITYPE##_##RTYPE##_##OTYPE##_##CTYPE)
+    REGISTER_FWD_LAUNCHER_ENTRY(0, false, HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG)
+
+// Single CTA per row only: the multi-CTA workspace is sized for one warp per CTA.
+#define REGISTER_FWD_CANDIDATE(HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, WARPS_M, WARPS_N, BYTES_PER_LDG)                              \
+    REGISTER_FWD_LAUNCHER_ENTRY(0, true, HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, 1, WARPS_M, WARPS_N, BYTES_PER_LDG)
+
+#define REGISTER_FWD_CANDIDATE_SM(MIN_SM, HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, WARPS_M, WARPS_N, BYTES_PER_LDG)                  \
+    REGISTER_FWD_LAUNCHER_ENTRY(MIN_SM, true, HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, 1, WARPS_M, WARPS_N, BYTES_PER_LDG)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The 16-bit compute variant of a launcher, see Kernel_traits_packed. The compute type of its key is
+// the 16-bit type, the launcher keeps fp32 for the reductions.
+#define REGISTER_FWD_PACKED_LAUNCHER(HIDDEN_SIZE, TYPE, WARPS_M, WARPS_N, BYTES_PER_LDG)                                           \
+    LN_IF_ITYPE_ENABLED_##TYPE(registry[Types2Key<TYPE, TYPE, TYPE, TYPE, TYPE>::get(HIDDEN_SIZE)].push_back({                         \
+        0,                                                                                                                                 \
+        &launch_<TYPE, TYPE, TYPE, TYPE, fp32, uint32_t, HIDDEN_SIZE, 1, WARPS_M, WARPS_N, BYTES_PER_LDG, true>,                           \
+        { 1, WARPS_M, WARPS_N, BYTES_PER_LDG },                                                                                            \
+        false                                                                                                                              \
+    }))
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define REGISTER_FWD_SUBWARP_LAUNCHER(HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, WARPS_M, BYTES_PER_LDG)                              \
+    LN_IF_ITYPE_ENABLED_##ITYPE(registry[Types2Key<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE>::get(HIDDEN_SIZE)].push_back({                       \
+        0,                                                                                                                                 \
+        &launch_subwarp_<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, uint32_t, HIDDEN_SIZE, WARPS_M, BYTES_PER_LDG>,                                \
+        { 1, WARPS_M, 0, BYTES_PER_LDG },                                                                                                  \
+        false                                                                                                                              \
+    }))
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define REGISTER_BWD_LAUNCHER(                                                                                                     \
+    HIDDEN_SIZE, WTYPE, ITYPE, RTYPE, OTYPE, CTYPE, CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG, BYTES_PER_LDG_FINALIZE)       \
+    LN_IF_ITYPE_ENABLED_##ITYPE(registry[Types2Key<WTYPE, ITYPE, RTYPE, OTYPE, CTYPE>::get(HIDDEN_SIZE)].push_back({               \
+        0,                                                                                                                         \
+        &launch_<WTYPE,                                                                                                           \
+                 ITYPE,                                                                                                           \
+                 RTYPE,                                                                                                           \
+                 OTYPE,                                                                                                           \
+                 CTYPE,                                                                                                           \
+                 uint32_t,                                                                                                        \
+                 HIDDEN_SIZE,                                                                                                     \
+                 CTAS_PER_ROW,                                                                                                    \
+                 WARPS_M,                                                                                                         \
+                 WARPS_N,                                                                                                         \
+                 BYTES_PER_LDG,                                                                                                   \
+                 BYTES_PER_LDG_FINALIZE>,                                                                                         \
+        { CTAS_PER_ROW, WARPS_M, WARPS_N, BYTES_PER_LDG },                                                                         \
+        false                                                                                                                      \
+    }))
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -63,6 +160,44 @@ struct Sum {
     }
 };
 
+template<typename T>
+struct Max {
+    inline __device__ Max(){}
+    inline __device__ T operator()(const T &a, const T &b){
+        return a > b ? a : b;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Conversion of the normalized values to the output type. The quantized types saturate to their
+// finite range, the caller divides by the scale before converting.
+template<typename T>
+struct Quantize {
+    enum { IS_QUANTIZED = 0 };
+    static inline __device__ T convert(const float x) {
+        return T(x);
+    }
+};
+
+template<>
+struct Quantize<fp8e4m3> {
+    enum { IS_QUANTIZED = 1 };
+    static constexpr float MAX_VALUE = 448.f;
+    static inline __device__ fp8e4m3 convert(const float x) {
+        return fp8e4m3(x);
+    }
+};
+
+template<>
+struct Quantize<int8> {
+    enum { IS_QUANTIZED = 1 };
+    static constexpr float MAX_VALUE = 127.f;
+    static inline __device__ int8 convert(const float x) {
+        return int8(__float2int_rn(fminf(fmaxf(x, -MAX_VALUE), MAX_VALUE)));
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename T>
@@ -91,6 +226,133 @@ namespace layer_norm {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Compute capability of a device as major * 10 + minor, queried once per device.
+inline int device_sm(const int device) {
+    static std::unordered_map<int, int> sms;
+    static std::mutex sms_mutex;
+
+    std::lock_guard<std::mutex> lock(sms_mutex);
+    auto iter = sms.find(device);
+    if( iter == sms.end() ) {
+        int major, minor;
+        CHECK_CUDA(cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, device));
+        CHECK_CUDA(cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor, device));
+        iter = sms.insert({ device, major * 10 + minor }).first;
+    }
+    return iter->second;
+}
+
+// Returns the default launcher of a key for a device, or nullptr when the key is not registered.
+template<typename Function>
+inline SmLauncher<Function> *select_launcher(std::unordered_map<FunctionKey, std::vector<SmLauncher<Function>>> &registry,
+                                             const uint64_t key, const int device) {
+    auto iter = registry.find(key);
+    if( iter == registry.end() ) {
+        return nullptr;
+    }
+    const int sm = device_sm(device);
+    SmLauncher<Function> *best = nullptr;
+    for( auto &entry : iter->second ) {
+        if( !entry.candidate && entry.min_sm <= sm && (best == nullptr || entry.min_sm > best->min_sm) ) {
+            best = &entry;
+        }
+    }
+    return best;
+}
+
+// Returns the launchers of a key that can run on a device, defaults and candidates, one per shape.
+// A shape registered for several SM generations keeps the entry of the highest one.
+template<typename Function>
+inline std::vector<SmLauncher<Function> *> eligible_launchers(
+    std::unordered_map<FunctionKey, std::vector<SmLauncher<Function>>> &registry, const uint64_t key, const int device) {
+    std::vector<SmLauncher<Function> *> launchers;
+    auto iter = registry.find(key);
+    if( iter == registry.end() ) {
+        return launchers;
+    }
+    const int sm = device_sm(device);
+    for( auto &entry : iter->second ) {
+        if( entry.min_sm > sm ) {
+            continue;
+        }
+        auto same_shape = std::find_if(launchers.begin(), launchers.end(), [&](const SmLauncher<Function> *other) {
+            return other->shape == entry.shape;
+        });
+        if( same_shape == launchers.end() ) {
+            launchers.push_back(&entry);
+        } else if( entry.min_sm > (*same_shape)->min_sm ) {
+            *same_shape = &entry;
+        }
+    }
+    return launchers;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Runs the configure pass of a launcher on a device.
+template<typename Params, typename Function>
+inline LaunchPlan make_launch_plan(Function &launcher, LaunchParams<Params> &launch_params, const int device) {
+    int multi_processor_count;
+    CHECK_CUDA(cudaDeviceGetAttribute(&multi_processor_count, cudaDevAttrMultiProcessorCount, device));
+    launch_params.multi_processor_count = multi_processor_count;
+
+    // Query the kernel-specific launch parameters.
+    launcher(launch_params, true);
+
+    LaunchPlan plan;
+    plan.ctas_per_col = launch_params.params.ctas_per_col;
+    plan.workspace_bytes = launch_params.workspace_bytes;
+    plan.barrier_size = launch_params.barrier_size;
+    plan.multi_processor_count = multi_processor_count;
+    plan.persistent_ctas = launch_params.persistent_ctas;
+    return plan;
+}
+
+// elts_per_thread is not restored: it depends on the number of rows and is not used by the
+// launchers.
+template<typename Params>
+inline void apply_launch_plan(const LaunchPlan &plan, LaunchParams<Params> &launch_params) {
+    launch_params.params.ctas_per_col = plan.ctas_per_col;
+    launch_params.workspace_bytes = plan.workspace_bytes;
+    launch_params.barrier_size = plan.barrier_size;
+    launch_params.multi_processor_count = plan.multi_processor_count;
+    launch_params.persistent_ctas = plan.persistent_ctas;
+}
+
+// Runs the configure pass of a launcher the first time a (kernel specialization, device) pair is
+// seen and caches the result, so that steady-state launches do not query the device anymore.
+template<typename Params, typename Function>
+inline void configure_launch(Function &launcher, LaunchParams<Params> &launch_params, const PlanKey &key) {
+    static PlanCache<> plans;
+    static std::mutex plans_mutex;
+
+    std::lock_guard<std::mutex> lock(plans_mutex);
+    auto iter = plans.find(key);
+    if( iter == plans.end() ) {
+        iter = plans.insert({ key, make_launch_plan(launcher, launch_params, key.device) }).first;
+    }
+    apply_launch_plan(iter->second, launch_params);
+}
+
+// The same with the plan held by the caller, whose steady-state launches then only load the slot.
+// Two launches that configure the same slot at once compute the same plan, the second one drops
+// its copy. The published plans are never freed, like the tables that hold them.
+template<typename Params, typename Function>
+inline void configure_launch(Function &launcher, LaunchParams<Params> &launch_params, const int device, PlanSlot &slot) {
+    const LaunchPlan *plan = slot.load(std::memory_order_acquire);
+    if( plan == nullptr ) {
+        const LaunchPlan *configured = new LaunchPlan(make_launch_plan(launcher, launch_params, device));
+        if( slot.compare_exchange_strong(plan, configured, std::memory_order_acq_rel, std::memory_order_acquire) ) {
+            plan = configured;
+        } else {
+            delete configured;
+        }
+    }
+    apply_launch_plan(*plan, launch_params);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 struct uint16 {
     uint4 u;
     uint4 v;
@@ -154,6 +416,52 @@ struct BytesToType<1> {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Counter-based Philox4x32-10 (Salmon et al., 2011), the generator of curand's Philox state. The
+// dropout mask only depends on the seed, the offset and the element index, not on the launch
+// configuration, so it can be regenerated.
+inline __device__ uint4 philox4x32_10(uint4 ctr, uint2 key) {
+    constexpr uint32_t M0 = 0xD2511F53;
+    constexpr uint32_t M1 = 0xCD9E8D57;
+    #pragma unroll
+    for( int it = 0; it < 10; it++ ) {
+        const uint32_t hi0 = __umulhi(M0, ctr.x);
+        const uint32_t hi1 = __umulhi(M1, ctr.z);
+        ctr = make_uint4(hi1 ^ ctr.y ^ key.x, M1 * ctr.z, hi0 ^ ctr.w ^ key.y, M0 * ctr.x);
+        key.x += 0x9E3779B9;
+        key.y += 0xBB67AE85;
+    }
+    return ctr;
+}
+
+// Four random words for the elements 4 * group to 4 * group + 3.
+inline __device__ uint4 dropout_rand4(const uint64_t seed, const uint64_t offset, const uint64_t group) {
+    return philox4x32_10(make_uint4(uint32_t(group), uint32_t(group >> 32), uint32_t(offset), uint32_t(offset >> 32)),
+                         make_uint2(uint32_t(seed), uint32_t(seed >> 32)));
+}
+
+// Stores the NUM_ELTS keep bits of a vector starting at element elt of a bit-packed mask, element
+// i being bit i % 32 of word i / 32. Vectors of 8 or more elements cover whole bytes, smaller ones
+// share their byte and are or-ed into a zero-initialized mask.
+template<int NUM_ELTS>
+inline __device__ void store_mask_bits(void *dmask, const uint64_t elt, const uint32_t bits) {
+    static_assert(NUM_ELTS <= 32 && 32 % NUM_ELTS == 0);
+    if constexpr (NUM_ELTS % 8 == 0) {
+        using T = typename BytesToType<NUM_ELTS / 8>::Type;
+        static_cast<T *>(dmask)[elt / NUM_ELTS] = T(bits);
+    } else {
+        atomicOr(static_cast<uint32_t *>(dmask) + elt / 32, bits << (elt % 32));
+    }
+}
+
+template<int NUM_ELTS>
+inline __device__ uint32_t load_mask_bits(const void *dmask, const uint64_t elt) {
+    static_assert(NUM_ELTS <= 32 && 32 % NUM_ELTS == 0);
+    const uint32_t word = static_cast<const uint32_t *>(dmask)[elt / 32];
+    return NUM_ELTS == 32 ? word : (word >> (elt % 32)) & ((1u << NUM_ELTS) - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<typename T>
 struct TypeToVec2 {};
 
@@ -174,6 +482,28 @@ struct TypeToVec2<nv_bfloat16> {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// The pairs of the 16-bit normalization of Kernel_traits_packed.
+template<typename T>
+struct Packed2 {};
+
+template<>
+struct Packed2<half> {
+    using Type = half2;
+    static inline __device__ Type splat(const float v) { return __float2half2_rn(v); }
+    static inline __device__ float2 to_float2(const Type v) { return __half22float2(v); }
+    static inline __device__ float max_finite() { return 65504.f; }
+};
+
+template<>
+struct Packed2<nv_bfloat16> {
+    using Type = nv_bfloat162;
+    static inline __device__ Type splat(const float v) { return __float2bfloat162_rn(v); }
+    static inline __device__ float2 to_float2(const Type v) { return __bfloat1622float2(v); }
+    static inline __device__ float max_finite() { return 3.3895313892515355e38f; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<int INDEX>
 struct Get {
     template<typename T, typename R>
@@ -300,8 +630,81 @@ struct Vec {
     inline __device__ void store_to(void *base_ptr, const size_t idx) {
         static_cast<Vec_type *>(base_ptr)[idx] = this->data.vec;
     }
+
+    // Load of a vector in shared memory that completes at the next cp_async_wait_all. Before sm80,
+    // and for vectors narrower than 4 bytes, it is an ordinary load.
+    inline __device__ void load_async_from(const void *base_ptr, const size_t idx) {
+#if LN_HAS_CP_ASYNC
+        if constexpr (BYTES % 4 == 0) {
+            enum { CHUNK = BYTES < 16 ? BYTES : 16 };
+            const char *src = reinterpret_cast<const char *>(static_cast<const Vec_type *>(base_ptr) + idx);
+            const uint32_t dst = uint32_t(__cvta_generic_to_shared(&this->data));
+            #pragma unroll
+            for( int it = 0; it < BYTES; it += CHUNK ) {
+                asm volatile("cp.async.ca.shared.global [%0], [%1], %2;\n" :: "r"(dst + it), "l"(src + it), "n"(int(CHUNK)) : "memory");
+            }
+            return;
+        }
+#endif
+        load_from(base_ptr, idx);
+    }
 };
 
+inline __device__ void cp_async_wait_all() {
+#if LN_HAS_CP_ASYNC
+    asm volatile("cp.async.wait_all;\n" ::: "memory");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// An mbarrier in shared memory that a single thread arms for the bytes of its bulk copies, every
+// thread that reads the copied data waits on its phase. All of them are no-ops before sm90.
+inline __device__ void mbarrier_init(uint64_t *bar) {
+#if LN_HAS_BULK_COPY
+    const uint32_t addr = uint32_t(__cvta_generic_to_shared(bar));
+    asm volatile("mbarrier.init.shared::cta.b64 [%0], 1;\n" :: "r"(addr) : "memory");
+#endif
+}
+
+inline __device__ void mbarrier_expect_tx(uint64_t *bar, const uint32_t bytes) {
+#if LN_HAS_BULK_COPY
+    const uint32_t addr = uint32_t(__cvta_generic_to_shared(bar));
+    asm volatile("mbarrier.arrive.expect_tx.shared::cta.b64 _, [%0], %1;\n" :: "r"(addr), "r"(bytes) : "memory");
+#endif
+}
+
+inline __device__ void mbarrier_wait(uint64_t *bar, const uint32_t parity) {
+#if LN_HAS_BULK_COPY
+    const uint32_t addr = uint32_t(__cvta_generic_to_shared(bar));
+    uint32_t done = 0;
+    while( !done ) {
+        asm volatile("{\n"
+                     ".reg .pred p;\n"
+                     "mbarrier.try_wait.parity.shared::cta.b64 p, [%1], %2;\n"
+                     "selp.u32 %0, 1, 0, p;\n"
+                     "}\n" : "=r"(done) : "r"(addr), "r"(parity) : "memory");
+    }
+#endif
+}
+
+// Orders the earlier accesses of the thread to shared memory before its next bulk copies.
+inline __device__ void fence_proxy_async() {
+#if LN_HAS_BULK_COPY
+    asm volatile("fence.proxy.async.shared::cta;\n" ::: "memory");
+#endif
+}
+
+// Copies bytes, a multiple of 16 with both addresses 16-byte aligned, from gmem to smem.
+inline __device__ void bulk_copy_to_smem(void *dst, const void *src, const uint32_t bytes, uint64_t *bar) {
+#if LN_HAS_BULK_COPY
+    const uint32_t dst_addr = uint32_t(__cvta_generic_to_shared(dst));
+    const uint32_t bar_addr = uint32_t(__cvta_generic_to_shared(bar));
+    asm volatile("cp.async.bulk.shared::cluster.global.mbarrier::complete_tx::bytes [%0], [%1], %2, [%3];\n"
+                 :: "r"(dst_addr), "l"(src), "r"(bytes), "r"(bar_addr) : "memory");
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<uint32_t CTAS_PER_ROW>
@@ -513,6 +916,24 @@ struct Reducer<T, 1, WARPS_M, WARPS_N> : public Reducer<T, 1, WARPS_M, 1> {
 
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reduction over aligned groups of THREADS lanes of a warp, all lanes of the warp must enter. The
+// xor butterfly never leaves the group, all the lanes of a group get the result.
+template<typename T, uint32_t THREADS>
+struct Subwarp_reducer {
+    static_assert((THREADS & (THREADS - 1)) == 0 && THREADS <= 32);
+
+    template<typename Op>
+    static inline __device__ T allreduce(T data, Op &op) {
+        #pragma unroll
+        for( int it = 1; it < THREADS; it *= 2 ) {
+            data = op(data, warp_shuffle_xor(data, it));
+        }
+        return data;
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
  
 template<typename T, typename int_t>
@@ -528,8 +949,10 @@ inline __device__ void warp_chan_upd_dynamic(T &m_a, T &m2_a, int_t &n_a, int nu
         T m2_b = warp_shuffle_down(m2_a, step);
 
         // Update
-        const int_t n_ab = n_a + n_b; // We can handle one of them being 0, not both.
-        const T rn_ab = 1.f / n_ab; // Might have different n per thread, otherwise this would simplify :(
+        const int_t n_ab = n_a + n_b;
+        // Might have different n per thread, otherwise this would simplify :( Two empty warps, with
+        // an uneven number of columns, merge into an empty one.
+        const T rn_ab = n_ab > 0 ? 1.f / n_ab : 0.f;
         const T delta = m_a - m_b;
         const float m2_ab = m2_a + m2_b + delta * delta * n_a * n_b * rn_ab;
         const float m_ab = (n_a * m_a + n_b * m_b) * rn_ab;
@@ -567,12 +990,17 @@ struct Stats {
     {
     }
 
-    template<uint32_t N>
-    inline __device__ stats_t compute(const T (&elts)[N], const T rn) {
+    // Multi-CTA launches are only used with cols == HIDDEN_SIZE (see run_ln), so every CTA of the
+    // group holds the same number of valid elements.
+    template<bool Is_even_cols, uint32_t N, typename function_t>
+    inline __device__ stats_t compute(const T (&elts)[N], const T rn,
+                                      function_t valid_elts_in_warp_fn, const int num_valid_elts = N) {
         constexpr T ELTS_PER_ROW_PER_CTA = N * WARPS_N * THREADS_PER_WARP;
         // TODO rn is not really needed here..
         constexpr T block_rn = 1.f / T(ELTS_PER_ROW_PER_CTA);
-        stats_t block_stats = block_stats_.compute(elts, block_rn);
+        stats_t block_stats = block_stats_.template compute<Is_even_cols>(
+            elts, block_rn, valid_elts_in_warp_fn, num_valid_elts
+        );
 
         stats_t *workspace = inter_cta_.phase_counter_ & 0x1 ? w1_ : w0_;
 
@@ -639,7 +1067,9 @@ struct Stats<T, 1, WARPS_M, WARPS_N> {
         use0_ = !use0_;
         // Compute warp local for all WARPS_N
         const auto warp_n = warp_stats_.reducer_.warp_n_;
-        const T warp_norm_factor = 1.f / T(Is_even_cols ? N * THREADS_PER_WARP : valid_elts_in_warp_fn(warp_n));
+        // With uneven columns the last warps of a row can have no valid elements, their stats are 0.
+        const int warp_elts = Is_even_cols ? N * THREADS_PER_WARP : valid_elts_in_warp_fn(warp_n);
+        const T warp_norm_factor = warp_elts > 0 ? 1.f / T(warp_elts) : 0.f;
         stats_t warp_stats = warp_stats_.template compute<Is_even_cols>(
             elts, warp_norm_factor, valid_elts_in_warp_fn, num_valid_elts
         );
@@ -0,0 +1,588 @@
+//! The forward pass of [`LayerNorm`] on the cpu.
+//!
+//! The rows are split over the rayon pool. Each row is widened to f32, normalized with the
+//! widest vector unit of the host, AVX-512 or AVX2 on x86_64 and NEON on aarch64, and narrowed
+//! back to the dtype of the input.
+
+use crate::{LayerNorm, LayerNormStats};
+use candle_core::backend::BackendStorage;
+use candle_core::{CpuStorage, DType, Layout, Result, Shape, Tensor, TensorId, WithDType};
+use half::slice::HalfFloatSliceExt;
+use half::{bf16, f16};
+use rayon::prelude::*;
+use std::borrow::Cow;
+
+/// Number of elements below which rows are not split into separate rayon tasks.
+const MIN_TASK_ELEMS: usize = 1 << 14;
+
+/// The dtypes of the cpu path and their conversions from and to f32.
+trait CpuDType: WithDType + Send + Sync {
+    fn to_f32(src: &[Self], dst: &mut [f32]);
+    fn from_f32(src: &[f32], dst: &mut [Self]);
+}
+
+impl CpuDType for f32 {
+    fn to_f32(src: &[Self], dst: &mut [f32]) {
+        dst.copy_from_slice(src)
+    }
+
+    fn from_f32(src: &[f32], dst: &mut [Self]) {
+        dst.copy_from_slice(src)
+    }
+}
+
+impl CpuDType for f16 {
+    fn to_f32(src: &[Self], dst: &mut [f32]) {
+        src.convert_to_f32_slice(dst)
+    }
+
+    fn from_f32(src: &[f32], dst: &mut [Self]) {
+        dst.convert_from_f32_slice(src)
+    }
+}
+
+impl CpuDType for bf16 {
+    fn to_f32(src: &[Self], dst: &mut [f32]) {
+        src.convert_to_f32_slice(dst)
+    }
+
+    fn from_f32(src: &[f32], dst: &mut [Self]) {
+        dst.convert_from_f32_slice(src)
+    }
+}
+
+/// The elements of a storage in the row-major order of its layout, copied if it is strided.
+fn contiguous<'a, T: Clone>(data: &'a [T], l: &Layout) -> Cow<'a, [T]> {
+    match l.contiguous_offsets() {
+        Some((start, end)) => Cow::Borrowed(&data[start..end]),
+        None => Cow::Owned(l.strided_index().map(|i| data[i].clone()).collect()),
+    }
+}
+
+/// Copies the statistics computed on the cpu into the caller buffers.
+struct WriteStats<'a>(&'a [f32]);
+
+impl candle_core::InplaceOp1 for WriteStats<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-stats"
+    }
+
+    fn cpu_fwd(&self, s: &mut CpuStorage, l: &Layout) -> Result<()> {
+        match (s, l.contiguous_offsets()) {
+            (CpuStorage::F32(s), Some((start, end))) if end - start == self.0.len() => {
+                s[start..end].copy_from_slice(self.0)
+            }
+            _ => candle_core::bail!(
+                "the statistics must be contiguous f32 buffers of {} rows",
+                self.0.len()
+            ),
+        }
+        Ok(())
+    }
+}
+
+/// gamma and beta widened to f32, once by [`LayerNorm::new`] for cpu weights.
+pub(crate) struct Weights {
+    ids: (TensorId, Option<TensorId>),
+    gamma: Vec<f32>,
+    beta: Option<Vec<f32>>,
+}
+
+impl Weights {
+    pub(crate) fn new(gamma: &Tensor, beta: Option<&Tensor>) -> Result<Self> {
+        let widen = |t: &Tensor| t.to_dtype(DType::F32)?.flatten_all()?.to_vec1::<f32>();
+        Ok(Self {
+            ids: (gamma.id(), beta.map(|b| b.id())),
+            gamma: widen(gamma)?,
+            beta: beta.map(widen).transpose()?,
+        })
+    }
+
+    /// Whether these are the weights of `ln`, whose fields may have been replaced since.
+    fn of(&self, ln: &LayerNorm) -> bool {
+        self.ids == (ln.gamma.id(), ln.beta.as_ref().map(|b| b.id()))
+    }
+}
+
+/// The normalization of one row.
+struct RowNorm<'a> {
+    gamma: &'a [f32],
+    beta: Option<&'a [f32]>,
+    epsilon: f32,
+    is_rms_norm: bool,
+}
+
+impl RowNorm<'_> {
+    /// Normalizes `x + r` into `z`, writes the sum to `add` when given and returns the mean and
+    /// the inverse standard deviation. `buf` and `tmp` are f32 scratch rows.
+    fn row<T: CpuDType>(
+        &self,
+        x: &[T],
+        r: Option<&[T]>,
+        z: &mut [T],
+        add: Option<&mut [T]>,
+        buf: &mut [f32],
+        tmp: &mut [f32],
+    ) -> (f32, f32) {
+        let cols = x.len() as f32;
+        T::to_f32(x, buf);
+        if let Some(r) = r {
+            T::to_f32(r, tmp);
+            simd::add(buf, tmp);
+        }
+        if let Some(add) = add {
+            T::from_f32(buf, add);
+        }
+
+        let mu = if self.is_rms_norm {
+            0.
+        } else {
+            simd::sum(buf) / cols
+        };
+        let var = simd::sum_sq_diff(buf, mu) / cols;
+        let rsigma = 1. / (var + self.epsilon).sqrt();
+
+        simd::normalize(buf, mu, rsigma, self.gamma, self.beta);
+        T::from_f32(buf, z);
+        (mu, rsigma)
+    }
+}
+
+fn fwd_t<T: CpuDType>(
+    norm: &RowNorm,
+    x: &[T],
+    r: Option<&[T]>,
+    cols: usize,
+    out: &mut [T],
+) -> Vec<(f32, f32)> {
+    let rows = x.len() / cols;
+    let min_len = MIN_TASK_ELEMS / cols + 1;
+    let init = || (vec![0f32; cols], vec![0f32; cols]);
+    let (z, add) = out.split_at_mut(rows * cols);
+    let x = x.par_chunks(cols);
+    match r {
+        Some(r) => x
+            .zip(r.par_chunks(cols))
+            .zip(z.par_chunks_mut(cols))
+            .zip(add.par_chunks_mut(cols))
+            .with_min_len(min_len)
+            .map_init(init, |(buf, tmp), (((x, r), z), add)| {
+                norm.row(x, Some(r), z, Some(add), buf, tmp)
+            })
+            .collect(),
+        None => x
+            .zip(z.par_chunks_mut(cols))
+            .with_min_len(min_len)
+            .map_init(init, |(buf, tmp), (x, z)| {
+                norm.row(x, None, z, None, buf, tmp)
+            })
+            .collect(),
+    }
+}
+
+fn fwd_storage<T: CpuDType>(
+    norm: &RowNorm,
+    x: &[T],
+    x_l: &Layout,
+    r: Option<(&[T], &Layout)>,
+    out_len: usize,
+) -> (CpuStorage, Vec<(f32, f32)>) {
+    let cols = x_l.dims()[x_l.dims().len() - 1];
+    let x = contiguous(x, x_l);
+    let r = r.map(|(r, r_l)| contiguous(r, r_l));
+    let mut out = vec![T::from_f64(0.); out_len];
+    let stats = fwd_t(norm, &x, r.as_deref(), cols, &mut out);
+    (T::to_cpu_storage_owned(out), stats)
+}
+
+/// Runs the forward pass of `ln` on cpu storages, with the outputs laid out as on cuda.
+pub(crate) fn fwd(
+    ln: &LayerNorm,
+    x: &CpuStorage,
+    x_l: &Layout,
+    r: Option<(&CpuStorage, &Layout)>,
+) -> Result<(CpuStorage, Shape)> {
+    let dtype = x.dtype();
+    let residual_dtype = r.map_or(dtype, |(r, _)| r.dtype());
+    crate::check_fwd_dtypes(ln.gamma.dtype(), dtype, residual_dtype)?;
+    // The residuals of another dtype are only updated in place on cuda
+    if residual_dtype != dtype {
+        candle_core::bail!(
+            "the cpu forward pass requires a residual of the dtype of x, got a \
+             {residual_dtype:?} residual with {dtype:?} inputs"
+        )
+    }
+
+    let dims = x_l.dims();
+    if dims.len() < 2 {
+        candle_core::bail!("x must have a rank >= 2, got {:?}", x_l.shape())
+    }
+    let cols = dims[dims.len() - 1];
+    let rows = x_l.shape().elem_count() / cols;
+    if let Some((_, r_l)) = r {
+        if r_l.dims() != dims {
+            candle_core::bail!("shape mismatch x {:?} and r {:?}", x_l.shape(), r_l.shape());
+        }
+    }
+
+    let widened;
+    let weights = match &ln.cpu_weights {
+        Some(w) if w.of(ln) => w.as_ref(),
+        _ => {
+            widened = Weights::new(&ln.gamma, ln.beta.as_ref())?;
+            &widened
+        }
+    };
+    let check_len = |t: &[f32], name: &str| -> Result<()> {
+        if t.len() != cols {
+            candle_core::bail!("{name} must have {cols} elements, got {}", t.len())
+        }
+        Ok(())
+    };
+    check_len(&weights.gamma, "gamma")?;
+    if let Some(beta) = &weights.beta {
+        check_len(beta, "beta")?;
+    }
+    let norm = RowNorm {
+        gamma: &weights.gamma,
+        beta: weights.beta.as_deref(),
+        epsilon: ln.epsilon,
+        is_rms_norm: ln.is_rms_norm,
+    };
+
+    // With a residual, the results of the residual add follow the main results as on cuda
+    let mut out_dims = dims.to_vec();
+    if r.is_some() {
+        out_dims[0] *= 2;
+    }
+    let out_shape = Shape::from(out_dims);
+
+    let (out, stats) = match (x, r) {
+        (CpuStorage::F32(x), None) => fwd_storage(&norm, x, x_l, None, out_shape.elem_count()),
+        (CpuStorage::F16(x), None) => fwd_storage(&norm, x, x_l, None, out_shape.elem_count()),
+        (CpuStorage::BF16(x), None) => fwd_storage(&norm, x, x_l, None, out_shape.elem_count()),
+        (CpuStorage::F32(x), Some((CpuStorage::F32(r), r_l))) => {
+            fwd_storage(&norm, x, x_l, Some((r, r_l)), out_shape.elem_count())
+        }
+        (CpuStorage::F16(x), Some((CpuStorage::F16(r), r_l))) => {
+            fwd_storage(&norm, x, x_l, Some((r, r_l)), out_shape.elem_count())
+        }
+        (CpuStorage::BF16(x), Some((CpuStorage::BF16(r), r_l))) => {
+            fwd_storage(&norm, x, x_l, Some((r, r_l)), out_shape.elem_count())
+        }
+        _ => candle_core::bail!(
+            "fused-layer-norm is only supported for f32, f16 and bf16 ({dtype:?})"
+        ),
+    };
+
+    if let LayerNormStats::Buffers { mu, rsigma } = &ln.stats {
+        debug_assert_eq!(stats.len(), rows);
+        let (mu_rows, rsigma_rows): (Vec<f32>, Vec<f32>) = stats.into_iter().unzip();
+        mu.inplace_op1(&WriteStats(&mu_rows))?;
+        rsigma.inplace_op1(&WriteStats(&rsigma_rows))?;
+    }
+    Ok((out, out_shape))
+}
+
+/// The f32 row kernels, dispatched on the vector extensions of the host.
+mod simd {
+    /// Sum of the elements of `x`.
+    pub fn sum(x: &[f32]) -> f32 {
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx512f") {
+                return unsafe { x86::sum_avx512(x) };
+            }
+            if is_x86_feature_detected!("avx2") {
+                return unsafe { x86::sum_avx2(x) };
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            return unsafe { neon::sum(x) };
+        }
+        #[allow(unreachable_code)]
+        x.iter().sum()
+    }
+
+    /// Sum of the squared differences of the elements of `x` to `mu`.
+    pub fn sum_sq_diff(x: &[f32], mu: f32) -> f32 {
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx512f") {
+                return unsafe { x86::sum_sq_diff_avx512(x, mu) };
+            }
+            if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("fma") {
+                return unsafe { x86::sum_sq_diff_avx2(x, mu) };
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            return unsafe { neon::sum_sq_diff(x, mu) };
+        }
+        #[allow(unreachable_code)]
+        x.iter().map(|x| (x - mu) * (x - mu)).sum()
+    }
+
+    /// Adds `r` to `x`.
+    pub fn add(x: &mut [f32], r: &[f32]) {
+        assert_eq!(x.len(), r.len());
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx512f") {
+                return unsafe { x86::add_avx512(x, r) };
+            }
+            if is_x86_feature_detected!("avx2") {
+                return unsafe { x86::add_avx2(x, r) };
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            return unsafe { neon::add(x, r) };
+        }
+        #[allow(unreachable_code)]
+        for (x, r) in x.iter_mut().zip(r) {
+            *x += r
+        }
+    }
+
+    /// Replaces `x` with `(x - mu) * rsigma * gamma + beta`.
+    pub fn normalize(x: &mut [f32], mu: f32, rsigma: f32, gamma: &[f32], beta: Option<&[f32]>) {
+        assert_eq!(x.len(), gamma.len());
+        assert!(beta.map_or(true, |b| b.len() == x.len()));
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx512f") {
+                return unsafe { x86::normalize_avx512(x, mu, rsigma, gamma, beta) };
+            }
+            if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("fma") {
+                return unsafe { x86::normalize_avx2(x, mu, rsigma, gamma, beta) };
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            return unsafe { neon::normalize(x, mu, rsigma, gamma, beta) };
+        }
+        #[allow(unreachable_code)]
+        normalize_tail(x, mu, rsigma, gamma, beta, 0)
+    }
+
+    /// The scalar normalization of the elements from `start` on.
+    fn normalize_tail(
+        x: &mut [f32],
+        mu: f32,
+        rsigma: f32,
+        gamma: &[f32],
+        beta: Option<&[f32]>,
+        start: usize,
+    ) {
+        for i in start..x.len() {
+            let b = beta.map_or(0., |b| b[i]);
+            x[i] = (x[i] - mu) * rsigma * gamma[i] + b;
+        }
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    mod x86 {
+        use std::arch::x86_64::*;
+
+        #[target_feature(enable = "avx512f")]
+        pub unsafe fn sum_avx512(x: &[f32]) -> f32 {
+            let n = x.len() / 16 * 16;
+            let mut acc = _mm512_setzero_ps();
+            for i in (0..n).step_by(16) {
+                acc = _mm512_add_ps(acc, _mm512_loadu_ps(x.as_ptr().add(i)));
+            }
+            _mm512_reduce_add_ps(acc) + x[n..].iter().sum::<f32>()
+        }
+
+        #[target_feature(enable = "avx512f")]
+        pub unsafe fn sum_sq_diff_avx512(x: &[f32], mu: f32) -> f32 {
+            let n = x.len() / 16 * 16;
+            let mu_v = _mm512_set1_ps(mu);
+            let mut acc = _mm512_setzero_ps();
+            for i in (0..n).step_by(16) {
+                let d = _mm512_sub_ps(_mm512_loadu_ps(x.as_ptr().add(i)), mu_v);
+                acc = _mm512_fmadd_ps(d, d, acc);
+            }
+            let tail: f32 = x[n..].iter().map(|x| (x - mu) * (x - mu)).sum();
+            _mm512_reduce_add_ps(acc) + tail
+        }
+
+        #[target_feature(enable = "avx512f")]
+        pub unsafe fn add_avx512(x: &mut [f32], r: &[f32]) {
+            let n = x.len() / 16 * 16;
+            for i in (0..n).step_by(16) {
+                let p = x.as_mut_ptr().add(i);
+                _mm512_storeu_ps(
+                    p,
+                    _mm512_add_ps(_mm512_loadu_ps(p), _mm512_loadu_ps(r.as_ptr().add(i))),
+                );
+            }
+            for i in n..x.len() {
+                x[i] += r[i]
+            }
+        }
+
+        #[target_feature(enable = "avx512f")]
+        pub unsafe fn normalize_avx512(
+            x: &mut [f32],
+            mu: f32,
+            rsigma: f32,
+            gamma: &[f32],
+            beta: Option<&[f32]>,
+        ) {
+            let n = x.len() / 16 * 16;
+            let mu_v = _mm512_set1_ps(mu);
+            let rsigma_v = _mm512_set1_ps(rsigma);
+            for i in (0..n).step_by(16) {
+                let p = x.as_mut_ptr().add(i);
+                let y = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(p), mu_v), rsigma_v);
+                let b = match beta {
+                    Some(b) => _mm512_loadu_ps(b.as_ptr().add(i)),
+                    None => _mm512_setzero_ps(),
+                };
+                _mm512_storeu_ps(
+                    p,
+                    _mm512_fmadd_ps(y, _mm512_loadu_ps(gamma.as_ptr().add(i)), b),
+                );
+            }
+            super::normalize_tail(x, mu, rsigma, gamma, beta, n)
+        }
+
+        #[target_feature(enable = "avx")]
+        unsafe fn reduce_add_256(v: __m256) -> f32 {
+            let s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps::<1>(v));
+            let s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            let s = _mm_add_ss(s, _mm_shuffle_ps::<1>(s, s));
+            _mm_cvtss_f32(s)
+        }
+
+        #[target_feature(enable = "avx2")]
+        pub unsafe fn sum_avx2(x: &[f32]) -> f32 {
+            let n = x.len() / 8 * 8;
+            let mut acc = _mm256_setzero_ps();
+            for i in (0..n).step_by(8) {
+                acc = _mm256_add_ps(acc, _mm256_loadu_ps(x.as_ptr().add(i)));
+            }
+            reduce_add_256(acc) + x[n..].iter().sum::<f32>()
+        }
+
+        #[target_feature(enable = "avx2,fma")]
+        pub unsafe fn sum_sq_diff_avx2(x: &[f32], mu: f32) -> f32 {
+            let n = x.len() / 8 * 8;
+            let mu_v = _mm256_set1_ps(mu);
+            let mut acc = _mm256_setzero_ps();
+            for i in (0..n).step_by(8) {
+                let d = _mm256_sub_ps(_mm256_loadu_ps(x.as_ptr().add(i)), mu_v);
+                acc = _mm256_fmadd_ps(d, d, acc);
+            }
+            let tail: f32 = x[n..].iter().map(|x| (x - mu) * (x - mu)).sum();
+            reduce_add_256(acc) + tail
+        }
+
+        #[target_feature(enable = "avx2")]
+        pub unsafe fn add_avx2(x: &mut [f32], r: &[f32]) {
+            let n = x.len() / 8 * 8;
+            for i in (0..n).step_by(8) {
+                let p = x.as_mut_ptr().add(i);
+                _mm256_storeu_ps(
+                    p,
+                    _mm256_add_ps(_mm256_loadu_ps(p), _mm256_loadu_ps(r.as_ptr().add(i))),
+                );
+            }
+            for i in n..x.len() {
+                x[i] += r[i]
+            }
+        }
+
+        #[target_feature(enable = "avx2,fma")]
+        pub unsafe fn normalize_avx2(
+            x: &mut [f32],
+            mu: f32,
+            rsigma: f32,
+            gamma: &[f32],
+            beta: Option<&[f32]>,
+        ) {
+            let n = x.len() / 8 * 8;
+            let mu_v = _mm256_set1_ps(mu);
+            let rsigma_v = _mm256_set1_ps(rsigma);
+            for i in (0..n).step_by(8) {
+                let p = x.as_mut_ptr().add(i);
+                let y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(p), mu_v), rsigma_v);
+                let b = match beta {
+                    Some(b) => _mm256_loadu_ps(b.as_ptr().add(i)),
+                    None => _mm256_setzero_ps(),
+                };
+                _mm256_storeu_ps(
+                    p,
+                    _mm256_fmadd_ps(y, _mm256_loadu_ps(gamma.as_ptr().add(i)), b),
+                );
+            }
+            super::normalize_tail(x, mu, rsigma, gamma, beta, n)
+        }
+    }
+
+    #[cfg(target_arch = "aarch64")]
+    mod neon {
+        use std::arch::aarch64::*;
+
+        #[target_feature(enable = "neon")]
+        pub unsafe fn sum(x: &[f32]) -> f32 {
+            let n = x.len() / 4 * 4;
+            let mut acc = vdupq_n_f32(0.);
+            for i in (0..n).step_by(4) {
+                acc = vaddq_f32(acc, vld1q_f32(x.as_ptr().add(i)));
+            }
+            vaddvq_f32(acc) + x[n..].iter().sum::<f32>()
+        }
+
+        #[target_feature(enable = "neon")]
+        pub unsafe fn sum_sq_diff(x: &[f32], mu: f32) -> f32 {
+            let n = x.len() / 4 * 4;
+            let mu_v = vdupq_n_f32(mu);
+            let mut acc = vdupq_n_f32(0.);
+            for i in (0..n).step_by(4) {
+                let d = vsubq_f32(vld1q_f32(x.as_ptr().add(i)), mu_v);
+                acc = vfmaq_f32(acc, d, d);
+            }
+            let tail: f32 = x[n..].iter().map(|x| (x - mu) * (x - mu)).sum();
+            vaddvq_f32(acc) + tail
+        }
+
+        #[target_feature(enable = "neon")]
+        pub unsafe fn add(x: &mut [f32], r: &[f32]) {
+            let n = x.len() / 4 * 4;
+            for i in (0..n).step_by(4) {
+                let p = x.as_mut_ptr().add(i);
+                vst1q_f32(p, vaddq_f32(vld1q_f32(p), vld1q_f32(r.as_ptr().add(i))));
+            }
+            for i in n..x.len() {
+                x[i] += r[i]
+            }
+        }
+
+        #[target_feature(enable = "neon")]
+        pub unsafe fn normalize(
+            x: &mut [f32],
+            mu: f32,
+            rsigma: f32,
+            gamma: &[f32],
+            beta: Option<&[f32]>,
+        ) {
+            let n = x.len() / 4 * 4;
+            let mu_v = vdupq_n_f32(mu);
+            let rsigma_v = vdupq_n_f32(rsigma);
+            for i in (0..n).step_by(4) {
+                let p = x.as_mut_ptr().add(i);
+                let y = vmulq_f32(vsubq_f32(vld1q_f32(p), mu_v), rsigma_v);
+                let b = match beta {
+                    Some(b) => vld1q_f32(b.as_ptr().add(i)),
+                    None => vdupq_n_f32(0.),
+                };
+                vst1q_f32(p, vfmaq_f32(b, y, vld1q_f32(gamma.as_ptr().add(i))));
+            }
+            super::normalize_tail(x, mu, rsigma, gamma, beta, n)
+        }
+    }
+}
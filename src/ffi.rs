@@ -10,13 +10,104 @@ extern "C" {
         dst: *const c_void,
         mu: *const c_void,
         rsigma: *const c_void,
+        z_scale: *const c_void,
+        quant_scale: *const c_void,
+        workspace: *const c_void,
+        barrier: *const c_void,
+        work_counter: *const c_void,
 
         epsilon: f32,
 
         hidden_size_rounded: u32,
         rows: u32,
         cols: u32,
-        multi_processor_count: i32,
+        x_row_stride: u32,
+        residual_row_stride: u32,
+        dst_add_row_stride: u32,
+        dst_row_stride: u32,
+        heads: u32,
+        x_head_stride: u32,
+        residual_head_stride: u32,
+        dst_add_head_stride: u32,
+        dst_head_stride: u32,
+        rope_cos: *const c_void,
+        rope_sin: *const c_void,
+        rope_pos: *const c_void,
+        rope_interleaved: c_int,
+        dmask: *const c_void,
+        dropout_p: f32,
+        philox_seed: u64,
+        philox_offset: u64,
+        rowscale: *const c_void,
+        colscale: *const c_void,
+        x0_subset: *const c_void,
+        z_subset: *const c_void,
+        x0_subset_rows: u32,
+        z_subset_rows: u32,
+        rowscale_const: f32,
+        x0_bias: *const c_void,
+        rows_ptr: *const c_void,
+        device: i32,
+
+        stream: *const c_void,
+
+        fwd_handle: *const c_void,
+
+        is_rms_norm: c_int,
+    ) -> c_int;
+
+    pub(crate) fn ln_fwd_resolve(
+        hidden_size_rounded: u32,
+        device: i32,
+
+        wtype: u32,
+        itype: u32,
+        rtype: u32,
+        otype: u32,
+        ctype: u32,
+
+        handle: *mut *const c_void,
+    ) -> c_int;
+
+    #[cfg(feature = "telemetry")]
+    pub(crate) fn ln_fwd_telemetry(values: *mut u64, reset: c_int);
+
+    pub(crate) fn run_ln_bwd_ctas_per_col(
+        hidden_size_rounded: u32,
+        cols: u32,
+        device: i32,
+
+        wtype: u32,
+        itype: u32,
+        rtype: u32,
+        otype: u32,
+        ctype: u32,
+
+        ctas_per_col: *mut u32,
+    ) -> c_int;
+
+    pub(crate) fn run_ln_bwd(
+        dz: *const c_void,
+        x: *const c_void,
+        dx: *const c_void,
+        mu: *const c_void,
+        rsigma: *const c_void,
+        gamma: *const c_void,
+        dx0: *const c_void,
+        dresidual: *const c_void,
+        dmask: *const c_void,
+        dropout_p: f32,
+        dgamma: *const c_void,
+        dbeta: *const c_void,
+        dgamma_part: *const c_void,
+        dbeta_part: *const c_void,
+
+        hidden_size_rounded: u32,
+        rows: u32,
+        cols: u32,
+        device: i32,
+
+        stream: *const c_void,
 
         wtype: u32,
         itype: u32,
@@ -25,5 +116,35 @@ extern "C" {
         ctype: u32,
 
         is_rms_norm: c_int,
-    );
+    ) -> c_int;
+
+    pub(crate) fn run_ln_grouped(
+        num_tensors: u32,
+
+        x: *const *const c_void,
+        residual: *const *const c_void,
+        gamma: *const *const c_void,
+        beta: *const *const c_void,
+        dst_add: *const *const c_void,
+        dst: *const *const c_void,
+
+        epsilon: *const f32,
+
+        rows: *const u32,
+        cols: *const u32,
+        x_row_stride: *const u32,
+        residual_row_stride: *const u32,
+        is_rms_norm: *const c_int,
+
+        hidden_size_rounded: u32,
+        device: i32,
+
+        stream: *const c_void,
+
+        wtype: u32,
+        itype: u32,
+        rtype: u32,
+        otype: u32,
+        ctype: u32,
+    ) -> c_int;
 }
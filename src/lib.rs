@@ -1,12 +1,17 @@
+mod cpu;
 mod ffi;
 
 use candle_core::backend::BackendStorage;
-use candle_core::cuda_backend::cudarc::driver::sys::CUdevice_attribute::CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT;
-use candle_core::cuda_backend::cudarc::driver::DevicePtr;
+use candle_core::cuda_backend::cudarc::driver::sys::CUdevice_attribute::{
+    CU_DEVICE_ATTRIBUTE_MAX_BLOCKS_PER_MULTIPROCESSOR, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT,
+};
+use candle_core::cuda_backend::cudarc::driver::{CudaSlice, DevicePtr};
 use candle_core::cuda_backend::WrapErr;
 use candle_core::{CpuStorage, DType, Layout, Result, Shape, Storage, Tensor};
 use half::{bf16, f16};
+use std::collections::HashMap;
 use std::ptr;
+use std::sync::{Arc, Mutex, OnceLock};
 
 fn layer_norm_internal_type(dtype: DType) -> Result<u32> {
     let internal_type = match dtype {
@@ -18,18 +23,775 @@ fn layer_norm_internal_type(dtype: DType) -> Result<u32> {
     Ok(internal_type)
 }
 
+/// What the forward pass does with the per-row mean and inverse standard deviation. The mean is
+/// 0 for RMSNorm, which only reduces the sum of squares.
+#[derive(Clone, Debug, Default)]
+pub enum LayerNormStats {
+    /// The statistics are neither allocated nor stored.
+    #[default]
+    None,
+    /// The statistics are allocated and returned by [`LayerNorm::forward`].
+    Return,
+    /// The statistics are written into caller-provided f32 tensors of shape `(rows,)`. The
+    /// backward pass reads them back instead of recomputing them.
+    Buffers { mu: Tensor, rsigma: Tensor },
+}
+
+/// Created with [`LayerNorm::new`]. The public fields can be changed afterwards, launches that no
+/// longer match the resolved kernel resolve theirs.
+#[derive(Clone)]
 pub struct LayerNorm {
     pub epsilon: f32,
     pub is_rms_norm: bool,
+    /// Channel scale, in the dtype of the input or in f32, see [`FWD_DTYPES`]
     pub gamma: Tensor,
+    /// Channel bias with the dtype of gamma
     pub beta: Option<Tensor>,
+    pub stats: LayerNormStats,
+    /// Forward kernel resolved by [`LayerNorm::new`], launches of other kernels resolve theirs
+    handle: Option<FwdHandle>,
+    /// gamma and beta widened by [`LayerNorm::new`] for the cpu forward pass, launches with
+    /// other weights widen theirs
+    cpu_weights: Option<Arc<cpu::Weights>>,
+    /// Workspace of the device and stream of gamma, launches on other streams look theirs up
+    workspace: Option<Arc<MultiCtaWorkspace>>,
+}
+
+/// A forward kernel resolved once for a device. Its launches call the launcher directly, without
+/// looking up the registry.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+struct FwdHandle {
+    ptr: *const core::ffi::c_void,
+    hidden_size: u32,
+    device: i32,
+    /// Internal weight, input, residual and output type ids
+    types: (u32, u32, u32, u32),
+    /// Compute type id, see [`LayerNorm::with_packed_compute`]
+    ctype: u32,
+}
+
+/// Compute type id of the kernels that normalize in f32.
+const FP32_COMPUTE: u32 = 2;
+
+// The handle points to an immutable entry of the launcher registry that is never freed.
+unsafe impl Send for FwdHandle {}
+unsafe impl Sync for FwdHandle {}
+
+impl FwdHandle {
+    fn resolve(
+        hidden_size: usize,
+        device: i32,
+        types: (u32, u32, u32, u32),
+        ctype: u32,
+    ) -> Result<Self> {
+        let (wtype, itype, rtype, otype) = types;
+        let mut ptr = ptr::null();
+        let status = unsafe {
+            ffi::ln_fwd_resolve(
+                hidden_size as u32,
+                device,
+                wtype,
+                itype,
+                rtype,
+                otype,
+                ctype,
+                &mut ptr,
+            )
+        };
+        if status != 0 {
+            candle_core::bail!(
+                "no forward kernel of hidden size {hidden_size} for the (weight, input, residual, \
+                 output) type ids {types:?} and compute type id {ctype}"
+            )
+        }
+        Ok(Self {
+            ptr,
+            hidden_size: hidden_size as u32,
+            device,
+            types,
+            ctype,
+        })
+    }
+
+    /// Returns the handle when it is the one of the launch, resolves the kernel otherwise.
+    fn or_resolve(
+        handle: Option<Self>,
+        hidden_size: usize,
+        device: i32,
+        types: (u32, u32, u32, u32),
+        ctype: u32,
+    ) -> Result<Self> {
+        match handle {
+            Some(h)
+                if h.hidden_size as usize == hidden_size
+                    && h.device == device
+                    && h.types == types
+                    && h.ctype == ctype =>
+            {
+                Ok(h)
+            }
+            _ => Self::resolve(hidden_size, device, types, ctype),
+        }
+    }
+}
+
+/// Results of [`LayerNorm::forward`].
+pub struct LayerNormOutput {
+    pub out: Tensor,
+    /// Result of the residual add, only set when a residual was given or when dropout or an input
+    /// bias changed the input.
+    pub residual_add: Option<Tensor>,
+    /// Per-row mean and inverse standard deviation, unless the statistics mode is `None`.
+    pub stats: Option<(Tensor, Tensor)>,
+    /// Bit-packed keep mask of [`LayerNorm::forward_dropout`], see [`dmask_words`].
+    pub dmask: Option<Tensor>,
+}
+
+/// Element type of the quantized outputs of [`LayerNorm::forward_quantized`].
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum QuantDType {
+    /// FP8 with 4 exponent and 3 mantissa bits, saturated to +-448.
+    F8E4M3,
+    /// Signed 8-bit integers, rounded to nearest and saturated to +-127.
+    I8,
+}
+
+impl QuantDType {
+    fn internal_type(&self) -> u32 {
+        match self {
+            QuantDType::F8E4M3 => 3,
+            QuantDType::I8 => 4,
+        }
+    }
+}
+
+/// Scale of the quantized outputs, that are `quantize(out / scale)`.
+pub enum QuantScale {
+    /// One scale per row mapping the row absolute maximum to the largest finite value.
+    PerRow,
+    /// One scale for the whole tensor, as a single element f32 cuda tensor.
+    Static(Tensor),
+}
+
+/// Kernel arguments of the quantized outputs.
+struct QuantOutput {
+    otype: u32,
+    z_scale: *const core::ffi::c_void,
+    quant_scale: *const core::ffi::c_void,
+}
+
+/// Rotary embedding applied to the normalized outputs, see [`LayerNorm::forward_rope`].
+#[derive(Clone, Debug)]
+pub struct RotaryEmbedding {
+    /// Contiguous `[max_position, head_dim / 2]` cache with the dtype of the input
+    pub cos: Tensor,
+    /// Contiguous `[max_position, head_dim / 2]` cache with the dtype of the input
+    pub sin: Tensor,
+    /// Rotate the adjacent pairs (2i, 2i + 1) instead of the halves (i, i + head_dim / 2)
+    pub interleaved: bool,
+}
+
+/// Kernel arguments of the rotary embedding of the outputs.
+struct RopeArgs {
+    cos: *const core::ffi::c_void,
+    sin: *const core::ffi::c_void,
+    pos: *const core::ffi::c_void,
+    interleaved: i32,
+}
+
+/// Dropout of the input of the normalization, before the residual add, see
+/// [`LayerNorm::forward_dropout`].
+#[derive(Clone, Copy, Debug)]
+pub struct Dropout {
+    /// Probability of zeroing an element, in [0, 1). The kept elements are scaled by 1 / (1 - p).
+    pub p: f32,
+    /// Philox seed and offset. The mask only depends on them and on the element index, the caller
+    /// advances the offset by at least `elem_count / 4` between launches sharing a seed.
+    pub seed: u64,
+    pub offset: u64,
+    /// Return the bit-packed keep mask needed by [`LayerNorm::backward_dropout`].
+    pub return_mask: bool,
+}
+
+/// Kernel arguments of the dropout.
+struct DropoutArgs {
+    dmask: *const core::ffi::c_void,
+    p: f32,
+    seed: u64,
+    offset: u64,
+}
+
+/// Rows of the residual add gathered from the input and scattered to the outputs, see
+/// [`LayerNorm::forward_scaled`]. The indices are 1-based, 0 or an index past the rows selects no
+/// row.
+#[derive(Clone, Debug)]
+pub struct RowSubset {
+    /// u32 tensor with one entry per row of the residual add: row i adds row `x_rows[i] - 1` of
+    /// the input to the residual, or only takes the residual when it is 0
+    pub x_rows: Tensor,
+    /// u32 tensor with one entry per row of the residual add: row i is normalized into row
+    /// `out_rows[i] - 1` of the outputs, or not written when it is 0
+    pub out_rows: Tensor,
+    /// Number of rows of the outputs
+    pub num_out_rows: usize,
+    /// Scale of every input row, in place of a per-row scale tensor
+    pub scale: f32,
+}
+
+/// Scales of the input of the normalization, before the residual add, and row subsets, see
+/// [`LayerNorm::forward_scaled`].
+#[derive(Clone, Debug, Default)]
+pub struct InputScales {
+    /// One scale per row of the input, with its dtype
+    pub rowscale: Option<Tensor>,
+    /// One scale per column, with the dtype of gamma
+    pub colscale: Option<Tensor>,
+    pub subset: Option<RowSubset>,
+}
+
+/// Kernel arguments of the input scales and row subsets.
+struct ScaleArgs {
+    rowscale: *const core::ffi::c_void,
+    colscale: *const core::ffi::c_void,
+    x0_subset: *const core::ffi::c_void,
+    z_subset: *const core::ffi::c_void,
+    rowscale_const: f32,
+    /// Rows of the residual add and of the outputs, that differ from the input rows with a subset.
+    rows: usize,
+    out_rows: usize,
+}
+
+/// Caller buffers of a graph-safe forward launch, see [`LayerNorm::forward_graph_safe`].
+pub struct GraphBuffers<'a> {
+    /// Single element u32 tensor holding the number of rows to normalize, at most the rows of the
+    /// input.
+    pub rows: &'a Tensor,
+    /// Normalized output, with the shape and dtype of the input.
+    pub out: &'a Tensor,
+    /// Residual add result, with the shape and dtype of the input. Required with a residual.
+    pub residual_add: Option<&'a Tensor>,
+}
+
+/// Kernel arguments of a graph-safe launch.
+struct GraphArgs {
+    rows: *const core::ffi::c_void,
+    dst: *const core::ffi::c_void,
+    dst_add: *const core::ffi::c_void,
+}
+
+/// Optional features of a forward launch.
+#[derive(Default)]
+struct FwdOptions<'a> {
+    /// The residual add result is written over the residual.
+    residual_inplace: bool,
+    quant: Option<&'a QuantOutput>,
+    rope: Option<&'a RopeArgs>,
+    dropout: Option<&'a DropoutArgs>,
+    scales: Option<&'a ScaleArgs>,
+    /// Per-column bias added to the input before the residual add.
+    x0_bias: Option<&'a Tensor>,
+    /// The outputs are caller buffers and the number of rows is read from the device.
+    graph: Option<&'a GraphArgs>,
+}
+
+/// Gradients computed by [`LayerNorm::backward`].
+pub struct LayerNormGrads {
+    /// Gradient wrt. the input of the normalization (and wrt. the residual for the fused-add
+    /// variants).
+    pub dx: Tensor,
+    /// Gradient wrt. the input of the dropout, only set by [`LayerNorm::backward_dropout`].
+    pub dx0: Option<Tensor>,
+    pub dgamma: Tensor,
+    pub dbeta: Option<Tensor>,
 }
 
 fn round_multiple(x: usize, m: usize) -> usize {
     (x + m - 1) / m * m
 }
 
+/// Hidden sizes above 8192 use several CTAs per row, these kernels only support exact sizes.
+const MULTI_CTA_HIDDEN_SIZES: [usize; 3] = [12288, 16384, 18432];
+
+/// Per-head sizes handled by a group of lanes per row, these kernels only support exact sizes.
+const SUBWARP_HIDDEN_SIZES: [usize; 2] = [64, 128];
+
+/// Hidden sizes of popular models with exact forward kernels, instead of the masked tail of the
+/// next size up. The other sizes up to 8192 are rounded up, see the table in the README.
+const EXACT_HIDDEN_SIZES: [usize; 7] = [896, 2304, 3584, 3840, 4608, 5376, 6656];
+
+/// Head dims whose kernels can apply a rotary embedding to the outputs.
+const ROPE_HIDDEN_SIZES: [usize; 4] = [64, 128, 256, 512];
+
+/// Round cols to match with the correct kernel
+fn hidden_size_rounded(cols: usize) -> usize {
+    if cols > 8192 {
+        cols
+    } else if cols <= 1536 {
+        round_multiple(cols, 256)
+    } else if cols <= 3072 {
+        round_multiple(cols, 512)
+    } else {
+        round_multiple(cols, 1024)
+    }
+}
+
+/// The forward kernel of cols: the exact one when it is compiled in, the rounded up one otherwise.
+fn fwd_hidden_size(cols: usize, dtype: DType) -> usize {
+    if EXACT_HIDDEN_SIZES.contains(&cols) && is_compiled(cols, dtype) {
+        cols
+    } else {
+        hidden_size_rounded(cols)
+    }
+}
+
+/// Hidden sizes and input dtypes of the compiled kernels, see build.rs.
+const COMPILED_HIDDEN_SIZES: &str = env!("CANDLE_LAYER_NORM_COMPILED_HIDDEN_SIZES");
+const COMPILED_DTYPES: &str = env!("CANDLE_LAYER_NORM_COMPILED_DTYPES");
+
+fn is_compiled(hidden_size: usize, dtype: DType) -> bool {
+    let has_size = COMPILED_HIDDEN_SIZES
+        .split(',')
+        .any(|s| s.parse() == Ok(hidden_size));
+    let has_dtype = COMPILED_DTYPES.split(',').any(|d| d == dtype.as_str());
+    has_size && has_dtype
+}
+
+/// The hidden sizes of the forward kernels in this build, see CANDLE_LAYER_NORM_HIDDEN_SIZES.
+pub fn compiled_hidden_sizes() -> Vec<usize> {
+    COMPILED_HIDDEN_SIZES
+        .split(',')
+        .filter_map(|s| s.parse().ok())
+        .collect()
+}
+
+/// The input dtypes of the kernels in this build, see CANDLE_LAYER_NORM_DTYPES.
+pub fn compiled_dtypes() -> Vec<DType> {
+    [DType::F16, DType::BF16, DType::F32]
+        .into_iter()
+        .filter(|dtype| COMPILED_DTYPES.split(',').any(|d| d == dtype.as_str()))
+        .collect()
+}
+
+/// Counters of the forward launches since the start of the process or the last reset, with the
+/// `telemetry` feature. The launches are also tagged with NVTX ranges holding the hidden size, the
+/// type key, the rows and the mode, e.g. `ln_fwd rms+residual hidden=4096 types=4aa rows=512`.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct FwdTelemetry {
+    /// Forward launches, without the grouped ones
+    pub calls: u64,
+    /// Host time of the checks and output allocations before the launches
+    pub prepare_ns: u64,
+    /// Host time of the launches: the launch plan, with the occupancy queries of the first
+    /// launch of a kernel, and the kernel enqueue
+    pub dispatch_ns: u64,
+    /// CTAs of all the launches
+    pub ctas: u64,
+    /// CTAs of the last launch
+    pub last_ctas: u64,
+}
+
+#[cfg(feature = "telemetry")]
+static FWD_PREPARE_NS: std::sync::atomic::AtomicU64 = std::sync::atomic::AtomicU64::new(0);
+
+/// Reads the forward launch counters, and resets them if `reset` is set.
+#[cfg(feature = "telemetry")]
+pub fn fwd_telemetry(reset: bool) -> FwdTelemetry {
+    use std::sync::atomic::Ordering;
+    let mut values = [0u64; 4];
+    unsafe { ffi::ln_fwd_telemetry(values.as_mut_ptr(), reset as core::ffi::c_int) };
+    let prepare_ns = if reset {
+        FWD_PREPARE_NS.swap(0, Ordering::Relaxed)
+    } else {
+        FWD_PREPARE_NS.load(Ordering::Relaxed)
+    };
+    FwdTelemetry {
+        calls: values[0],
+        prepare_ns,
+        dispatch_ns: values[1],
+        ctas: values[2],
+        last_ctas: values[3],
+    }
+}
+
+/// Fails when the kernels of a hidden size or dtype were left out of the build.
+fn check_compiled(hidden_size: usize, dtype: DType) -> Result<()> {
+    if !is_compiled(hidden_size, dtype) {
+        candle_core::bail!(
+            "the {dtype:?} kernels of hidden size {hidden_size} are not compiled in, the build has \
+             sizes [{COMPILED_HIDDEN_SIZES}] and dtypes [{COMPILED_DTYPES}], see \
+             CANDLE_LAYER_NORM_HIDDEN_SIZES and CANDLE_LAYER_NORM_DTYPES"
+        )
+    }
+    Ok(())
+}
+
+/// Inter-CTA workspace and sync barriers of the multi-CTA kernels, and the work counter of the
+/// persistent kernel. They are allocated once per device and stream, sized for the largest grid the
+/// device can run cooperatively, and are reused by every launch. The launcher resets the barriers,
+/// the persistent kernel leaves the counter at zero.
+struct MultiCtaWorkspace {
+    /// Device ordinal and stream
+    key: (usize, usize),
+    workspace: CudaSlice<u8>,
+    barrier: CudaSlice<i32>,
+    work_counter: CudaSlice<i32>,
+}
+
+fn multi_cta_workspace(dev: &candle_core::CudaDevice) -> Result<Arc<MultiCtaWorkspace>> {
+    static WORKSPACES: OnceLock<Mutex<HashMap<(usize, usize), Arc<MultiCtaWorkspace>>>> =
+        OnceLock::new();
+
+    let key = (dev.ordinal(), *dev.cu_stream() as usize);
+    let mut workspaces = WORKSPACES.get_or_init(Default::default).lock().unwrap();
+    if let Some(workspace) = workspaces.get(&key) {
+        return Ok(workspace.clone());
+    }
+
+    // A cooperative launch cannot have more CTAs than can be resident at once.
+    let multi_processor_count = dev.attribute(CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT).w()?;
+    let max_blocks_per_sm = dev
+        .attribute(CU_DEVICE_ATTRIBUTE_MAX_BLOCKS_PER_MULTIPROCESSOR)
+        .w()?;
+    let max_ctas = (multi_processor_count * max_blocks_per_sm) as usize;
+
+    // Two f32x2 stats per CTA (double buffered) and two barriers per CTA group.
+    let workspace = MultiCtaWorkspace {
+        key,
+        workspace: unsafe { dev.alloc::<u8>(max_ctas * 2 * 2 * std::mem::size_of::<f32>()) }.w()?,
+        barrier: unsafe { dev.alloc::<i32>(max_ctas * 2) }.w()?,
+        work_counter: dev.alloc_zeros::<i32>(2).w()?,
+    };
+    let workspace = Arc::new(workspace);
+    workspaces.insert(key, workspace.clone());
+    Ok(workspace)
+}
+
+/// Row layout of an input of rank >= 2. For rank >= 3 the second to last dim is taken as the
+/// heads, so that rows are the tokens times the heads and a per-head slice of a fused qkv tensor
+/// is read in place. Strides are in elements.
+struct RowLayout {
+    rows: usize,
+    cols: usize,
+    heads: usize,
+    /// Distance between consecutive tokens, the leading dims flattened.
+    row_stride: usize,
+    /// Distance between consecutive heads of a token, 0 when there is a single head.
+    head_stride: usize,
+}
+
+impl RowLayout {
+    /// The distance between consecutive rows when the heads can be flattened into the tokens.
+    fn flat_row_stride(&self) -> Option<usize> {
+        if self.heads == 1 {
+            Some(self.row_stride)
+        } else if self.rows == self.heads || self.row_stride == self.heads * self.head_stride {
+            Some(self.head_stride)
+        } else {
+            None
+        }
+    }
+
+    /// The same rows with the heads flattened into the tokens.
+    fn flattened(self, name: &str) -> Result<RowLayout> {
+        match self.flat_row_stride() {
+            Some(row_stride) => Ok(RowLayout {
+                heads: 1,
+                row_stride,
+                head_stride: 0,
+                ..self
+            }),
+            None => candle_core::bail!("the rows of {name} must be evenly spaced"),
+        }
+    }
+}
+
+/// Flattens the leading dims of a layout into tokens, see [`RowLayout`]. The strides only have to
+/// be % 8.
+fn row_layout(l: &Layout, name: &str) -> Result<RowLayout> {
+    let dims = l.dims();
+    let stride = l.stride();
+    let rank = dims.len();
+    if rank < 2 {
+        candle_core::bail!("layer-norm expects input tensors of rank >= 2. Found: {rank}")
+    }
+    if stride[rank - 1] != 1 {
+        candle_core::bail!("the last dim of {name} must be contiguous {stride:?}")
+    }
+    let cols = dims[rank - 1];
+    let rows = dims[..rank - 1].iter().product();
+    let (heads, head_stride, token_rank) = if rank >= 3 && dims[rank - 2] > 1 {
+        (dims[rank - 2], stride[rank - 2], rank - 2)
+    } else {
+        (1, 0, rank - 1)
+    };
+
+    // Dims of size one do not constrain the layout, the others must be densely nested.
+    let mut row_stride = None;
+    let mut expected_stride = 0;
+    for i in (0..token_rank).rev() {
+        if dims[i] == 1 {
+            continue;
+        }
+        match row_stride {
+            None => row_stride = Some(stride[i]),
+            Some(_) if stride[i] != expected_stride => candle_core::bail!(
+                "the leading dims of {name} cannot be flattened into rows {dims:?} {stride:?}"
+            ),
+            Some(_) => {}
+        }
+        expected_stride = stride[i] * dims[i];
+    }
+    let row_stride = row_stride.unwrap_or(if heads == 1 { cols } else { heads * head_stride });
+
+    // Every row starts at a vectorized load boundary.
+    if row_stride % 8 != 0 || head_stride % 8 != 0 || l.start_offset() % 8 != 0 {
+        candle_core::bail!(
+            "the row stride, head stride and offset of {name} must be % 8, got {row_stride}, {head_stride} and {}",
+            l.start_offset()
+        )
+    }
+    Ok(RowLayout {
+        rows,
+        cols,
+        heads,
+        row_stride,
+        head_stride,
+    })
+}
+
+/// Returns the device pointer to the first element of a cuda storage, its number of rows and
+/// columns and the distance between its rows. The heads must flatten into the tokens.
+fn cuda_rows_ptr<
+    T: candle_core::cuda_backend::CudaDType + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+>(
+    s: &candle_core::CudaStorage,
+    l: &Layout,
+    name: &str,
+) -> Result<(*const core::ffi::c_void, usize, usize, usize)> {
+    let layout = row_layout(l, name)?;
+    let row_stride = match layout.flat_row_stride() {
+        Some(row_stride) => row_stride,
+        None => candle_core::bail!(
+            "the rows of {name} must be evenly spaced {:?} {:?}",
+            l.dims(),
+            l.stride()
+        ),
+    };
+    let (rows, cols) = (layout.rows, layout.cols);
+    let s = s.as_cuda_slice::<T>()?;
+    let s = s.slice(l.start_offset()..);
+    Ok((*s.device_ptr() as *const core::ffi::c_void, rows, cols, row_stride))
+}
+
+/// The (weight, input, residual) dtypes of the forward kernels, see the table in ln_api.cu. The
+/// outputs have the dtype of the input, the backward pass only supports weights of that dtype.
+pub const FWD_DTYPES: [(DType, DType, DType); 10] = [
+    (DType::F32, DType::F32, DType::F32),
+    (DType::F16, DType::F32, DType::F32),
+    (DType::F32, DType::F16, DType::F32),
+    (DType::F16, DType::F16, DType::F32),
+    (DType::F32, DType::F16, DType::F16),
+    (DType::F32, DType::BF16, DType::F32),
+    (DType::BF16, DType::BF16, DType::F32),
+    (DType::F32, DType::BF16, DType::BF16),
+    (DType::F16, DType::F16, DType::F16),
+    (DType::BF16, DType::BF16, DType::BF16),
+];
+
+fn check_fwd_dtypes(weight: DType, input: DType, residual: DType) -> Result<()> {
+    if !FWD_DTYPES.contains(&(weight, input, residual)) {
+        candle_core::bail!(
+            "no kernel for {weight:?} weights, {input:?} inputs and {residual:?} residuals, the \
+             supported (weight, input, residual) dtypes are {FWD_DTYPES:?}"
+        )
+    }
+    Ok(())
+}
+
+/// Returns the device pointer to the first element of a cuda storage of any of the kernel dtypes,
+/// for the tensors that need not have the dtype of the input.
+fn cuda_storage_ptr(
+    s: &candle_core::CudaStorage,
+    l: &Layout,
+    name: &str,
+) -> Result<*const core::ffi::c_void> {
+    let ptr = match s.dtype() {
+        DType::F16 => *s
+            .as_cuda_slice::<f16>()?
+            .slice(l.start_offset()..)
+            .device_ptr(),
+        DType::BF16 => *s
+            .as_cuda_slice::<bf16>()?
+            .slice(l.start_offset()..)
+            .device_ptr(),
+        DType::F32 => *s
+            .as_cuda_slice::<f32>()?
+            .slice(l.start_offset()..)
+            .device_ptr(),
+        dtype => candle_core::bail!("{name} must be f16, bf16 or f32, got {dtype:?}"),
+    };
+    Ok(ptr as *const core::ffi::c_void)
+}
+
+/// [`cuda_tensor_ptr`] for the tensors that need not have the dtype of the input.
+fn cuda_tensor_ptr_any(t: &Tensor, name: &str) -> Result<*const core::ffi::c_void> {
+    match t.dtype() {
+        DType::F16 => cuda_tensor_ptr::<f16>(t, name),
+        DType::BF16 => cuda_tensor_ptr::<bf16>(t, name),
+        DType::F32 => cuda_tensor_ptr::<f32>(t, name),
+        dtype => candle_core::bail!("{name} must be f16, bf16 or f32, got {dtype:?}"),
+    }
+}
+
+/// Returns the device pointer to the first element of a cuda tensor whose last dim is contiguous.
+fn cuda_tensor_ptr<
+    T: candle_core::cuda_backend::CudaDType + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+>(
+    t: &Tensor,
+    name: &str,
+) -> Result<*const core::ffi::c_void> {
+    let (s, l) = t.storage_and_layout();
+    let s = match &*s {
+        Storage::Cuda(s) => s,
+        _ => candle_core::bail!("{name} must be a cuda tensor"),
+    };
+
+    let s = s.as_cuda_slice::<T>()?;
+    let s = s.slice(l.start_offset()..);
+
+    let stride = l.stride();
+    if stride[stride.len() - 1] != 1 {
+        candle_core::bail!("the last dim of {name} must be contiguous {stride:?}")
+    }
+    Ok(*s.device_ptr() as *const core::ffi::c_void)
+}
+
+/// Number of u32 words of the bit-packed dropout mask of `elem_count` elements. Element i, in the
+/// row-major order of the input, is bit i % 32 of word i / 32.
+pub fn dmask_words(elem_count: usize) -> usize {
+    (elem_count + 31) / 32
+}
+
+/// Number of rows of a tensor whose leading dims are flattened into rows.
+fn num_rows(x: &Tensor) -> usize {
+    let dims = x.dims();
+    dims[..dims.len().saturating_sub(1)].iter().product()
+}
+
+fn stats_buffers(x: &Tensor) -> Result<LayerNormStats> {
+    stats_buffers_for_rows(num_rows(x), x.device())
+}
+
+fn stats_buffers_for_rows(rows: usize, device: &candle_core::Device) -> Result<LayerNormStats> {
+    let mu = Tensor::zeros(rows, DType::F32, device)?;
+    let rsigma = Tensor::zeros(rows, DType::F32, device)?;
+    Ok(LayerNormStats::Buffers { mu, rsigma })
+}
+
+/// Allocates the statistics buffers needed by the backward pass when `x`, the residual or the
+/// weights are part of a graph that tracks gradients.
+fn stats_for_backward(
+    x: &Tensor,
+    r: Option<&Tensor>,
+    gamma: &Tensor,
+    beta: Option<&Tensor>,
+) -> Result<LayerNormStats> {
+    let tracks = |t: Option<&Tensor>| t.map_or(false, |t| t.track_op());
+    if !(x.track_op() || tracks(r) || gamma.track_op() || tracks(beta)) {
+        return Ok(LayerNormStats::None);
+    }
+    stats_buffers(x)
+}
+
 impl LayerNorm {
+    /// Creates a normalization of inputs in the dtype of gamma and resolves its forward kernel,
+    /// so that an unsupported hidden size or dtype fails here, not at the first launch.
+    ///
+    /// The plain forward passes and those with a residual then launch the kernel directly, the
+    /// options that select another kernel, e.g. dropout or quantized outputs, resolve theirs on
+    /// each launch.
+    pub fn new(
+        gamma: Tensor,
+        beta: Option<Tensor>,
+        epsilon: f32,
+        is_rms_norm: bool,
+    ) -> Result<Self> {
+        let dtype = gamma.dtype();
+        let ln = LayerNorm {
+            epsilon,
+            is_rms_norm,
+            gamma,
+            beta,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        ln.with_dtypes(dtype, dtype)
+    }
+
+    /// Resolves the forward kernel of inputs and residuals of other dtypes than gamma instead,
+    /// see [`FWD_DTYPES`].
+    pub fn with_dtypes(self, input: DType, residual: DType) -> Result<Self> {
+        self.resolved(input, residual, FP32_COMPUTE)
+    }
+
+    /// Normalizes in packed pairs of the f16 or bf16 dtype of gamma, with the reductions still in
+    /// f32, for launches whose input, residual and outputs also have that dtype. This halves the
+    /// registers that hold a row and raises the occupancy of the bandwidth-bound large hidden
+    /// sizes, it is available for the kernels of 4096 to 8192 columns without rotary embedding.
+    ///
+    /// With u the unit roundoff of the dtype, 2^-11 for f16 and 2^-8 for bf16, and y the normalized
+    /// input, the outputs z are to first order within `u * (|z| + |gamma| * (4 |y| + 2 rs |mu|))`
+    /// of those of the f32 compute, i.e. a few ulps, mu being 0 for RMSNorm. For f16 this holds
+    /// while `var + epsilon >= 2.4e-10`: rs is clamped to the largest finite f16, so rows of a
+    /// smaller variance get smaller outputs instead of overflowing. The results are as
+    /// deterministic as the f32 ones.
+    pub fn with_packed_compute(self) -> Result<Self> {
+        let dtype = self.gamma.dtype();
+        if dtype != DType::F16 && dtype != DType::BF16 {
+            candle_core::bail!("the packed compute requires f16 or bf16 gamma, got {dtype:?}")
+        }
+        let ctype = layer_norm_internal_type(dtype)?;
+        self.resolved(dtype, dtype, ctype)
+    }
+
+    fn resolved(mut self, input: DType, residual: DType, ctype: u32) -> Result<Self> {
+        check_fwd_dtypes(self.gamma.dtype(), input, residual)?;
+        let device = match self.gamma.device() {
+            candle_core::Device::Cuda(dev) => {
+                self.workspace = Some(multi_cta_workspace(dev)?);
+                dev.ordinal() as i32
+            }
+            // The cpu forward pass has no kernel to resolve, only its weights to widen
+            candle_core::Device::Cpu => {
+                self.cpu_weights = Some(Arc::new(cpu::Weights::new(
+                    &self.gamma,
+                    self.beta.as_ref(),
+                )?));
+                return Ok(self);
+            }
+            _ => candle_core::bail!("gamma must be a cpu or cuda tensor"),
+        };
+        // The kernel of the launches without options, see fwd_launch
+        let cols = self.gamma.elem_count();
+        let hidden_size = if SUBWARP_HIDDEN_SIZES.contains(&cols) {
+            cols
+        } else {
+            fwd_hidden_size(cols, input)
+        };
+        check_compiled(hidden_size, input)?;
+        let itype = layer_norm_internal_type(input)?;
+        let types = (
+            layer_norm_internal_type(self.gamma.dtype())?,
+            itype,
+            layer_norm_internal_type(residual)?,
+            itype,
+        );
+        self.handle = Some(FwdHandle::resolve(hidden_size, device, types, ctype)?);
+        Ok(self)
+    }
+
     fn fwd<
         T: candle_core::cuda_backend::CudaDType
             + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
@@ -39,140 +801,311 @@ impl LayerNorm {
         x_l: &Layout,
         r: Option<&candle_core::CudaStorage>,
         r_l: Option<&Layout>,
+        opts: &FwdOptions,
     ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match self.fwd_launch::<T>(x, x_l, r, r_l, opts)? {
+            (Some(out), out_shape) => Ok((out, out_shape)),
+            (None, _) => candle_core::bail!("graph-safe launches write to the caller buffers"),
+        }
+    }
+
+    /// The forward launch, that returns the outputs it allocated, none for graph-safe launches.
+    fn fwd_launch<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+        opts: &FwdOptions,
+    ) -> Result<(Option<candle_core::CudaStorage>, Shape)> {
+        let FwdOptions {
+            residual_inplace,
+            quant,
+            rope,
+            dropout,
+            scales,
+            x0_bias,
+            graph,
+        } = *opts;
+        #[cfg(feature = "telemetry")]
+        let prepare_start = std::time::Instant::now();
         // Assume all tensors are on the same device and take device of x
         let dev = x.device();
 
-        // Get internal layer norm type id for the given dtype
-        let layer_norm_type = layer_norm_internal_type(x.dtype())?;
+        // Get internal layer norm type id for the given dtype, the weights and the residual can
+        // have their own
+        let dtype = x.dtype();
+        let layer_norm_type = layer_norm_internal_type(dtype)?;
+        let weight_dtype = self.gamma.dtype();
+        let weight_type = layer_norm_internal_type(weight_dtype)?;
+        let residual_dtype = r.map_or(dtype, |r| r.dtype());
+        let residual_type = layer_norm_internal_type(residual_dtype)?;
+        check_fwd_dtypes(weight_dtype, dtype, residual_dtype)?;
+        if quant.is_some() && (weight_dtype != dtype || residual_dtype != dtype) {
+            candle_core::bail!("quantized outputs require gamma and the residual in the dtype of x")
+        }
+        // The results of the residual add share the output buffer unless they are written to the
+        // residual or to caller buffers
+        if residual_dtype != dtype && !residual_inplace && graph.is_none() {
+            candle_core::bail!(
+                "a {residual_dtype:?} residual with {dtype:?} inputs must be updated in place"
+            )
+        }
 
-        // Make sure that gamma is a CUDA tensor and get the underlying storage
-        let (g, g_l) = self.gamma.storage_and_layout();
-        let g = match &*g {
-            Storage::Cuda(g) => g,
-            _ => candle_core::bail!("gamma must be a cuda tensor"),
-        };
+        // gamma, beta, the bias and the column scales have the weight dtype
+        let g_ptr = cuda_tensor_ptr_any(&self.gamma, "gamma")?;
 
-        // Get cuda slices for all tensors
+        // Get cuda slices and views for the input
         let x = x.as_cuda_slice::<T>()?;
-        let g = g.as_cuda_slice::<T>()?;
-
-        // Get cuda views for all tensors
         let x = x.slice(x_l.start_offset()..);
-        let g = g.slice(g_l.start_offset()..);
 
-        // Input matrix layout
-        let rows = x_l.dims()[0];
-        let cols = x_l.dims()[1];
+        // Input matrix layout, the leading dims are flattened into rows
+        let mut x_layout = row_layout(x_l, "x")?;
+        // Scales and row subsets index flat rows
+        if scales.is_some() {
+            x_layout = x_layout.flattened("x")?;
+        }
+        let (rows, cols, heads) = (x_layout.rows, x_layout.cols, x_layout.heads);
+        // With a row subset the kernel runs over the rows of the residual add, x holds the gathered
+        // input rows and the outputs the scattered ones
+        let x_rows = rows;
+        let (rows, out_rows) = match scales {
+            Some(scales) => (scales.rows, scales.out_rows),
+            None => (rows, rows),
+        };
 
-        if !(cols % 8 == 0 && cols <= 8192) {
+        if !(cols % 8 == 0 && (cols <= 8192 || MULTI_CTA_HIDDEN_SIZES.contains(&cols))) {
             candle_core::bail!(
-                "hidden size must be % 8 and <= 8192, it is {:?}",
+                "hidden size must be % 8 and <= 8192, or one of {MULTI_CTA_HIDDEN_SIZES:?}, it is {:?}",
                 x_l.shape()
             )
         }
 
-        let x_stride = x_l.stride();
-        let g_stride = g_l.stride();
-
-        let x_rank = x_stride.len();
-        let g_rank = g_stride.len();
-
-        if x_rank != 2 {
-            candle_core::bail!("layer-norm expects input tensors of rank 2. Found: {x_rank}")
-        }
-        if x_stride[x_rank - 1] != 1 {
-            candle_core::bail!("the last dim of x must be contiguous {x_stride:?}")
-        }
-        if g_stride[g_rank - 1] != 1 {
-            candle_core::bail!("the last dim of g must be contiguous {g_stride:?}")
+        if rope.is_some() && !ROPE_HIDDEN_SIZES.contains(&cols) {
+            candle_core::bail!(
+                "rotary embeddings support head dims {ROPE_HIDDEN_SIZES:?}, got {cols}"
+            )
         }
 
-        // Round cols to match with the correct kernel
-        let cols_rounded = if cols <= 1536 {
-            round_multiple(cols, 256)
-        } else if cols <= 3072 {
-            round_multiple(cols, 512)
+        // Per-head sizes have exact sub-warp kernels, without quantized outputs, dropout, scales or
+        // input bias
+        let subwarp = quant.is_none() && dropout.is_none() && scales.is_none() && x0_bias.is_none();
+        let cols_rounded = if subwarp && SUBWARP_HIDDEN_SIZES.contains(&cols) {
+            cols
         } else {
-            round_multiple(cols, 1024)
+            fwd_hidden_size(cols, dtype)
         };
+        check_compiled(cols_rounded, dtype)?;
 
         let is_rms_norm = if self.is_rms_norm { 1 } else { 0 };
 
         // If beta is et, get ids device pointer
         let b_ptr = if let Some(beta) = &self.beta {
-            // Make sure that beta is a CUDA tensor and get the underlying storage
-            let (b, b_l) = beta.storage_and_layout();
-            let b = match &*b {
-                Storage::Cuda(b) => b,
-                _ => candle_core::bail!("gamma must be a cuda tensor"),
-            };
-
-            let b = b.as_cuda_slice::<T>()?;
-            let b = b.slice(b_l.start_offset()..);
-
-            let b_stride = b_l.stride();
-            let b_rank = b_stride.len();
-
-            if b_stride[b_rank - 1] != 1 {
-                candle_core::bail!("the last dim of b must be contiguous {b_stride:?}")
+            if beta.dtype() != weight_dtype {
+                candle_core::bail!(
+                    "beta must have the dtype of gamma {weight_dtype:?}, got {:?}",
+                    beta.dtype()
+                )
             }
-            *b.device_ptr() as *const core::ffi::c_void
+            cuda_tensor_ptr_any(beta, "beta")?
         } else {
             ptr::null() as *const std::ffi::c_void
         };
 
         // If residual is set, get its device pointer
-        let r_ptr = if let (Some(r), Some(r_l)) = (r, r_l) {
-            // Check shape
-            let expected_shape = x_l.shape().dims2()?;
-            if r_l.shape().dims2()? != expected_shape {
+        let (r_ptr, r_row_stride, r_head_stride) = if let (Some(r), Some(r_l)) = (r, r_l) {
+            // Check shape, the residual has the rows of the residual add with a row subset
+            let mut r_layout = row_layout(r_l, "r")?;
+            let same_shape = match scales {
+                Some(_) => {
+                    r_layout = r_layout.flattened("r")?;
+                    r_layout.rows == rows && r_layout.cols == cols
+                }
+                None => r_l.dims() == x_l.dims(),
+            };
+            if !same_shape {
                 candle_core::bail!("shape mismatch x {:?} and r {:?}", x_l.shape(), r_l.shape());
             }
 
-            let r = r.as_cuda_slice::<T>()?;
-            let r = r.slice(r_l.start_offset()..);
+            let r_ptr = cuda_storage_ptr(r, r_l, "r")?;
+
+            // The residual add result is written back over the residual rows
+            let r_min_stride = if heads == 1 {
+                r_layout.row_stride
+            } else {
+                r_layout.head_stride.min(r_layout.row_stride)
+            };
+            if residual_inplace && r_min_stride < cols {
+                candle_core::bail!(
+                    "the rows of r must not overlap to be updated in place {:?}",
+                    r_l.stride()
+                )
+            }
+            (r_ptr, r_layout.row_stride, r_layout.head_stride)
+        } else {
+            (ptr::null() as *const std::ffi::c_void, cols, 0)
+        };
 
-            let r_stride = r_l.stride();
-            let r_rank = r_stride.len();
+        // With a residual, dropout or an input bias, we store the results of the residual add next
+        // to the main results so out has the same shape as inp * 2, unless the sum overwrites the
+        // residual. Without any, the kernel never writes the sum. Scaled inputs always have their
+        // sum written, as `(out_rows + rows, cols)`.
+        let has_residual = !r_ptr.is_null();
+        if residual_inplace && !has_residual {
+            candle_core::bail!("an in-place residual update requires a residual")
+        }
+        // The kernel writes the sum whenever it differs from x, e.g. the dropped input that the
+        // backward pass of dropout needs
+        let save_add = has_residual || scales.is_some() || dropout.is_some() || x0_bias.is_some();
+        let mut out_dims = x_l.dims().to_vec();
+        if scales.is_some() {
+            out_dims = vec![out_rows + rows, cols];
+        } else if save_add && !residual_inplace {
+            out_dims[0] *= 2;
+        }
+        let out_shape = Shape::from(out_dims);
+        // The outputs are dense, with the same heads as the input
+        let (dst_row_stride, dst_head_stride) = if heads == 1 {
+            (cols, 0)
+        } else {
+            (heads * cols, cols)
+        };
+        let (dst_add_row_stride, dst_add_head_stride) = if residual_inplace {
+            (r_row_stride, r_head_stride)
+        } else {
+            (dst_row_stride, dst_head_stride)
+        };
 
-            if r_rank != 2 {
-                candle_core::bail!("layer-norm expects input tensors of rank 2. Found: {r_rank}")
+        // Quantized outputs are written as raw bytes as candle has no fp8 or int8 dtype. They have
+        // a different dtype from the residual add result, which is then written in place.
+        let (out, dst_ptr, dst_add_ptr) = if let Some(graph) = graph {
+            (None, graph.dst, graph.dst_add)
+        } else if quant.is_some() {
+            if has_residual && !residual_inplace {
+                candle_core::bail!("quantized outputs require the residual to be updated in place")
+            }
+            if cols > 8192 {
+                candle_core::bail!("quantized outputs support hidden sizes <= 8192")
+            }
+            let out = unsafe { dev.alloc::<u8>(rows * cols) }.w()?;
+            let dst_ptr = *out.device_ptr() as *const core::ffi::c_void;
+            let out = candle_core::CudaStorage::wrap_cuda_slice(out, dev.clone());
+            (Some(out), dst_ptr, r_ptr)
+        } else {
+            let out = unsafe { dev.alloc::<T>(out_shape.elem_count()) }.w()?;
+            let dst_ptr = *out.slice(..out_rows * cols).device_ptr() as *const core::ffi::c_void;
+            let dst_add_ptr = if residual_inplace {
+                // Each thread reads its residual elements before storing the sum over them
+                r_ptr
+            } else if save_add {
+                *out.slice(out_rows * cols..).device_ptr() as *const core::ffi::c_void
+            } else {
+                ptr::null() as *const std::ffi::c_void
+            };
+            let out = candle_core::CudaStorage::wrap_cuda_slice(out, dev.clone());
+            (Some(out), dst_ptr, dst_add_ptr)
+        };
+        let (otype, z_scale_ptr, quant_scale_ptr) = match quant {
+            Some(quant) => (quant.otype, quant.z_scale, quant.quant_scale),
+            None => (layer_norm_type, ptr::null(), ptr::null()),
+        };
+        let (rope_cos, rope_sin, rope_pos, rope_interleaved) = match rope {
+            Some(rope) => (rope.cos, rope.sin, rope.pos, rope.interleaved),
+            None => (ptr::null(), ptr::null(), ptr::null(), 0),
+        };
+        let (dmask_ptr, dropout_p, philox_seed, philox_offset) = match dropout {
+            Some(d) => (d.dmask, d.p, d.seed, d.offset),
+            None => (ptr::null(), 0., 0, 0),
+        };
+        let (rowscale_ptr, colscale_ptr, x0_subset_ptr, z_subset_ptr, rowscale_const) = match scales
+        {
+            Some(s) => (
+                s.rowscale,
+                s.colscale,
+                s.x0_subset,
+                s.z_subset,
+                s.rowscale_const,
+            ),
+            None => (ptr::null(), ptr::null(), ptr::null(), ptr::null(), 1.),
+        };
+        let x0_bias_ptr = match x0_bias {
+            Some(bias) => cuda_tensor_ptr_any(bias, "bias")?,
+            None => ptr::null(),
+        };
+        let rows_ptr = graph.map_or(ptr::null(), |g| g.rows);
+
+        // Null stats pointers select the kernels that skip the stores
+        let (mu_ptr, rsigma_ptr) = match &self.stats {
+            LayerNormStats::None => (ptr::null(), ptr::null()),
+            LayerNormStats::Return => candle_core::bail!(
+                "the stats can only be returned through LayerNorm::forward, use Buffers instead"
+            ),
+            LayerNormStats::Buffers { mu, rsigma } => {
+                for t in [mu, rsigma] {
+                    if t.dtype() != DType::F32 || t.elem_count() != rows {
+                        candle_core::bail!(
+                            "stats must be f32 tensors with {rows} elements, got {:?} {:?}",
+                            t.dtype(),
+                            t.shape()
+                        )
+                    }
+                }
+                (
+                    cuda_tensor_ptr::<f32>(mu, "mu")?,
+                    cuda_tensor_ptr::<f32>(rsigma, "rsigma")?,
+                )
             }
+        };
 
-            if r_stride[r_rank - 1] != 1 {
-                candle_core::bail!("the last dim of r must be contiguous {r_stride:?}")
+        // Multi-CTA kernels exchange the partial statistics through global memory, the persistent
+        // kernel takes its rows from the work counter
+        let looked_up;
+        let ws = match &self.workspace {
+            Some(ws) if ws.key == (dev.ordinal(), *dev.cu_stream() as usize) => ws,
+            _ => {
+                looked_up = multi_cta_workspace(dev)?;
+                &looked_up
             }
-            *r.device_ptr() as *const std::ffi::c_void
+        };
+        let (workspace_ptr, barrier_ptr) = if cols > 8192 {
+            (
+                *ws.workspace.device_ptr() as *const core::ffi::c_void,
+                *ws.barrier.device_ptr() as *const core::ffi::c_void,
+            )
         } else {
-            ptr::null() as *const std::ffi::c_void
+            (ptr::null(), ptr::null())
         };
+        let work_counter_ptr = *ws.work_counter.device_ptr() as *const core::ffi::c_void;
 
-        // We will store the results of the residual add next to the main results
-        // so out has the same shape as inp * 2
-        let out_shape = Shape::from((rows * 2, cols));
+        // Get cuda device pointers from cuda slices
+        let x_ptr = *x.device_ptr() as *const core::ffi::c_void;
 
-        let out = unsafe { dev.alloc::<T>(out_shape.elem_count()) }.w()?;
-        let dst = out.slice(..rows * cols);
-        let dst_add = out.slice(rows * cols..);
+        // The multiprocessor count and the occupancy are queried once per device and kernel by
+        // the launcher itself.
+        let device = dev.ordinal() as i32;
 
-        // Alloc internal buffers
-        let mu = unsafe { dev.alloc::<f32>(rows) }.w()?;
-        let rsigma = unsafe { dev.alloc::<f32>(rows) }.w()?;
+        // Launch on the device stream so that the kernel is ordered with the rest of candle's work.
+        let stream = *dev.cu_stream() as *const core::ffi::c_void;
 
-        // Get cuda device pointers from cuda slices
-        let x_ptr = *x.device_ptr() as *const core::ffi::c_void;
-        let g_ptr = *g.device_ptr() as *const core::ffi::c_void;
-        let dst_add_ptr = *dst_add.device_ptr() as *const core::ffi::c_void;
-        let dst_ptr = *dst.device_ptr() as *const core::ffi::c_void;
-        let mu_ptr = *mu.device_ptr() as *const core::ffi::c_void;
-        let rsigma_ptr = *rsigma.device_ptr() as *const core::ffi::c_void;
+        let types = (weight_type, layer_norm_type, residual_type, otype);
+        // The packed compute of with_packed_compute only has uniform 16-bit kernels
+        let uniform = types.0 == types.1 && types.1 == types.2 && types.2 == types.3;
+        let ctype = match self.handle {
+            Some(h) if h.ctype != FP32_COMPUTE && uniform && rope.is_none() => h.ctype,
+            _ => FP32_COMPUTE,
+        };
+        let handle = FwdHandle::or_resolve(self.handle, cols_rounded, device, types, ctype)?;
 
-        let multi_processors_count = dev
-            .attribute(CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT)
-            .unwrap();
+        #[cfg(feature = "telemetry")]
+        FWD_PREPARE_NS.fetch_add(
+            prepare_start.elapsed().as_nanos() as u64,
+            std::sync::atomic::Ordering::Relaxed,
+        );
 
-        unsafe {
+        let status = unsafe {
             // Launch Kernel
             ffi::run_ln(
                 x_ptr,
@@ -183,63 +1116,1422 @@ impl LayerNorm {
                 dst_ptr,
                 mu_ptr,
                 rsigma_ptr,
+                z_scale_ptr,
+                quant_scale_ptr,
+                workspace_ptr,
+                barrier_ptr,
+                work_counter_ptr,
                 self.epsilon,
                 cols_rounded as u32,
                 rows as u32,
                 cols as u32,
-                multi_processors_count,
-                layer_norm_type,
-                layer_norm_type,
-                layer_norm_type,
-                layer_norm_type,
-                2,
+                x_layout.row_stride as u32,
+                r_row_stride as u32,
+                dst_add_row_stride as u32,
+                dst_row_stride as u32,
+                heads as u32,
+                x_layout.head_stride as u32,
+                r_head_stride as u32,
+                dst_add_head_stride as u32,
+                dst_head_stride as u32,
+                rope_cos,
+                rope_sin,
+                rope_pos,
+                rope_interleaved,
+                dmask_ptr,
+                dropout_p,
+                philox_seed,
+                philox_offset,
+                rowscale_ptr,
+                colscale_ptr,
+                x0_subset_ptr,
+                z_subset_ptr,
+                x_rows as u32,
+                out_rows as u32,
+                rowscale_const,
+                x0_bias_ptr,
+                rows_ptr,
+                device,
+                stream,
+                handle.ptr,
                 is_rms_norm,
             )
+        };
+        if status != 0 {
+            candle_core::bail!("the forward kernel launch failed with CUDA error {status}")
         }
 
-        let out = candle_core::CudaStorage::wrap_cuda_slice(out, dev.clone());
-
         Ok((out, out_shape))
     }
-}
-
-impl candle_core::CustomOp1 for LayerNorm {
-    fn name(&self) -> &'static str {
-        "fused-layer-norm"
-    }
-
-    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
-        candle_core::bail!("no cpu support for fused-layer-norm")
-    }
 
-    fn cuda_fwd(
+    fn bwd<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
         &self,
+        dz: &candle_core::CudaStorage,
+        dz_l: &Layout,
         x: &candle_core::CudaStorage,
         x_l: &Layout,
+        dx_add: Option<&Tensor>,
+        dropout: Option<(&Tensor, f32)>,
     ) -> Result<(candle_core::CudaStorage, Shape)> {
-        match x.dtype() {
-            DType::F16 => self.fwd::<f16>(x, x_l, None, None),
-            DType::BF16 => self.fwd::<bf16>(x, x_l, None, None),
-            DType::F32 => self.fwd::<f32>(x, x_l, None, None),
-            dt => {
-                candle_core::bail!(
-                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
-                )
-            }
-        }
-    }
-}
+        let dev = dz.device();
 
-impl candle_core::CustomOp2 for LayerNorm {
-    fn name(&self) -> &'static str {
-        "fused-layer-norm"
-    }
+        // Get internal layer norm type id for the given dtype
+        let dtype = dz.dtype();
+        let layer_norm_type = layer_norm_internal_type(dtype)?;
+
+        let (mu, rsigma) = match &self.stats {
+            LayerNormStats::Buffers { mu, rsigma } => (mu, rsigma),
+            _ => candle_core::bail!(
+                "the fused-layer-norm backward pass requires the stats saved by the forward pass"
+            ),
+        };
 
-    fn cpu_fwd(
-        &self,
-        _: &CpuStorage,
-        _: &Layout,
-        _: &CpuStorage,
+        let (rows, cols) = x_l.shape().dims2()?;
+        if dz_l.shape().dims2()? != (rows, cols) {
+            candle_core::bail!("shape mismatch x {:?} and dz {:?}", x_l.shape(), dz_l.shape());
+        }
+        if !x_l.is_contiguous() || !dz_l.is_contiguous() {
+            candle_core::bail!("the fused-layer-norm backward pass expects contiguous inputs")
+        }
+        if cols > 8192 {
+            candle_core::bail!("the fused-layer-norm backward pass supports hidden sizes <= 8192")
+        }
+        if mu.elem_count() != rows || rsigma.elem_count() != rows {
+            candle_core::bail!("stats must have {rows} elements, got {:?}", mu.shape())
+        }
+
+        let dz = dz.as_cuda_slice::<T>()?;
+        let dz = dz.slice(dz_l.start_offset()..);
+        let x = x.as_cuda_slice::<T>()?;
+        let x = x.slice(x_l.start_offset()..);
+
+        let cols_rounded = hidden_size_rounded(cols);
+        check_compiled(cols_rounded, dtype)?;
+        let is_rms_norm = if self.is_rms_norm { 1 } else { 0 };
+        let device = dev.ordinal() as i32;
+
+        if self.gamma.dtype() != dtype {
+            candle_core::bail!(
+                "the fused-layer-norm backward pass requires gamma in the dtype of the input {dtype:?}"
+            )
+        }
+        let g_ptr = cuda_tensor_ptr::<T>(&self.gamma, "gamma")?;
+        let mu_ptr = cuda_tensor_ptr::<f32>(mu, "mu")?;
+        let rsigma_ptr = cuda_tensor_ptr::<f32>(rsigma, "rsigma")?;
+        let dx_ptr = if let Some(dx_add) = dx_add {
+            if dx_add.dims2()? != (rows, cols) {
+                candle_core::bail!("shape mismatch x {:?} and dx {:?}", x_l.shape(), dx_add.shape());
+            }
+            cuda_tensor_ptr::<T>(dx_add, "dx")?
+        } else {
+            ptr::null() as *const std::ffi::c_void
+        };
+
+        // Workspaces for the first stage of the dgamma/dbeta column reduction.
+        let no_kernel = || {
+            candle_core::bail!(
+                "no backward kernel of hidden size {cols_rounded} for the type id {layer_norm_type}"
+            )
+        };
+        let mut parts_rows = 0u32;
+        let status = unsafe {
+            ffi::run_ln_bwd_ctas_per_col(
+                cols_rounded as u32,
+                cols as u32,
+                device,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                2,
+                &mut parts_rows,
+            )
+        };
+        if status != 0 {
+            return no_kernel();
+        }
+        let parts_rows = parts_rows as usize;
+        let dgamma_part = unsafe { dev.alloc::<f32>(parts_rows * cols) }.w()?;
+        let dbeta_part = unsafe { dev.alloc::<f32>(parts_rows * cols) }.w()?;
+
+        // With dropout, the gradient of its input only differs from the residual one on the kept
+        // elements, they are stored in the first rows.
+        let (dmask_ptr, dropout_p, dx_rows) = match dropout {
+            Some((dmask, p)) => {
+                if dmask.dtype() != DType::U32 || dmask.elem_count() != dmask_words(rows * cols) {
+                    candle_core::bail!(
+                        "dmask must be a u32 tensor with {} elements, got {:?} {:?}",
+                        dmask_words(rows * cols),
+                        dmask.dtype(),
+                        dmask.shape()
+                    )
+                }
+                (cuda_tensor_ptr::<u32>(dmask, "dmask")?, p, 2 * rows)
+            }
+            None => (ptr::null(), 0., rows),
+        };
+
+        // dx, dgamma and dbeta are stored next to each other, dgamma and dbeta taking one row each.
+        let out_shape = Shape::from((dx_rows + 2, cols));
+
+        let out = unsafe { dev.alloc::<T>(out_shape.elem_count()) }.w()?;
+        let dx0 = out.slice(..rows * cols);
+        let dgamma = out.slice(dx_rows * cols..(dx_rows + 1) * cols);
+        let dbeta = out.slice((dx_rows + 1) * cols..);
+        let dresidual_ptr = if dropout.is_some() {
+            *out.slice(rows * cols..dx_rows * cols).device_ptr() as *const core::ffi::c_void
+        } else {
+            ptr::null()
+        };
+
+        let dz_ptr = *dz.device_ptr() as *const core::ffi::c_void;
+        let x_ptr = *x.device_ptr() as *const core::ffi::c_void;
+        let dx0_ptr = *dx0.device_ptr() as *const core::ffi::c_void;
+        let dgamma_ptr = *dgamma.device_ptr() as *const core::ffi::c_void;
+        let dbeta_ptr = *dbeta.device_ptr() as *const core::ffi::c_void;
+        let dgamma_part_ptr = *dgamma_part.device_ptr() as *const core::ffi::c_void;
+        let dbeta_part_ptr = *dbeta_part.device_ptr() as *const core::ffi::c_void;
+
+        let stream = *dev.cu_stream() as *const core::ffi::c_void;
+
+        let status = unsafe {
+            // Launch Kernels
+            ffi::run_ln_bwd(
+                dz_ptr,
+                x_ptr,
+                dx_ptr,
+                mu_ptr,
+                rsigma_ptr,
+                g_ptr,
+                dx0_ptr,
+                dresidual_ptr,
+                dmask_ptr,
+                dropout_p,
+                dgamma_ptr,
+                dbeta_ptr,
+                dgamma_part_ptr,
+                dbeta_part_ptr,
+                cols_rounded as u32,
+                rows as u32,
+                cols as u32,
+                device,
+                stream,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                2,
+                is_rms_norm,
+            )
+        };
+        if status != 0 {
+            return no_kernel();
+        }
+
+        let out = candle_core::CudaStorage::wrap_cuda_slice(out, dev.clone());
+
+        Ok((out, out_shape))
+    }
+
+    /// Forward pass that also returns the statistics, as selected by `stats`
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+    /// * `residual` - Optional residual tensor with the same shape as `x`, added to `x` before normalization
+    pub fn forward(&self, x: &Tensor, residual: Option<&Tensor>) -> Result<LayerNormOutput> {
+        let (op, stats) = self.with_stats_buffers(num_rows(x), x.device())?;
+        // The backward pass of a tracked graph reads the statistics back
+        let op = match op.stats {
+            LayerNormStats::None => {
+                let stats = stats_for_backward(x, residual, &op.gamma, op.beta.as_ref())?;
+                LayerNorm { stats, ..op }
+            }
+            _ => op,
+        };
+        let (out, residual_add) = op.apply(x, residual)?;
+        Ok(LayerNormOutput {
+            out,
+            residual_add,
+            stats,
+            dmask: None,
+        })
+    }
+
+    /// Applies the forward pass to `x` and the optional residual, and splits off the result of the
+    /// residual add. gamma and beta are op arguments when they track gradients, so that autograd
+    /// reaches them, see [`LayerNormWeights`].
+    fn apply(&self, x: &Tensor, r: Option<&Tensor>) -> Result<(Tensor, Option<Tensor>)> {
+        let rows = x.dims()[0];
+        let split = |results: Tensor| -> Result<(Tensor, Option<Tensor>)> {
+            Ok((
+                results.narrow(0, 0, rows)?,
+                Some(results.narrow(0, rows, rows)?),
+            ))
+        };
+        let tracked_beta = self.beta.as_ref().filter(|b| b.track_op());
+        if !self.gamma.track_op() && tracked_beta.is_none() {
+            return match r {
+                None => Ok((x.apply_op1(self.clone())?, None)),
+                Some(r) => split(x.apply_op2(r, self.clone())?),
+            };
+        }
+
+        match (r, &self.beta) {
+            (None, None) => {
+                let op = LayerNormWeights {
+                    ln: self.clone(),
+                    args: WeightArgs::Gamma,
+                };
+                Ok((x.apply_op2(&self.gamma, op)?, None))
+            }
+            (None, Some(beta)) => {
+                let op = LayerNormWeights {
+                    ln: self.clone(),
+                    args: WeightArgs::GammaBeta,
+                };
+                Ok((x.apply_op3(&self.gamma, beta, op)?, None))
+            }
+            // There is no op of four arguments, a tracked beta is added after the fused pass
+            (Some(r), _) => {
+                let ln = match tracked_beta {
+                    Some(_) => LayerNorm {
+                        beta: None,
+                        ..self.clone()
+                    },
+                    None => self.clone(),
+                };
+                let op = LayerNormWeights {
+                    ln,
+                    args: WeightArgs::ResidualGamma,
+                };
+                let (out, residual_add) = split(x.apply_op3(r, &self.gamma, op)?)?;
+                match tracked_beta {
+                    Some(beta) => Ok((out.broadcast_add(beta)?, residual_add)),
+                    None => Ok((out, residual_add)),
+                }
+            }
+        }
+    }
+
+    /// The op of a forward pass that returns the statistics, with `Return` turned into buffers.
+    fn with_stats_buffers(
+        &self,
+        rows: usize,
+        device: &candle_core::Device,
+    ) -> Result<(LayerNorm, Option<(Tensor, Tensor)>)> {
+        let op = match self.stats {
+            LayerNormStats::Return => LayerNorm {
+                stats: stats_buffers_for_rows(rows, device)?,
+                ..self.clone()
+            },
+            _ => self.clone(),
+        };
+        let stats = match &op.stats {
+            LayerNormStats::Buffers { mu, rsigma } => Some((mu.clone(), rsigma.clone())),
+            _ => None,
+        };
+        Ok((op, stats))
+    }
+
+    /// Forward pass with dropout applied to `x` before the residual add, for training
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+    /// * `residual` - Optional residual tensor with the same shape as `x`
+    /// * `dropout` - Probability, Philox state and whether to return the keep mask
+    ///
+    /// The residual add result is always returned, without a residual it is the dropped input. No
+    /// gradient is tracked, [`LayerNorm::backward_dropout`] takes it with the returned mask and the
+    /// statistics selected by `stats`.
+    pub fn forward_dropout(
+        &self,
+        x: &Tensor,
+        residual: Option<&Tensor>,
+        dropout: &Dropout,
+    ) -> Result<LayerNormOutput> {
+        if !(0. ..1.).contains(&dropout.p) {
+            candle_core::bail!(
+                "the dropout probability must be in [0, 1), got {}",
+                dropout.p
+            )
+        }
+        let (ln, stats) = self.with_stats_buffers(num_rows(x), x.device())?;
+        // Vectors of fewer than 8 elements or-in their keep bits
+        let dmask = if dropout.return_mask {
+            let words = dmask_words(x.elem_count());
+            Some(Tensor::zeros(words, DType::U32, x.device())?)
+        } else {
+            None
+        };
+        let op = LayerNormDropout {
+            ln: &ln,
+            dropout,
+            dmask: dmask.as_ref(),
+        };
+        // The residual add result is returned without a residual too, for the backward pass
+        let results = match residual {
+            None => x.apply_op1_no_bwd(&op)?,
+            Some(r) => x.apply_op2_no_bwd(r, &op)?,
+        };
+        let rows = x.dims()[0];
+        Ok(LayerNormOutput {
+            out: results.narrow(0, 0, rows)?,
+            residual_add: Some(results.narrow(0, rows, rows)?),
+            stats,
+            dmask,
+        })
+    }
+
+    /// Forward pass with per-row and per-column scales of `x` before the residual add, and row
+    /// subsets that only read and normalize the rows that are needed, for inference
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows. With a subset,
+    /// the gathered rows in any number
+    /// * `residual` - Optional residual tensor, with one row per row of the residual add
+    /// * `scales` - The scales and the subset, the rows of the residual add are the entries of the
+    /// subset when there is one and those of `x` otherwise
+    ///
+    /// The outputs have `subset.num_out_rows` rows with a subset and the shape of `x` otherwise,
+    /// rows whose index is never selected are left uninitialized. The residual add result is
+    /// always returned. No gradient is tracked, and the statistics selected by `stats` have one
+    /// entry per row of the residual add. Subset indices past the rows of `x` or of the outputs
+    /// are skipped like 0, by the kernel.
+    pub fn forward_scaled(
+        &self,
+        x: &Tensor,
+        residual: Option<&Tensor>,
+        scales: &InputScales,
+    ) -> Result<LayerNormOutput> {
+        let cols = x.dims()[x.rank() - 1];
+        let rows = match &scales.subset {
+            Some(subset) => {
+                if scales.rowscale.is_some() {
+                    candle_core::bail!(
+                        "a row subset takes a single row scale, set RowSubset::scale instead"
+                    )
+                }
+                let rows = subset.x_rows.elem_count();
+                for (t, name) in [(&subset.x_rows, "x_rows"), (&subset.out_rows, "out_rows")] {
+                    if t.dtype() != DType::U32 || t.elem_count() != rows {
+                        candle_core::bail!(
+                            "{name} must be a u32 tensor with {rows} elements, got {:?} {:?}",
+                            t.dtype(),
+                            t.shape()
+                        )
+                    }
+                }
+                rows
+            }
+            None => num_rows(x),
+        };
+        if let Some(rowscale) = &scales.rowscale {
+            if rowscale.dtype() != x.dtype() || rowscale.elem_count() != rows {
+                candle_core::bail!(
+                    "rowscale must have the dtype of x and {rows} elements, got {:?} {:?}",
+                    rowscale.dtype(),
+                    rowscale.shape()
+                )
+            }
+        }
+        if let Some(colscale) = &scales.colscale {
+            if colscale.dtype() != self.gamma.dtype() || colscale.elem_count() != cols {
+                candle_core::bail!(
+                    "colscale must have the dtype of gamma and {cols} elements, got {:?} {:?}",
+                    colscale.dtype(),
+                    colscale.shape()
+                )
+            }
+        }
+        let out_rows = scales.subset.as_ref().map_or(rows, |s| s.num_out_rows);
+
+        let (ln, stats) = self.with_stats_buffers(rows, x.device())?;
+        let op = LayerNormScaled {
+            ln: &ln,
+            scales,
+            rows,
+            out_rows,
+        };
+        let results = match residual {
+            None => x.apply_op1_no_bwd(&op)?,
+            Some(r) => x.apply_op2_no_bwd(r, &op)?,
+        };
+        let (mut out, mut residual_add) = (
+            results.narrow(0, 0, out_rows)?,
+            results.narrow(0, out_rows, rows)?,
+        );
+        if scales.subset.is_none() {
+            out = out.reshape(x.shape())?;
+            residual_add = residual_add.reshape(x.shape())?;
+        }
+        Ok(LayerNormOutput {
+            out,
+            residual_add: Some(residual_add),
+            stats,
+            dmask: None,
+        })
+    }
+
+    /// Forward pass with a per-column bias added to `x` before the residual add, for the outputs
+    /// of a projection whose GEMM did not apply its bias
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+    /// * `bias` - Bias with one element per column and the dtype of gamma
+    /// * `residual` - Optional residual tensor with the same shape as `x`
+    ///
+    /// The residual add result `x + bias + residual` is always returned, without a residual it is
+    /// `x + bias`. No gradient is tracked.
+    pub fn forward_bias(
+        &self,
+        x: &Tensor,
+        bias: &Tensor,
+        residual: Option<&Tensor>,
+    ) -> Result<LayerNormOutput> {
+        let cols = x.dims()[x.rank() - 1];
+        if bias.dtype() != self.gamma.dtype() || bias.elem_count() != cols {
+            candle_core::bail!(
+                "bias must have the dtype of gamma and {cols} elements, got {:?} {:?}",
+                bias.dtype(),
+                bias.shape()
+            )
+        }
+        let (ln, stats) = self.with_stats_buffers(num_rows(x), x.device())?;
+        let op = LayerNormBias { ln: &ln, bias };
+        let results = match residual {
+            None => x.apply_op1_no_bwd(&op)?,
+            Some(r) => x.apply_op2_no_bwd(r, &op)?,
+        };
+        let rows = x.dims()[0];
+        Ok(LayerNormOutput {
+            out: results.narrow(0, 0, rows)?,
+            residual_add: Some(results.narrow(0, rows, rows)?),
+            stats,
+            dmask: None,
+        })
+    }
+
+    /// Forward pass that can be captured in a CUDA graph
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows. Its rows are the
+    /// largest row count the launches serve, e.g. those of a batch size bucket
+    /// * `residual` - Optional residual tensor with the same shape as `x`
+    /// * `buffers` - The number of rows, on the device, and the outputs
+    ///
+    /// Only the first `buffers.rows` rows are read and written, so one graph captured with the rows
+    /// of `x` serves every smaller row count by updating `buffers.rows` before the replay. Once a
+    /// launch of the same kernel ran outside of the capture, e.g. in a warm-up step, launches do
+    /// not allocate, synchronize or query the device. The statistics selected by `stats` must be
+    /// caller buffers too. No gradient is tracked.
+    pub fn forward_graph_safe(
+        &self,
+        x: &Tensor,
+        residual: Option<&Tensor>,
+        buffers: &GraphBuffers,
+    ) -> Result<()> {
+        if buffers.rows.dtype() != DType::U32 || buffers.rows.elem_count() != 1 {
+            candle_core::bail!(
+                "rows must be a u32 tensor with a single element, got {:?} {:?}",
+                buffers.rows.dtype(),
+                buffers.rows.shape()
+            )
+        }
+        if residual.is_some() != buffers.residual_add.is_some() {
+            candle_core::bail!("residual_add must be given if and only if there is a residual")
+        }
+        // The results of the residual add have the dtype of the residual
+        let residual_dtype = residual.map_or(x.dtype(), |r| r.dtype());
+        for (t, dtype, name) in [
+            (Some(buffers.out), x.dtype(), "out"),
+            (buffers.residual_add, residual_dtype, "residual_add"),
+        ] {
+            if let Some(t) = t {
+                if t.dtype() != dtype || t.dims() != x.dims() || !t.is_contiguous() {
+                    candle_core::bail!(
+                        "{name} must be a contiguous {dtype:?} tensor with the shape of x, got {:?} {:?}",
+                        t.dtype(),
+                        t.shape()
+                    )
+                }
+            }
+        }
+        match x.dtype() {
+            DType::F16 => self.fwd_graph_safe::<f16>(x, residual, buffers),
+            DType::BF16 => self.fwd_graph_safe::<bf16>(x, residual, buffers),
+            DType::F32 => self.fwd_graph_safe::<f32>(x, residual, buffers),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+
+    fn fwd_graph_safe<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x: &Tensor,
+        residual: Option<&Tensor>,
+        buffers: &GraphBuffers,
+    ) -> Result<()> {
+        let graph = GraphArgs {
+            rows: cuda_tensor_ptr::<u32>(buffers.rows, "rows")?,
+            dst: cuda_tensor_ptr::<T>(buffers.out, "out")?,
+            dst_add: match buffers.residual_add {
+                Some(t) => cuda_tensor_ptr_any(t, "residual_add")?,
+                None => ptr::null(),
+            },
+        };
+        let opts = FwdOptions {
+            graph: Some(&graph),
+            ..Default::default()
+        };
+        let (x_s, x_l) = x.storage_and_layout();
+        let x_s = match &*x_s {
+            Storage::Cuda(s) => s,
+            _ => candle_core::bail!("x must be a cuda tensor"),
+        };
+        match residual {
+            None => self.fwd_launch::<T>(x_s, x_l, None, None, &opts)?,
+            Some(r) => {
+                let (r_s, r_l) = r.storage_and_layout();
+                let r_s = match &*r_s {
+                    Storage::Cuda(s) => s,
+                    _ => candle_core::bail!("r must be a cuda tensor"),
+                };
+                self.fwd_launch::<T>(x_s, x_l, Some(r_s), Some(r_l), &opts)?
+            }
+        };
+        Ok(())
+    }
+
+    /// Forward pass with a residual that is updated in place with `x + residual`
+    ///
+    /// This keeps the residual stream of a pre-norm stack in a single buffer across layers. No
+    /// gradient is tracked through the in-place update.
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+    /// * `residual` - Residual tensor with the same shape as `x` and rows that do not overlap.
+    /// Its storage must not be shared with other tensors that are still in use. It can be f32 with
+    /// f16 or bf16 inputs, for a full precision residual stream, see [`FWD_DTYPES`].
+    pub fn forward_residual_inplace(&self, x: &Tensor, residual: &mut Tensor) -> Result<Tensor> {
+        x.apply_op2_no_bwd(residual, &LayerNormResidualInplace(self))
+    }
+
+    /// Forward pass with outputs quantized to 8 bits, without a separate quantization pass
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 2, f16 or bf16
+    /// * `residual` - Optional residual, updated in place with `x + residual` as in
+    /// [`LayerNorm::forward_residual_inplace`]
+    /// * `dtype` - Element type of the quantized outputs
+    /// * `scale` - Per-row or static per-tensor scale
+    ///
+    /// Returns the quantized outputs as a u8 tensor holding the raw fp8 or int8 bits, and the
+    /// per-row f32 scales for `QuantScale::PerRow`. The hidden size must be <= 8192.
+    pub fn forward_quantized(
+        &self,
+        x: &Tensor,
+        residual: Option<&mut Tensor>,
+        dtype: QuantDType,
+        scale: &QuantScale,
+    ) -> Result<(Tensor, Option<Tensor>)> {
+        let rows = num_rows(x);
+        let row_scale = match scale {
+            QuantScale::PerRow => Some(Tensor::zeros(rows, DType::F32, x.device())?),
+            QuantScale::Static(_) => None,
+        };
+        let op = LayerNormQuantized {
+            ln: self,
+            dtype,
+            row_scale: row_scale.as_ref(),
+            static_scale: match scale {
+                QuantScale::PerRow => None,
+                QuantScale::Static(t) => Some(t),
+            },
+        };
+        let out = match residual {
+            None => x.apply_op1_no_bwd(&op)?,
+            Some(r) => x.apply_op2_no_bwd(r, &op)?,
+        };
+        Ok((out, row_scale))
+    }
+
+    /// Forward pass followed by a rotary embedding of the outputs, for the per-head norms of
+    /// queries and keys, without a separate pass over them
+    ///
+    /// # Arguments
+    ///
+    /// * `x` - Input tensor of rank >= 3, the second to last dim is the heads and the last one
+    /// the head dim, that must be one of 64, 128, 256 or 512
+    /// * `rope` - The cos and sin caches and the rotated pairs
+    /// * `positions` - Optional u32 tensor with the position of each token, the leading dims of
+    /// `x` flattened. Token i is at position i without it
+    pub fn forward_rope(
+        &self,
+        x: &Tensor,
+        rope: &RotaryEmbedding,
+        positions: Option<&Tensor>,
+    ) -> Result<Tensor> {
+        x.apply_op1_no_bwd(&LayerNormRope {
+            ln: self,
+            rope,
+            positions,
+        })
+    }
+
+    /// Fused backward pass
+    ///
+    /// # Arguments
+    ///
+    /// * `dz` - Gradient wrt. the normalized output
+    /// * `x` - Input of the normalization, that is the result of the residual add for the
+    /// fused-add variants
+    /// * `dx_add` - Gradient wrt. the result of the residual add for the fused-add variants
+    ///
+    /// The statistics must have been written by a previous forward pass on `x` into the
+    /// `Buffers` of `stats`.
+    pub fn backward(
+        &self,
+        dz: &Tensor,
+        x: &Tensor,
+        dx_add: Option<&Tensor>,
+    ) -> Result<LayerNormGrads> {
+        self.backward_impl(dz, x, dx_add, None)
+    }
+
+    /// Fused backward pass of [`LayerNorm::forward_dropout`]
+    ///
+    /// As [`LayerNorm::backward`], with `dmask` the keep mask returned by the forward pass and `p`
+    /// its dropout probability. `dx` is the gradient wrt. the residual and `dx0` the one wrt. the
+    /// input of the dropout.
+    pub fn backward_dropout(
+        &self,
+        dz: &Tensor,
+        x: &Tensor,
+        dx_add: Option<&Tensor>,
+        dmask: &Tensor,
+        p: f32,
+    ) -> Result<LayerNormGrads> {
+        self.backward_impl(dz, x, dx_add, Some((dmask, p)))
+    }
+
+    fn backward_impl(
+        &self,
+        dz: &Tensor,
+        x: &Tensor,
+        dx_add: Option<&Tensor>,
+        dropout: Option<(&Tensor, f32)>,
+    ) -> Result<LayerNormGrads> {
+        // The leading dims are flattened into rows, as in the forward pass
+        let shape = x.shape().clone();
+        let flatten = |t: &Tensor| t.contiguous()?.flatten_to(t.rank().saturating_sub(2));
+        let dz = flatten(dz)?;
+        let x = flatten(x)?;
+        let dx_add = dx_add.map(flatten).transpose()?;
+        let rows = x.dims2()?.0;
+
+        let op = LayerNormBwd {
+            ln: self,
+            dx_add: dx_add.as_ref(),
+            dropout,
+        };
+        let results = dz.apply_op2_no_bwd(&x, &op)?;
+        let (dx, dx0, dx_rows) = match dropout {
+            Some(_) => (
+                results.narrow(0, rows, rows)?.reshape(shape.clone())?,
+                Some(results.narrow(0, 0, rows)?.reshape(shape)?),
+                2 * rows,
+            ),
+            None => (results.narrow(0, 0, rows)?.reshape(shape)?, None, rows),
+        };
+        let dgamma = results.get(dx_rows)?;
+        let dbeta = match self.beta {
+            Some(_) => Some(results.get(dx_rows + 1)?),
+            None => None,
+        };
+        Ok(LayerNormGrads {
+            dx,
+            dx0,
+            dgamma,
+            dbeta,
+        })
+    }
+}
+
+struct LayerNormBwd<'a> {
+    ln: &'a LayerNorm,
+    dx_add: Option<&'a Tensor>,
+    dropout: Option<(&'a Tensor, f32)>,
+}
+
+impl candle_core::CustomOp2 for LayerNormBwd<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-bwd"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm-bwd")
+    }
+
+    fn cuda_fwd(
+        &self,
+        dz: &candle_core::CudaStorage,
+        dz_l: &Layout,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match dz.dtype() {
+            DType::F16 => self
+                .ln
+                .bwd::<f16>(dz, dz_l, x, x_l, self.dx_add, self.dropout),
+            DType::BF16 => self
+                .ln
+                .bwd::<bf16>(dz, dz_l, x, x_l, self.dx_add, self.dropout),
+            DType::F32 => self
+                .ln
+                .bwd::<f32>(dz, dz_l, x, x_l, self.dx_add, self.dropout),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNorm {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm"
+    }
+
+    fn cpu_fwd(&self, x: &CpuStorage, x_l: &Layout) -> Result<(CpuStorage, Shape)> {
+        cpu::fwd(self, x, x_l, None)
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match x.dtype() {
+            DType::F16 => self.fwd::<f16>(x, x_l, None, None, &FwdOptions::default()),
+            DType::BF16 => self.fwd::<bf16>(x, x_l, None, None, &FwdOptions::default()),
+            DType::F32 => self.fwd::<f32>(x, x_l, None, None, &FwdOptions::default()),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+
+    // gamma and beta are not arguments of the op so only the input gradient is propagated, the
+    // weights that track gradients go through LayerNormWeights instead.
+    fn bwd(&self, arg: &Tensor, _res: &Tensor, grad_res: &Tensor) -> Result<Option<Tensor>> {
+        let grads = self.backward(grad_res, arg, None)?;
+        Ok(Some(grads.dx))
+    }
+}
+
+impl candle_core::CustomOp2 for LayerNorm {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm"
+    }
+
+    fn cpu_fwd(
+        &self,
+        x: &CpuStorage,
+        x_l: &Layout,
+        r: &CpuStorage,
+        r_l: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        cpu::fwd(self, x, x_l, Some((r, r_l)))
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: &candle_core::CudaStorage,
+        r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match x.dtype() {
+            DType::F16 => self.fwd::<f16>(x, x_l, Some(r), Some(r_l), &FwdOptions::default()),
+            DType::BF16 => self.fwd::<bf16>(x, x_l, Some(r), Some(r_l), &FwdOptions::default()),
+            DType::F32 => self.fwd::<f32>(x, x_l, Some(r), Some(r_l), &FwdOptions::default()),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+
+    // The residual add output is the input of the normalization, its gradient is added to the
+    // gradient flowing back through the normalization. Both inputs get the same gradient.
+    fn bwd(
+        &self,
+        arg1: &Tensor,
+        _arg2: &Tensor,
+        res: &Tensor,
+        grad_res: &Tensor,
+    ) -> Result<(Option<Tensor>, Option<Tensor>)> {
+        let rows = arg1.dims()[0];
+        let x = res.narrow(0, rows, rows)?;
+        let dz = grad_res.narrow(0, 0, rows)?;
+        let dx_add = grad_res.narrow(0, rows, rows)?;
+        let grads = self.backward(&dz, &x, Some(&dx_add))?;
+        Ok((Some(grads.dx.clone()), Some(grads.dx)))
+    }
+}
+
+/// Arguments of a [`LayerNormWeights`] op after `x`.
+#[derive(Clone, Copy)]
+enum WeightArgs {
+    Gamma,
+    GammaBeta,
+    ResidualGamma,
+}
+
+/// The forward pass of [`LayerNorm`] with its weights as op arguments, for the weights that track
+/// gradients. The backward pass returns the weight gradients of the column reduction of the fused
+/// backward kernels.
+struct LayerNormWeights {
+    ln: LayerNorm,
+    args: WeightArgs,
+}
+
+impl candle_core::CustomOp2 for LayerNormWeights {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm"
+    }
+
+    fn cpu_fwd(
+        &self,
+        x: &CpuStorage,
+        x_l: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::CustomOp1::cpu_fwd(&self.ln, x, x_l)
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        _: &candle_core::CudaStorage,
+        _: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        candle_core::CustomOp1::cuda_fwd(&self.ln, x, x_l)
+    }
+
+    fn bwd(
+        &self,
+        x: &Tensor,
+        gamma: &Tensor,
+        _res: &Tensor,
+        grad_res: &Tensor,
+    ) -> Result<(Option<Tensor>, Option<Tensor>)> {
+        let grads = self.ln.backward(grad_res, x, None)?;
+        Ok((Some(grads.dx), Some(grads.dgamma.reshape(gamma.shape())?)))
+    }
+}
+
+impl candle_core::CustomOp3 for LayerNormWeights {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm"
+    }
+
+    fn cpu_fwd(
+        &self,
+        x: &CpuStorage,
+        x_l: &Layout,
+        arg2: &CpuStorage,
+        arg2_l: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        match self.args {
+            WeightArgs::ResidualGamma => {
+                candle_core::CustomOp2::cpu_fwd(&self.ln, x, x_l, arg2, arg2_l)
+            }
+            _ => candle_core::CustomOp1::cpu_fwd(&self.ln, x, x_l),
+        }
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        arg2: &candle_core::CudaStorage,
+        arg2_l: &Layout,
+        _: &candle_core::CudaStorage,
+        _: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match self.args {
+            WeightArgs::ResidualGamma => {
+                candle_core::CustomOp2::cuda_fwd(&self.ln, x, x_l, arg2, arg2_l)
+            }
+            _ => candle_core::CustomOp1::cuda_fwd(&self.ln, x, x_l),
+        }
+    }
+
+    // As the bwd of LayerNorm, with the weight gradients of the arguments.
+    fn bwd(
+        &self,
+        arg1: &Tensor,
+        arg2: &Tensor,
+        arg3: &Tensor,
+        res: &Tensor,
+        grad_res: &Tensor,
+    ) -> Result<(Option<Tensor>, Option<Tensor>, Option<Tensor>)> {
+        match self.args {
+            WeightArgs::ResidualGamma => {
+                let rows = arg1.dims()[0];
+                let x = res.narrow(0, rows, rows)?;
+                let dz = grad_res.narrow(0, 0, rows)?;
+                let dx_add = grad_res.narrow(0, rows, rows)?;
+                let grads = self.ln.backward(&dz, &x, Some(&dx_add))?;
+                let dgamma = grads.dgamma.reshape(arg3.shape())?;
+                Ok((Some(grads.dx.clone()), Some(grads.dx), Some(dgamma)))
+            }
+            _ => {
+                let grads = self.ln.backward(grad_res, arg1, None)?;
+                let dgamma = grads.dgamma.reshape(arg2.shape())?;
+                let dbeta = grads.dbeta.map(|d| d.reshape(arg3.shape())).transpose()?;
+                Ok((Some(grads.dx), Some(dgamma), dbeta))
+            }
+        }
+    }
+}
+
+struct LayerNormDropout<'a> {
+    ln: &'a LayerNorm,
+    dropout: &'a Dropout,
+    dmask: Option<&'a Tensor>,
+}
+
+impl LayerNormDropout<'_> {
+    fn fwd<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let dropout = DropoutArgs {
+            dmask: match self.dmask {
+                Some(dmask) => cuda_tensor_ptr::<u32>(dmask, "dmask")?,
+                None => ptr::null(),
+            },
+            p: self.dropout.p,
+            seed: self.dropout.seed,
+            offset: self.dropout.offset,
+        };
+        let opts = FwdOptions {
+            dropout: Some(&dropout),
+            ..Default::default()
+        };
+        self.ln.fwd::<T>(x, x_l, r, r_l, &opts)
+    }
+
+    fn dispatch(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match x.dtype() {
+            DType::F16 => self.fwd::<f16>(x, x_l, r, r_l),
+            DType::BF16 => self.fwd::<bf16>(x, x_l, r, r_l),
+            DType::F32 => self.fwd::<f32>(x, x_l, r, r_l),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormDropout<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-dropout"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, None, None)
+    }
+}
+
+impl candle_core::CustomOp2 for LayerNormDropout<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-dropout"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: &candle_core::CudaStorage,
+        r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, Some(r), Some(r_l))
+    }
+}
+
+struct LayerNormScaled<'a> {
+    ln: &'a LayerNorm,
+    scales: &'a InputScales,
+    rows: usize,
+    out_rows: usize,
+}
+
+impl LayerNormScaled<'_> {
+    fn fwd<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let ptr_or_null = |t: Option<&Tensor>, name| match t {
+            Some(t) => cuda_tensor_ptr::<T>(t, name),
+            None => Ok(ptr::null()),
+        };
+        let subset = self.scales.subset.as_ref();
+        let scales = ScaleArgs {
+            rowscale: ptr_or_null(self.scales.rowscale.as_ref(), "rowscale")?,
+            colscale: match self.scales.colscale.as_ref() {
+                Some(t) => cuda_tensor_ptr_any(t, "colscale")?,
+                None => ptr::null(),
+            },
+            x0_subset: match subset {
+                Some(s) => cuda_tensor_ptr::<u32>(&s.x_rows, "x_rows")?,
+                None => ptr::null(),
+            },
+            z_subset: match subset {
+                Some(s) => cuda_tensor_ptr::<u32>(&s.out_rows, "out_rows")?,
+                None => ptr::null(),
+            },
+            rowscale_const: subset.map_or(1., |s| s.scale),
+            rows: self.rows,
+            out_rows: self.out_rows,
+        };
+        let opts = FwdOptions {
+            scales: Some(&scales),
+            ..Default::default()
+        };
+        self.ln.fwd::<T>(x, x_l, r, r_l, &opts)
+    }
+
+    fn dispatch(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match x.dtype() {
+            DType::F16 => self.fwd::<f16>(x, x_l, r, r_l),
+            DType::BF16 => self.fwd::<bf16>(x, x_l, r, r_l),
+            DType::F32 => self.fwd::<f32>(x, x_l, r, r_l),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormScaled<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-scaled"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, None, None)
+    }
+}
+
+impl candle_core::CustomOp2 for LayerNormScaled<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-scaled"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: &candle_core::CudaStorage,
+        r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, Some(r), Some(r_l))
+    }
+}
+
+struct LayerNormBias<'a> {
+    ln: &'a LayerNorm,
+    bias: &'a Tensor,
+}
+
+impl LayerNormBias<'_> {
+    fn dispatch(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let opts = FwdOptions {
+            x0_bias: Some(self.bias),
+            ..Default::default()
+        };
+        match x.dtype() {
+            DType::F16 => self.ln.fwd::<f16>(x, x_l, r, r_l, &opts),
+            DType::BF16 => self.ln.fwd::<bf16>(x, x_l, r, r_l, &opts),
+            DType::F32 => self.ln.fwd::<f32>(x, x_l, r, r_l, &opts),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormBias<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-bias"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, None, None)
+    }
+}
+
+impl candle_core::CustomOp2 for LayerNormBias<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-bias"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: &candle_core::CudaStorage,
+        r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.dispatch(x, x_l, Some(r), Some(r_l))
+    }
+}
+
+/// Fused add normalization that writes the result of the residual add over the residual.
+struct LayerNormResidualInplace<'a>(&'a LayerNorm);
+
+impl candle_core::CustomOp2 for LayerNormResidualInplace<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-residual-inplace"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
+        _: &Layout,
+    ) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: &candle_core::CudaStorage,
+        r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let opts = FwdOptions {
+            residual_inplace: true,
+            ..Default::default()
+        };
+        match x.dtype() {
+            DType::F16 => self.0.fwd::<f16>(x, x_l, Some(r), Some(r_l), &opts),
+            DType::BF16 => self.0.fwd::<bf16>(x, x_l, Some(r), Some(r_l), &opts),
+            DType::F32 => self.0.fwd::<f32>(x, x_l, Some(r), Some(r_l), &opts),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+/// Fused normalization with quantized outputs, see [`LayerNorm::forward_quantized`].
+struct LayerNormQuantized<'a> {
+    ln: &'a LayerNorm,
+    dtype: QuantDType,
+    row_scale: Option<&'a Tensor>,
+    static_scale: Option<&'a Tensor>,
+}
+
+impl LayerNormQuantized<'_> {
+    fn fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+        r: Option<&candle_core::CudaStorage>,
+        r_l: Option<&Layout>,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let rows = row_layout(x_l, "x")?.rows;
+        let scale_ptr = |t: Option<&Tensor>, name: &str, elem_count: usize| match t {
+            Some(t) => {
+                if t.dtype() != DType::F32 || t.elem_count() != elem_count {
+                    candle_core::bail!(
+                        "{name} must be an f32 tensor with {elem_count} elements, got {:?} {:?}",
+                        t.dtype(),
+                        t.shape()
+                    )
+                }
+                cuda_tensor_ptr::<f32>(t, name)
+            }
+            None => Ok(ptr::null()),
+        };
+        let quant = QuantOutput {
+            otype: self.dtype.internal_type(),
+            z_scale: scale_ptr(self.row_scale, "row_scale", rows)?,
+            quant_scale: scale_ptr(self.static_scale, "scale", 1)?,
+        };
+        let opts = FwdOptions {
+            residual_inplace: r.is_some(),
+            quant: Some(&quant),
+            ..Default::default()
+        };
+        match x.dtype() {
+            DType::F16 => self.ln.fwd::<f16>(x, x_l, r, r_l, &opts),
+            DType::BF16 => self.ln.fwd::<bf16>(x, x_l, r, r_l, &opts),
+            dt => {
+                candle_core::bail!(
+                    "quantized fused-layer-norm is only supported for f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormQuantized<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-quantized"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.fwd(x, x_l, None, None)
+    }
+}
+
+impl candle_core::CustomOp2 for LayerNormQuantized<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-quantized"
+    }
+
+    fn cpu_fwd(
+        &self,
+        _: &CpuStorage,
+        _: &Layout,
+        _: &CpuStorage,
         _: &Layout,
     ) -> Result<(CpuStorage, Shape)> {
         candle_core::bail!("no cpu support for fused-layer-norm")
@@ -251,11 +2543,279 @@ impl candle_core::CustomOp2 for LayerNorm {
         x_l: &Layout,
         r: &candle_core::CudaStorage,
         r_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        self.fwd(x, x_l, Some(r), Some(r_l))
+    }
+}
+
+struct LayerNormRope<'a> {
+    ln: &'a LayerNorm,
+    rope: &'a RotaryEmbedding,
+    positions: Option<&'a Tensor>,
+}
+
+impl LayerNormRope<'_> {
+    fn fwd<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let layout = row_layout(x_l, "x")?;
+        let tokens = layout.rows / layout.heads;
+        let freqs = layout.cols / 2;
+        for (t, name) in [(&self.rope.cos, "cos"), (&self.rope.sin, "sin")] {
+            let (max_positions, t_freqs) = t.dims2()?;
+            if t.dtype() != x.dtype() || t_freqs != freqs || !t.is_contiguous() {
+                candle_core::bail!(
+                    "{name} must be a contiguous {:?} tensor with {freqs} columns, got {:?} {:?}",
+                    x.dtype(),
+                    t.dtype(),
+                    t.shape()
+                )
+            }
+            if self.positions.is_none() && tokens > max_positions {
+                candle_core::bail!(
+                    "{tokens} tokens do not fit in the {max_positions} positions of {name}"
+                )
+            }
+        }
+        let pos = match self.positions {
+            Some(p) => {
+                if p.dtype() != DType::U32 || p.elem_count() != tokens || !p.is_contiguous() {
+                    candle_core::bail!(
+                        "positions must be a contiguous u32 tensor with {tokens} elements, got {:?} {:?}",
+                        p.dtype(),
+                        p.shape()
+                    )
+                }
+                cuda_tensor_ptr::<u32>(p, "positions")?
+            }
+            None => ptr::null(),
+        };
+        let rope = RopeArgs {
+            cos: cuda_tensor_ptr::<T>(&self.rope.cos, "cos")?,
+            sin: cuda_tensor_ptr::<T>(&self.rope.sin, "sin")?,
+            pos,
+            interleaved: if self.rope.interleaved { 1 } else { 0 },
+        };
+        let opts = FwdOptions {
+            rope: Some(&rope),
+            ..Default::default()
+        };
+        self.ln.fwd::<T>(x, x_l, None, None, &opts)
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormRope<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-rope"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        match x.dtype() {
+            DType::F16 => self.fwd::<f16>(x, x_l),
+            DType::BF16 => self.fwd::<bf16>(x, x_l),
+            DType::F32 => self.fwd::<f32>(x, x_l),
+            dt => {
+                candle_core::bail!(
+                    "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
+                )
+            }
+        }
+    }
+}
+
+/// One normalization of a grouped launch, see [`layer_norm_grouped`].
+pub struct GroupedNorm<'a> {
+    pub ln: &'a LayerNorm,
+    /// Input tensor of rank >= 2, the leading dims are flattened into rows
+    pub x: &'a Tensor,
+    /// Optional residual tensor with the same shape as `x`, added to `x` before normalization
+    pub residual: Option<&'a Tensor>,
+}
+
+/// Several independent normalizations in one launch, see [`layer_norm_grouped`]. The results are
+/// packed in a single buffer, in order and with the residual add result after each output.
+struct LayerNormGrouped<'a> {
+    norms: &'a [GroupedNorm<'a>],
+}
+
+impl LayerNormGrouped<'_> {
+    fn fwd<
+        T: candle_core::cuda_backend::CudaDType
+            + candle_core::cuda_backend::cudarc::driver::DeviceRepr,
+    >(
+        &self,
+        x0: &candle_core::CudaStorage,
+        x0_l: &Layout,
+    ) -> Result<(candle_core::CudaStorage, Shape)> {
+        let dev = x0.device();
+
+        // Get internal layer norm type id for the given dtype
+        let layer_norm_type = layer_norm_internal_type(x0.dtype())?;
+
+        let n = self.norms.len();
+        let mut x_ptrs = Vec::with_capacity(n);
+        let mut r_ptrs = Vec::with_capacity(n);
+        let mut g_ptrs = Vec::with_capacity(n);
+        let mut b_ptrs = Vec::with_capacity(n);
+        let mut rows = Vec::with_capacity(n);
+        let mut cols = Vec::with_capacity(n);
+        let mut x_row_strides = Vec::with_capacity(n);
+        let mut r_row_strides = Vec::with_capacity(n);
+        let mut epsilons = Vec::with_capacity(n);
+        let mut is_rms_norms = Vec::with_capacity(n);
+
+        for (i, norm) in self.norms.iter().enumerate() {
+            if !matches!(norm.ln.stats, LayerNormStats::None) {
+                candle_core::bail!("grouped launches do not save the stats")
+            }
+
+            // The storage of the first input is already borrowed by the op
+            let (x_ptr, x_rows, x_cols, x_row_stride) = if i == 0 {
+                cuda_rows_ptr::<T>(x0, x0_l, "x")?
+            } else {
+                let (s, l) = norm.x.storage_and_layout();
+                match &*s {
+                    Storage::Cuda(s) => cuda_rows_ptr::<T>(s, &l, "x")?,
+                    _ => candle_core::bail!("x must be a cuda tensor"),
+                }
+            };
+            if !(x_cols % 8 == 0 && x_cols <= 8192) {
+                candle_core::bail!(
+                    "grouped launches support hidden sizes % 8 and <= 8192, it is {:?}",
+                    norm.x.shape()
+                )
+            }
+
+            let (r_ptr, r_row_stride) = match norm.residual {
+                Some(r) => {
+                    if r.dims() != norm.x.dims() {
+                        candle_core::bail!(
+                            "shape mismatch x {:?} and r {:?}",
+                            norm.x.shape(),
+                            r.shape()
+                        );
+                    }
+                    let (s, l) = r.storage_and_layout();
+                    let (r_ptr, _, _, r_row_stride) = match &*s {
+                        Storage::Cuda(s) => cuda_rows_ptr::<T>(s, &l, "r")?,
+                        _ => candle_core::bail!("r must be a cuda tensor"),
+                    };
+                    (r_ptr, r_row_stride)
+                }
+                None => (ptr::null(), x_cols),
+            };
+
+            x_ptrs.push(x_ptr);
+            r_ptrs.push(r_ptr);
+            g_ptrs.push(cuda_tensor_ptr::<T>(&norm.ln.gamma, "gamma")?);
+            b_ptrs.push(match &norm.ln.beta {
+                Some(beta) => cuda_tensor_ptr::<T>(beta, "beta")?,
+                None => ptr::null(),
+            });
+            rows.push(x_rows as u32);
+            cols.push(x_cols as u32);
+            x_row_strides.push(x_row_stride as u32);
+            r_row_strides.push(r_row_stride as u32);
+            epsilons.push(norm.ln.epsilon);
+            is_rms_norms.push(if norm.ln.is_rms_norm { 1 } else { 0 });
+        }
+
+        // Every output starts at a multiple of cols, so at a vectorized store boundary
+        let sizes: Vec<usize> = (0..n).map(|i| rows[i] as usize * cols[i] as usize).collect();
+        let elem_count = (0..n)
+            .map(|i| sizes[i] * if r_ptrs[i].is_null() { 1 } else { 2 })
+            .sum::<usize>();
+        let out = unsafe { dev.alloc::<T>(elem_count) }.w()?;
+        let mut dst_ptrs = Vec::with_capacity(n);
+        let mut dst_add_ptrs = Vec::with_capacity(n);
+        let mut offset = 0;
+        for i in 0..n {
+            dst_ptrs.push(*out.slice(offset..).device_ptr() as *const core::ffi::c_void);
+            offset += sizes[i];
+            if r_ptrs[i].is_null() {
+                dst_add_ptrs.push(ptr::null());
+            } else {
+                dst_add_ptrs.push(*out.slice(offset..).device_ptr() as *const core::ffi::c_void);
+                offset += sizes[i];
+            }
+        }
+
+        // All the tensors run the kernel of the largest hidden size
+        let max_cols = cols.iter().copied().max().unwrap_or(0) as usize;
+        let cols_rounded = fwd_hidden_size(max_cols, x0.dtype());
+        check_compiled(cols_rounded, x0.dtype())?;
+
+        let device = dev.ordinal() as i32;
+        let stream = *dev.cu_stream() as *const core::ffi::c_void;
+
+        let status = unsafe {
+            // Launch Kernel
+            ffi::run_ln_grouped(
+                n as u32,
+                x_ptrs.as_ptr(),
+                r_ptrs.as_ptr(),
+                g_ptrs.as_ptr(),
+                b_ptrs.as_ptr(),
+                dst_add_ptrs.as_ptr(),
+                dst_ptrs.as_ptr(),
+                epsilons.as_ptr(),
+                rows.as_ptr(),
+                cols.as_ptr(),
+                x_row_strides.as_ptr(),
+                r_row_strides.as_ptr(),
+                is_rms_norms.as_ptr(),
+                cols_rounded as u32,
+                device,
+                stream,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                layer_norm_type,
+                2,
+            )
+        };
+        if status != 0 {
+            candle_core::bail!(
+                "no forward kernel of hidden size {cols_rounded} for the type id {layer_norm_type}"
+            )
+        }
+
+        let out = candle_core::CudaStorage::wrap_cuda_slice(out, dev.clone());
+        Ok((out, Shape::from(elem_count)))
+    }
+}
+
+impl candle_core::CustomOp1 for LayerNormGrouped<'_> {
+    fn name(&self) -> &'static str {
+        "fused-layer-norm-grouped"
+    }
+
+    fn cpu_fwd(&self, _: &CpuStorage, _: &Layout) -> Result<(CpuStorage, Shape)> {
+        candle_core::bail!("no cpu support for fused-layer-norm")
+    }
+
+    fn cuda_fwd(
+        &self,
+        x: &candle_core::CudaStorage,
+        x_l: &Layout,
     ) -> Result<(candle_core::CudaStorage, Shape)> {
         match x.dtype() {
-            DType::F16 => self.fwd::<f16>(x, x_l, Some(r), Some(r_l)),
-            DType::BF16 => self.fwd::<bf16>(x, x_l, Some(r), Some(r_l)),
-            DType::F32 => self.fwd::<f32>(x, x_l, Some(r), Some(r_l)),
+            DType::F16 => self.fwd::<f16>(x, x_l),
+            DType::BF16 => self.fwd::<bf16>(x, x_l),
+            DType::F32 => self.fwd::<f32>(x, x_l),
             dt => {
                 candle_core::bail!(
                     "fused-layer-norm is only supported for f32, f16 and bf16 ({dt:?})"
@@ -269,7 +2829,7 @@ impl candle_core::CustomOp2 for LayerNorm {
 ///
 /// # Arguments
 ///
-/// * `x` - Input tensor of rank 2
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
 /// * `gamma` - Channel scale
 /// * `beta` - Channel bias
 /// * `epsilon` - A value added to the denominator for numerical stability
@@ -285,19 +2845,79 @@ pub fn layer_norm(
         epsilon,
         gamma: gamma.clone(),
         beta: beta.cloned(),
-        is_rms_norm: false,
+        is_rms_norm: false,
+        stats: stats_for_backward(x, None, gamma, beta)?,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
+    };
+    Ok(op.apply(x, None)?.0)
+}
+
+/// Fused Add Layer Normalization Layer
+///
+/// # Arguments
+///
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+/// * `res` - Residual tensor. Will be added to `x` before normalization. Must have
+/// the same shape as `x`.
+/// * `gamma` - Channel scale
+/// * `beta` - Channel bias
+/// * `epsilon` - A value added to the denominator for numerical stability
+///
+/// The resulting tensors have the same dimensions as `x`
+/// First tensor is the result of the normalization, second is the result of the residual add
+pub fn fused_add_layer_norm(
+    x: &Tensor,
+    res: &Tensor,
+    gamma: &Tensor,
+    beta: Option<&Tensor>,
+    epsilon: f32,
+) -> Result<(Tensor, Tensor)> {
+    let op = LayerNorm {
+        epsilon,
+        gamma: gamma.clone(),
+        beta: beta.cloned(),
+        is_rms_norm: false,
+        stats: stats_for_backward(x, Some(res), gamma, beta)?,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
+    };
+    let (out, residual_add) = op.apply(x, Some(res))?;
+    Ok((out, residual_add.unwrap()))
+}
+
+/// Layer RMS Normalization Layer
+///
+/// # Arguments
+///
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+/// * `gamma` - Channel scale
+/// * `beta` - Channel bias
+/// * `epsilon` - A value added to the denominator for numerical stability
+///
+/// The resulting tensor has the same dimensions as `x`
+pub fn rms_norm(x: &Tensor, gamma: &Tensor, beta: Option<&Tensor>, epsilon: f32) -> Result<Tensor> {
+    let op = LayerNorm {
+        epsilon,
+        gamma: gamma.clone(),
+        beta: beta.cloned(),
+        is_rms_norm: true,
+        stats: stats_for_backward(x, None, gamma, beta)?,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
     };
-    let results = x.apply_op1(op)?;
-    let rows = x.dims()[0];
-    results.narrow(0, 0, rows)
+    Ok(op.apply(x, None)?.0)
 }
 
-/// Fused Add Layer Normalization Layer
+/// Fused Add RMS Normalization Layer
 ///
 /// # Arguments
 ///
-/// * `x` - Input tensor of rank 2
-/// * `res` - Residual tensor of rank 2. Will be added to `x` before normalization. Must have
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+/// * `res` - Residual tensor. Will be added to `x` before normalization. Must have
 /// the same shape as `x`.
 /// * `gamma` - Channel scale
 /// * `beta` - Channel bias
@@ -305,7 +2925,7 @@ pub fn layer_norm(
 ///
 /// The resulting tensors have the same dimensions as `x`
 /// First tensor is the result of the normalization, second is the result of the residual add
-pub fn fused_add_layer_norm(
+pub fn fused_add_rms_norm(
     x: &Tensor,
     res: &Tensor,
     gamma: &Tensor,
@@ -316,64 +2936,113 @@ pub fn fused_add_layer_norm(
         epsilon,
         gamma: gamma.clone(),
         beta: beta.cloned(),
-        is_rms_norm: false,
+        is_rms_norm: true,
+        stats: stats_for_backward(x, Some(res), gamma, beta)?,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
     };
-    let results = x.apply_op2(&res, op)?;
-    let rows = x.dims()[0];
-    Ok((results.narrow(0, 0, rows)?, results.narrow(0, rows, rows)?))
+    let (out, residual_add) = op.apply(x, Some(res))?;
+    Ok((out, residual_add.unwrap()))
 }
 
-/// Layer RMS Normalization Layer
+/// Fused Add Layer Normalization Layer, updating the residual in place
 ///
 /// # Arguments
 ///
-/// * `x` - Input tensor of rank 2
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+/// * `res` - Residual tensor with the same shape as `x` and rows that do not overlap. Will be
+/// overwritten with the result of the residual add.
 /// * `gamma` - Channel scale
 /// * `beta` - Channel bias
 /// * `epsilon` - A value added to the denominator for numerical stability
 ///
-/// The resulting tensor has the same dimensions as `x`
-pub fn rms_norm(x: &Tensor, gamma: &Tensor, beta: Option<&Tensor>, epsilon: f32) -> Result<Tensor> {
+/// The resulting tensor is the result of the normalization and has the same dimensions as `x`
+pub fn fused_add_layer_norm_inplace(
+    x: &Tensor,
+    res: &mut Tensor,
+    gamma: &Tensor,
+    beta: Option<&Tensor>,
+    epsilon: f32,
+) -> Result<Tensor> {
     let op = LayerNorm {
         epsilon,
         gamma: gamma.clone(),
         beta: beta.cloned(),
-        is_rms_norm: true,
+        is_rms_norm: false,
+        stats: LayerNormStats::None,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
     };
-    let results = x.apply_op1(op)?;
-    let rows = x.dims()[0];
-    results.narrow(0, 0, rows)
+    op.forward_residual_inplace(x, res)
 }
 
-/// Fused Add RMS Normalization Layer
+/// Fused Add RMS Normalization Layer, updating the residual in place
 ///
 /// # Arguments
 ///
-/// * `x` - Input tensor of rank 2
-/// * `res` - Residual tensor of rank 2. Will be added to `x` before normalization. Must have
-/// the same shape as `x`.
+/// * `x` - Input tensor of rank >= 2, the leading dims are flattened into rows
+/// * `res` - Residual tensor with the same shape as `x` and rows that do not overlap. Will be
+/// overwritten with the result of the residual add.
 /// * `gamma` - Channel scale
 /// * `beta` - Channel bias
 /// * `epsilon` - A value added to the denominator for numerical stability
 ///
-/// The resulting tensors have the same dimensions as `x`
-/// First tensor is the result of the normalization, second is the result of the residual add
-pub fn fused_add_rms_norm(
+/// The resulting tensor is the result of the normalization and has the same dimensions as `x`
+pub fn fused_add_rms_norm_inplace(
     x: &Tensor,
-    res: &Tensor,
+    res: &mut Tensor,
     gamma: &Tensor,
     beta: Option<&Tensor>,
     epsilon: f32,
-) -> Result<(Tensor, Tensor)> {
+) -> Result<Tensor> {
     let op = LayerNorm {
         epsilon,
         gamma: gamma.clone(),
         beta: beta.cloned(),
         is_rms_norm: true,
+        stats: LayerNormStats::None,
+        handle: None,
+        cpu_weights: None,
+        workspace: None,
+    };
+    op.forward_residual_inplace(x, res)
+}
+
+/// Grouped Normalization Layer
+///
+/// Runs several independent normalizations, e.g. the q and k norms of a decoding step, with a
+/// single kernel launch. The inputs must share their dtype and have hidden sizes % 8 and <= 8192,
+/// their gamma, beta, epsilon, number of rows and hidden size may differ. The stats are not saved
+/// and no gradient is tracked.
+///
+/// Returns, for each normalization, the result of the normalization and, with a residual, the
+/// result of the residual add. Both have the same dimensions as the input.
+pub fn layer_norm_grouped(norms: &[GroupedNorm]) -> Result<Vec<(Tensor, Option<Tensor>)>> {
+    let first = match norms.first() {
+        Some(norm) => norm,
+        None => return Ok(vec![]),
     };
-    let results = x.apply_op2(&res, op)?;
-    let rows = x.dims()[0];
-    Ok((results.narrow(0, 0, rows)?, results.narrow(0, rows, rows)?))
+    let packed = first.x.apply_op1_no_bwd(&LayerNormGrouped { norms })?;
+
+    let mut offset = 0;
+    let mut results = Vec::with_capacity(norms.len());
+    for norm in norms {
+        let elem_count = norm.x.elem_count();
+        let out = packed.narrow(0, offset, elem_count)?.reshape(norm.x.shape())?;
+        offset += elem_count;
+        let residual_add = match norm.residual {
+            Some(_) => {
+                let t = packed.narrow(0, offset, elem_count)?.reshape(norm.x.shape())?;
+                offset += elem_count;
+                Some(t)
+            }
+            None => None,
+        };
+        results.push((out, residual_add));
+    }
+    Ok(results)
 }
 
 #[cfg(test)]
@@ -424,6 +3093,12 @@ mod tests {
         Ok(t)
     }
 
+    fn max_abs_diff(a: &Tensor, b: &Tensor) -> Result<f32> {
+        let a = a.to_dtype(DType::F32)?;
+        let b = b.to_dtype(DType::F32)?;
+        (a - b)?.abs()?.flatten_all()?.max(0)?.to_scalar::<f32>()
+    }
+
     #[test]
     fn test_layer_norm() -> Result<()> {
         let device = Device::new_cuda(0)?;
@@ -481,6 +3156,51 @@ mod tests {
         Ok(())
     }
 
+    #[test]
+    fn test_layer_norm_add_cpu() -> Result<()> {
+        let device = Device::Cpu;
+
+        // 100 columns leave a tail after the vector loops
+        let x = Tensor::randn(0f32, 1., (2, 3, 100), &device)?;
+        let r = Tensor::randn(0f32, 1., (2, 3, 100), &device)?;
+        let g = Tensor::randn(0f32, 1., 100, &device)?;
+        let b = Tensor::randn(0f32, 1., 100, &device)?;
+
+        for (dtype, tol) in [(DType::F32, 1e-4), (DType::F16, 1e-2), (DType::BF16, 1e-1)] {
+            let (x, r, g, b) = (
+                x.to_dtype(dtype)?,
+                r.to_dtype(dtype)?,
+                g.to_dtype(dtype)?,
+                b.to_dtype(dtype)?,
+            );
+            let mu_buf = Tensor::zeros(6, DType::F32, &device)?;
+            let rsigma_buf = Tensor::zeros(6, DType::F32, &device)?;
+            let mut ln = LayerNorm::new(g.clone(), Some(b.clone()), 1e-5, false)?;
+            ln.stats = LayerNormStats::Buffers {
+                mu: mu_buf.clone(),
+                rsigma: rsigma_buf.clone(),
+            };
+            let out = ln.forward(&x, Some(&r))?;
+            let truth_add = (&x + &r)?;
+            let truth = layer_norm_truth(&truth_add.flatten_to(1)?, &g, Some(&b), 1e-5, false)?;
+            assert!(max_abs_diff(&out.residual_add.unwrap(), &truth_add)? < tol);
+            assert!(max_abs_diff(&out.out.flatten_to(1)?, &truth)? < tol);
+
+            // The statistics of the f32 sum, that the 16-bit residual add rounds
+            let add = truth_add.to_dtype(DType::F32)?.flatten_to(1)?;
+            let mu = add.mean_keepdim(1)?;
+            let var = add.broadcast_sub(&mu)?.sqr()?.mean(1)?;
+            let rsigma = (var + 1e-5)?.sqrt()?.recip()?;
+            assert!(max_abs_diff(&mu_buf, &mu.flatten_all()?)? < tol);
+            assert!(max_abs_diff(&rsigma_buf, &rsigma)? < tol);
+
+            let res = rms_norm(&x, &g, None, 1e-5)?.flatten_to(1)?;
+            let truth = layer_norm_truth(&x.flatten_to(1)?, &g, None, 1e-5, true)?;
+            assert!(max_abs_diff(&res, &truth)? < tol);
+        }
+        Ok(())
+    }
+
     #[test]
     fn test_layer_norm_add() -> Result<()> {
         let device = Device::new_cuda(0)?;
@@ -514,4 +3234,824 @@ mod tests {
         assert_eq!(to_vec2_round(res, 3)?, to_vec2_round(truth, 3)?);
         Ok(())
     }
+
+    #[test]
+    fn test_rms_norm_add_persistent() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        // Enough rows for several blocks per CTA, which switches to the persistent kernel. The
+        // second launch relies on the work counter that the first one left at zero
+        let x = Tensor::randn(0., 1., (16384, 1024), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (16384, 1024), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+
+        for _ in 0..2 {
+            let (res, res_add) = fused_add_rms_norm(&x, &r, &g, None, 1e-12)?;
+            let truth_add = (&x + &r)?;
+            let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+            assert!(max_abs_diff(&res_add, &truth_add)? < 1e-4);
+            assert!(max_abs_diff(&res, &truth)? < 1e-4);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_strided() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let g = Tensor::randn(0., 1., 64, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., 64, &device)?.to_dtype(DType::F32)?;
+
+        // The leading dims are flattened into rows.
+        let x = Tensor::randn(0., 1., (2, 3, 64), &device)?.to_dtype(DType::F32)?;
+        let res = layer_norm(&x, &g, Some(&b), 1e-12)?;
+        assert_eq!(res.dims(), x.dims());
+        let truth = layer_norm_truth(&x.reshape((6, 64))?, &g, Some(&b), 1e-12, false)?;
+        assert!(max_abs_diff(&res.reshape((6, 64))?, &truth)? < 1e-4);
+
+        // Both halves of a larger buffer are read with their row stride of 128.
+        let buf = Tensor::randn(0., 1., (4, 128), &device)?.to_dtype(DType::F32)?;
+        let x = buf.narrow(1, 0, 64)?;
+        let r = buf.narrow(1, 64, 64)?;
+        let (res, res_add) = fused_add_layer_norm(&x, &r, &g, Some(&b), 1e-12)?;
+        let truth_add = (&x + &r)?;
+        let truth = layer_norm_truth(&truth_add, &g, Some(&b), 1e-12, false)?;
+        assert!(max_abs_diff(&res, &truth)? < 1e-4);
+        assert!(max_abs_diff(&res_add, &truth_add)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_per_head() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+        let (tokens, heads, kv_heads, head_dim) = (5, 8, 2, 128);
+
+        // The query heads of a fused qkv projection are normalized in place of the slice.
+        let qkv = Tensor::randn(0., 1., (tokens, heads + 2 * kv_heads, head_dim), &device)?
+            .to_dtype(DType::F16)?;
+        let q = qkv.narrow(1, 0, heads)?;
+        let g = Tensor::randn(0., 1., head_dim, &device)?.to_dtype(DType::F16)?;
+        let res = rms_norm(&q, &g, None, 1e-6)?;
+        assert_eq!(res.dims(), q.dims());
+
+        let q = q.contiguous()?.reshape((tokens * heads, head_dim))?;
+        let truth = layer_norm_truth(&q, &g, None, 1e-6, true)?;
+        let diff = max_abs_diff(&res.reshape((tokens * heads, head_dim))?, &truth)?;
+        assert!(diff < 1e-2, "{diff}");
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_rope() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+        let (tokens, heads, head_dim, max_positions) = (3, 4, 128, 16);
+        let half = head_dim / 2;
+
+        let x = Tensor::randn(0., 1., (tokens, heads, head_dim), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., head_dim, &device)?.to_dtype(DType::F32)?;
+        let freqs = Tensor::randn(0., 1., (max_positions, half), &device)?.to_dtype(DType::F32)?;
+        let positions = Tensor::new(&[5u32, 0, 2], &device)?;
+        let ln = LayerNorm {
+            epsilon: 1e-6,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+
+        let z = rms_norm(&x, &g, None, 1e-6)?;
+        let cos = freqs.cos()?.index_select(&positions, 0)?.unsqueeze(1)?;
+        let sin = freqs.sin()?.index_select(&positions, 0)?.unsqueeze(1)?;
+        for interleaved in [false, true] {
+            let rope = RotaryEmbedding {
+                cos: freqs.cos()?,
+                sin: freqs.sin()?,
+                interleaved,
+            };
+            let res = ln.forward_rope(&x, &rope, Some(&positions))?;
+
+            let (x1, x2) = if interleaved {
+                let z = z.reshape((tokens, heads, half, 2))?;
+                (z.narrow(3, 0, 1)?.squeeze(3)?, z.narrow(3, 1, 1)?.squeeze(3)?)
+            } else {
+                (z.narrow(2, 0, half)?, z.narrow(2, half, half)?)
+            };
+            let y1 = (x1.broadcast_mul(&cos)? - x2.broadcast_mul(&sin)?)?;
+            let y2 = (x2.broadcast_mul(&cos)? + x1.broadcast_mul(&sin)?)?;
+            let truth = if interleaved {
+                Tensor::stack(&[y1, y2], 3)?.reshape((tokens, heads, head_dim))?
+            } else {
+                Tensor::cat(&[y1, y2], 2)?
+            };
+            assert!(max_abs_diff(&res, &truth)? < 1e-4);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_grouped() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let q = Tensor::randn(0., 1., (2, 4, 128), &device)?.to_dtype(DType::F32)?;
+        let x = Tensor::randn(0., 1., (3, 1024), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (3, 1024), &device)?.to_dtype(DType::F32)?;
+        let q_norm = LayerNorm {
+            epsilon: 1e-6,
+            gamma: Tensor::randn(0., 1., 128, &device)?.to_dtype(DType::F32)?,
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let norm = LayerNorm {
+            epsilon: 1e-12,
+            gamma: Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?,
+            beta: Some(Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?),
+            is_rms_norm: false,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+
+        let results = layer_norm_grouped(&[
+            GroupedNorm {
+                ln: &q_norm,
+                x: &q,
+                residual: None,
+            },
+            GroupedNorm {
+                ln: &norm,
+                x: &x,
+                residual: Some(&r),
+            },
+        ])?;
+
+        let (q_res, q_add) = &results[0];
+        assert!(q_add.is_none());
+        assert_eq!(q_res.dims(), q.dims());
+        let q_truth = layer_norm_truth(&q.reshape((8, 128))?, &q_norm.gamma, None, 1e-6, true)?;
+        assert!(max_abs_diff(&q_res.reshape((8, 128))?, &q_truth)? < 1e-4);
+
+        let (res, res_add) = &results[1];
+        let truth_add = (&x + &r)?;
+        let truth = layer_norm_truth(&truth_add, &norm.gamma, norm.beta.as_ref(), 1e-12, false)?;
+        assert!(max_abs_diff(res, &truth)? < 1e-4);
+        assert!(max_abs_diff(res_add.as_ref().unwrap(), &truth_add)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_grouped_empty_warps() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        // The 128 columns only fill the first of the 4 warps per row of the 4096 kernel
+        let q = Tensor::randn(0f32, 1., (5, 128), &device)?;
+        let x = Tensor::randn(0f32, 1., (3, 4096), &device)?;
+        let q_norm = LayerNorm::new(
+            Tensor::randn(0f32, 1., 128, &device)?,
+            Some(Tensor::randn(0f32, 1., 128, &device)?),
+            1e-5,
+            false,
+        )?;
+        let norm = LayerNorm::new(Tensor::randn(0f32, 1., 4096, &device)?, None, 1e-5, false)?;
+
+        let results = layer_norm_grouped(&[
+            GroupedNorm {
+                ln: &q_norm,
+                x: &q,
+                residual: None,
+            },
+            GroupedNorm {
+                ln: &norm,
+                x: &x,
+                residual: None,
+            },
+        ])?;
+
+        let q_truth = layer_norm_truth(&q, &q_norm.gamma, q_norm.beta.as_ref(), 1e-5, false)?;
+        assert!(max_abs_diff(&results[0].0, &q_truth)? < 1e-4);
+        let truth = layer_norm_truth(&x, &norm.gamma, None, 1e-5, false)?;
+        assert!(max_abs_diff(&results[1].0, &truth)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_multi_cta() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        for hidden_size in MULTI_CTA_HIDDEN_SIZES {
+            let x = Tensor::randn(0., 1., (4, hidden_size), &device)?.to_dtype(DType::F32)?;
+            let g = Tensor::randn(0., 1., hidden_size, &device)?.to_dtype(DType::F32)?;
+            let b = Tensor::randn(0., 1., hidden_size, &device)?.to_dtype(DType::F32)?;
+
+            let res = layer_norm(&x, &g, Some(&b), 1e-12)?;
+            let truth = layer_norm_truth(&x, &g, Some(&b), 1e-12, false)?;
+            assert!(max_abs_diff(&res, &truth)? < 1e-4);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_exact_sizes() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        for hidden_size in EXACT_HIDDEN_SIZES {
+            for dtype in [DType::F32, DType::F16] {
+                let x = Tensor::randn(0., 1., (4, hidden_size), &device)?.to_dtype(dtype)?;
+                let g = Tensor::randn(0., 1., hidden_size, &device)?.to_dtype(dtype)?;
+                let b = Tensor::randn(0., 1., hidden_size, &device)?.to_dtype(dtype)?;
+
+                let res = layer_norm(&x, &g, Some(&b), 1e-12)?;
+                let truth = layer_norm_truth(&x, &g, Some(&b), 1e-12, false)?;
+                let tol = if dtype == DType::F32 { 1e-4 } else { 2e-2 };
+                assert!(max_abs_diff(&res, &truth)? < tol);
+            }
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_bwd() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let dz = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+
+        let x_var = candle_core::Var::from_tensor(&x)?;
+        let g_var = candle_core::Var::from_tensor(&g)?;
+        let b_var = candle_core::Var::from_tensor(&b)?;
+        let truth = layer_norm_truth(&x_var, &g_var, Some(&b_var), 1e-12, false)?;
+        let truth_grads = (truth * &dz)?.sum_all()?.backward()?;
+
+        // Autograd through the custom op propagates the input and the weight gradients.
+        let res = layer_norm(&x_var, &g_var, Some(&b_var), 1e-12)?;
+        let grads = (res * &dz)?.sum_all()?.backward()?;
+        for var in [&x_var, &g_var, &b_var] {
+            let grad = grads.get(var).unwrap();
+            assert!(max_abs_diff(grad, truth_grads.get(var).unwrap())? < 1e-4);
+        }
+
+        // The explicit backward pass also returns the weight gradients.
+        let op = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: Some(b.clone()),
+            is_rms_norm: false,
+            stats: stats_buffers(&x)?,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let _ = x.apply_op1_no_bwd(&op)?;
+        let grads = op.backward(&dz, &x, None)?;
+        assert!(max_abs_diff(&grads.dx, truth_grads.get(&x_var).unwrap())? < 1e-4);
+        assert!(max_abs_diff(&grads.dgamma, truth_grads.get(&g_var).unwrap())? < 1e-4);
+        assert!(max_abs_diff(&grads.dbeta.unwrap(), truth_grads.get(&b_var).unwrap())? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_forward_weight_grads() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let dz = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+
+        let x_var = candle_core::Var::from_tensor(&x)?;
+        let r_var = candle_core::Var::from_tensor(&r)?;
+        let g_var = candle_core::Var::from_tensor(&g)?;
+        let b_var = candle_core::Var::from_tensor(&b)?;
+        let truth_add = (x_var.as_tensor() + r_var.as_tensor())?;
+        let truth = layer_norm_truth(&truth_add, &g_var, Some(&b_var), 1e-5, false)?;
+        let truth_grads = (truth * &dz)?.sum_all()?.backward()?;
+
+        // The default statistics mode, the forward pass allocates them for the backward pass. With
+        // a residual, the tracked beta is added after the fused pass.
+        let ln = LayerNorm::new(
+            g_var.as_tensor().clone(),
+            Some(b_var.as_tensor().clone()),
+            1e-5,
+            false,
+        )?;
+        let res = ln.forward(&x_var, Some(&r_var))?;
+        assert!(res.stats.is_none());
+        let grads = (res.out * &dz)?.sum_all()?.backward()?;
+        for var in [&x_var, &r_var, &g_var, &b_var] {
+            let grad = grads.get(var).unwrap();
+            assert!(max_abs_diff(grad, truth_grads.get(var).unwrap())? < 1e-4);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_add_inplace() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+
+        let truth_add = (&x + &r)?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+
+        let mut res = r.copy()?;
+        let out = fused_add_rms_norm_inplace(&x, &mut res, &g, None, 1e-12)?;
+        assert_eq!(out.dims(), x.dims());
+        assert!(max_abs_diff(&out, &truth)? < 1e-4);
+        assert!(max_abs_diff(&res, &truth_add)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_resolved() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 1024), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm::new(g.clone(), Some(b.clone()), 1e-5, false)?;
+        assert!(ln.handle.is_some());
+
+        let truth = layer_norm_truth(&x, &g, Some(&b), 1e-5, false)?;
+        let res = ln.forward(&x, None)?;
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+
+        // No kernel rounds 9000 columns up.
+        let g = Tensor::ones(9000, DType::F32, &device)?;
+        assert!(LayerNorm::new(g, None, 1e-5, false).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_packed_compute() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (64, 4096), &device)?.to_dtype(DType::F16)?;
+        let r = Tensor::randn(0., 1., (64, 4096), &device)?.to_dtype(DType::F16)?;
+        let g = Tensor::randn(1., 0.1, 4096, &device)?.to_dtype(DType::F16)?;
+        let ln = LayerNorm::new(g.clone(), None, 1e-5, true)?;
+        let packed = ln.clone().with_packed_compute()?;
+
+        // A few ulps of the f16 outputs, whose magnitude is below 8 here.
+        let truth = ln.forward(&x, Some(&r))?;
+        let res = packed.forward(&x, Some(&r))?;
+        let out = res.out.to_dtype(DType::F32)?;
+        assert!(max_abs_diff(&out, &truth.out.to_dtype(DType::F32)?)? < 2e-2);
+        assert!(
+            max_abs_diff(
+                &res.residual_add.unwrap().to_dtype(DType::F32)?,
+                &truth.residual_add.unwrap().to_dtype(DType::F32)?
+            )? == 0.
+        );
+
+        let g = Tensor::ones(4096, DType::F32, &device)?;
+        assert!(LayerNorm::new(g, None, 1e-5, true)?.with_packed_compute().is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_packed_compute() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        for (dtype, tol) in [(DType::F16, 3e-2), (DType::BF16, 2.5e-1)] {
+            // An offset mean, that the two passes over the pairs remove before the squares.
+            let x = (Tensor::randn(0., 1., (64, 4096), &device)? + 4.)?.to_dtype(dtype)?;
+            let g = Tensor::randn(1., 0.1, 4096, &device)?.to_dtype(dtype)?;
+            let b = Tensor::randn(0., 1., 4096, &device)?.to_dtype(dtype)?;
+            let ln = LayerNorm::new(g.clone(), Some(b.clone()), 1e-5, false)?;
+            let packed = ln.clone().with_packed_compute()?;
+            let truth = ln.forward(&x, None)?.out;
+            let res = packed.forward(&x, None)?.out;
+            assert!(max_abs_diff(&res, &truth)? < tol, "{dtype:?}");
+
+            // A constant row has rs = 1e6 with this epsilon, past the largest f16. Its outputs
+            // are beta.
+            let x = Tensor::ones((4, 4096), dtype, &device)?;
+            let packed =
+                LayerNorm::new(g.clone(), Some(b.clone()), 1e-12, false)?.with_packed_compute()?;
+            let res = packed.forward(&x, None)?.out;
+            assert!(max_abs_diff(&res, &b.unsqueeze(0)?.broadcast_as((4, 4096))?)? == 0.);
+        }
+        Ok(())
+    }
+
+    #[cfg(feature = "telemetry")]
+    #[test]
+    fn test_fwd_telemetry() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (64, 1024), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::ones(1024, DType::F32, &device)?;
+        let before = fwd_telemetry(false);
+        rms_norm(&x, &g, None, 1e-5)?;
+        let after = fwd_telemetry(false);
+        // Other tests may launch concurrently.
+        assert!(after.calls > before.calls);
+        assert!(after.dispatch_ns > before.dispatch_ns);
+        assert!(after.ctas > before.ctas);
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_add_inplace_mixed_dtypes() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        // bf16 activations with an f32 residual stream and f32 weights.
+        let x = Tensor::randn(0., 1., (4, 1024), &device)?.to_dtype(DType::BF16)?;
+        let r = Tensor::randn(0., 1., (4, 1024), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+
+        let truth_add = (x.to_dtype(DType::F32)? + &r)?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-6, true)?;
+
+        let mut res = r.copy()?;
+        let out = fused_add_rms_norm_inplace(&x, &mut res, &g, None, 1e-6)?;
+        assert_eq!(out.dtype(), DType::BF16);
+        assert_eq!(res.dtype(), DType::F32);
+        assert!(max_abs_diff(&out.to_dtype(DType::F32)?, &truth)? < 5e-2);
+        assert!(max_abs_diff(&res, &truth_add)? < 1e-5);
+
+        // The sum of the residual add has no f32 slot in the bf16 output buffer.
+        let op = LayerNorm {
+            epsilon: 1e-6,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        assert!(op.forward(&x, Some(&r)).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_quantized() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 1024), &device)?.to_dtype(DType::F16)?;
+        let g = Tensor::ones(1024, DType::F16, &device)?;
+        let op = LayerNorm {
+            epsilon: 1e-5,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let truth = layer_norm_truth(&x, &g, None, 1e-5, true)?.to_dtype(DType::F32)?;
+
+        let (q, scales) = op.forward_quantized(&x, None, QuantDType::I8, &QuantScale::PerRow)?;
+        let scales = scales.unwrap();
+        assert_eq!(q.dtype(), DType::U8);
+        // Reinterpret the raw bytes as two's complement int8.
+        let q = q.to_dtype(DType::F32)?;
+        let q = (&q - (q.ge(128f64)?.to_dtype(DType::F32)? * 256.)?)?;
+        let dequantized = q.broadcast_mul(&scales.unsqueeze(1)?)?;
+        let max_scale = scales.max(0)?.to_scalar::<f32>()?;
+        assert!(max_abs_diff(&dequantized, &truth)? <= 0.5 * max_scale + 1e-2);
+
+        let scale = Tensor::new(&[max_scale], &device)?;
+        let (q_static, _) =
+            op.forward_quantized(&x, None, QuantDType::I8, &QuantScale::Static(scale))?;
+        let q_static = q_static.to_dtype(DType::F32)?;
+        let q_static = (&q_static - (q_static.ge(128f64)?.to_dtype(DType::F32)? * 256.)?)?;
+        assert!(max_abs_diff(&(q_static * max_scale as f64)?, &truth)? <= 0.5 * max_scale + 1e-2);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_stats() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let mut op = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: false,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let truth = layer_norm_truth(&x, &g, None, 1e-12, false)?;
+
+        let res = op.forward(&x, None)?;
+        assert!(res.stats.is_none());
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+
+        op.stats = LayerNormStats::Return;
+        let res = op.forward(&x, None)?;
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+        let (mu, rsigma) = res.stats.unwrap();
+        let mu_truth = x.mean_keepdim(1)?.squeeze(1)?;
+        let var = x.broadcast_sub(&mu_truth.unsqueeze(1)?)?.sqr()?.mean_keepdim(1)?;
+        let rsigma_truth = (var + 1e-12)?.sqrt()?.recip()?.squeeze(1)?;
+        assert!(max_abs_diff(&mu, &mu_truth)? < 1e-4);
+        assert!(max_abs_diff(&rsigma, &rsigma_truth)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_add_bwd() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let dz = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+        let dz_add = Tensor::randn(0., 1., (4, 8), &device)?.to_dtype(DType::F32)?;
+
+        let x_var = candle_core::Var::from_tensor(&x)?;
+        let r_var = candle_core::Var::from_tensor(&r)?;
+        let truth_add = (x_var.as_tensor() + r_var.as_tensor())?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+        let truth_loss = ((truth * &dz)?.sum_all()? + (truth_add * &dz_add)?.sum_all()?)?;
+        let truth_grads = truth_loss.backward()?;
+
+        let (res, res_add) = fused_add_rms_norm(&x_var, &r_var, &g, None, 1e-12)?;
+        let loss = ((res * &dz)?.sum_all()? + (res_add * &dz_add)?.sum_all()?)?;
+        let grads = loss.backward()?;
+        assert!(
+            max_abs_diff(grads.get(&x_var).unwrap(), truth_grads.get(&x_var).unwrap())? < 1e-4
+        );
+        assert!(
+            max_abs_diff(grads.get(&r_var).unwrap(), truth_grads.get(&r_var).unwrap())? < 1e-4
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_dropout() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+        let (rows, cols, p) = (16, 1024, 0.25);
+
+        let x = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., cols, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., cols, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: Some(b.clone()),
+            is_rms_norm: false,
+            stats: stats_buffers(&x)?,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let dropout = Dropout {
+            p,
+            seed: 42,
+            offset: 0,
+            return_mask: true,
+        };
+        let res = ln.forward_dropout(&x, Some(&r), &dropout)?;
+
+        // Unpack the mask, the same seed and offset give the same one.
+        let dmask = res.dmask.clone().unwrap();
+        let again = ln.forward_dropout(&x, Some(&r), &dropout)?.dmask.unwrap();
+        assert_eq!(dmask.to_vec1::<u32>()?, again.to_vec1::<u32>()?);
+        let words = dmask.to_vec1::<u32>()?;
+        let keep: Vec<f32> = (0..rows * cols)
+            .map(|i| ((words[i / 32] >> (i % 32)) & 1) as f32)
+            .collect();
+        let kept = keep.iter().sum::<f32>() / (rows * cols) as f32;
+        assert!((kept - (1. - p)).abs() < 0.02, "{kept}");
+        let keep = Tensor::from_vec(keep, (rows, cols), &device)?;
+
+        let x_var = candle_core::Var::from_tensor(&x)?;
+        let r_var = candle_core::Var::from_tensor(&r)?;
+        let truth_add = ((x_var.as_tensor() * &keep)? / (1. - p as f64))?.add(r_var.as_tensor())?;
+        let truth = layer_norm_truth(&truth_add, &g, Some(&b), 1e-12, false)?;
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+        assert!(max_abs_diff(res.residual_add.as_ref().unwrap(), &truth_add)? < 1e-4);
+
+        let dz = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let dz_add = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let truth_loss = ((truth * &dz)?.sum_all()? + (&truth_add * &dz_add)?.sum_all()?)?;
+        let truth_grads = truth_loss.backward()?;
+
+        let x_add = res.residual_add.unwrap();
+        let grads = ln.backward_dropout(&dz, &x_add, Some(&dz_add), &dmask, p)?;
+        assert!(max_abs_diff(&grads.dx0.unwrap(), truth_grads.get(&x_var).unwrap())? < 1e-3);
+        assert!(max_abs_diff(&grads.dx, truth_grads.get(&r_var).unwrap())? < 1e-3);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_dropout_no_residual() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+        let (rows, cols, p) = (16, 1024, 0.25);
+
+        let x = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., cols, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: stats_buffers(&x)?,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+        let dropout = Dropout {
+            p,
+            seed: 7,
+            offset: 0,
+            return_mask: true,
+        };
+        let res = ln.forward_dropout(&x, None, &dropout)?;
+        let dmask = res.dmask.unwrap();
+        let words = dmask.to_vec1::<u32>()?;
+        let keep: Vec<f32> = (0..rows * cols)
+            .map(|i| ((words[i / 32] >> (i % 32)) & 1) as f32)
+            .collect();
+        let keep = Tensor::from_vec(keep, (rows, cols), &device)?;
+
+        // The dropped input is returned as the residual add result.
+        let x_var = candle_core::Var::from_tensor(&x)?;
+        let truth_add = ((x_var.as_tensor() * &keep)? / (1. - p as f64))?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+        let x_add = res.residual_add.unwrap();
+        assert!(max_abs_diff(&x_add, &truth_add)? < 1e-4);
+
+        let dz = Tensor::randn(0., 1., (rows, cols), &device)?.to_dtype(DType::F32)?;
+        let truth_grads = (truth * &dz)?.sum_all()?.backward()?;
+        let grads = ln.backward_dropout(&dz, &x_add, None, &dmask, p)?;
+        assert!(max_abs_diff(&grads.dx0.unwrap(), truth_grads.get(&x_var).unwrap())? < 1e-3);
+        Ok(())
+    }
+
+    #[test]
+    fn test_layer_norm_scaled() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (8, 256), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (8, 256), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 256, &device)?.to_dtype(DType::F32)?;
+        let b = Tensor::randn(0., 1., 256, &device)?.to_dtype(DType::F32)?;
+        let rowscale = Tensor::randn(0., 1., 8, &device)?.to_dtype(DType::F32)?;
+        let colscale = Tensor::randn(0., 1., 256, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: Some(b.clone()),
+            is_rms_norm: false,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+
+        let scales = InputScales {
+            rowscale: Some(rowscale.clone()),
+            colscale: Some(colscale.clone()),
+            subset: None,
+        };
+        let res = ln.forward_scaled(&x, Some(&r), &scales)?;
+        let x_scaled = x.broadcast_mul(&rowscale.unsqueeze(1)?)?.broadcast_mul(&colscale)?;
+        let truth_add = (x_scaled + &r)?;
+        let truth = layer_norm_truth(&truth_add, &g, Some(&b), 1e-12, false)?;
+        assert!(max_abs_diff(&res.residual_add.unwrap(), &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+
+        // Rows 0, 2 and 4 of the residual add read the input rows, only rows 3 and 5 are
+        // normalized.
+        let x0 = x.narrow(0, 0, 3)?;
+        let r = r.narrow(0, 0, 6)?;
+        let subset = RowSubset {
+            x_rows: Tensor::new(&[1u32, 0, 2, 0, 3, 0], &device)?,
+            out_rows: Tensor::new(&[0u32, 0, 0, 1, 0, 2], &device)?,
+            num_out_rows: 2,
+            scale: 0.5,
+        };
+        let scales = InputScales {
+            subset: Some(subset),
+            ..Default::default()
+        };
+        let res = ln.forward_scaled(&x0, Some(&r), &scales)?;
+        let x0_rows = Tensor::new(&[0u32, 0, 1, 0, 2, 0], &device)?;
+        let x0_mask = Tensor::new(&[1f32, 0., 1., 0., 1., 0.], &device)?.unsqueeze(1)?;
+        let x0_gathered = (x0.index_select(&x0_rows, 0)?.broadcast_mul(&x0_mask)? * 0.5)?;
+        let truth_add = (x0_gathered + &r)?;
+        let out_rows = Tensor::new(&[3u32, 5], &device)?;
+        let truth_out = truth_add.index_select(&out_rows, 0)?;
+        let truth = layer_norm_truth(&truth_out, &g, Some(&b), 1e-12, false)?;
+        assert_eq!(res.out.dims(), &[2, 256]);
+        assert!(max_abs_diff(&res.residual_add.unwrap(), &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+
+        // Indices past the rows of x or of the outputs skip the row like 0.
+        let r = r.narrow(0, 0, 2)?;
+        let subset = RowSubset {
+            x_rows: Tensor::new(&[1u32, 4], &device)?,
+            out_rows: Tensor::new(&[3u32, 1], &device)?,
+            num_out_rows: 2,
+            scale: 1.,
+        };
+        let scales = InputScales {
+            subset: Some(subset),
+            ..Default::default()
+        };
+        let res = ln.forward_scaled(&x0, Some(&r), &scales)?;
+        let added = (x0.narrow(0, 0, 1)? + r.narrow(0, 0, 1)?)?;
+        let truth_add = Tensor::cat(&[added, r.narrow(0, 1, 1)?], 0)?;
+        let truth = layer_norm_truth(&r.narrow(0, 1, 1)?, &g, Some(&b), 1e-12, false)?;
+        assert!(max_abs_diff(&res.residual_add.unwrap(), &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&res.out.narrow(0, 0, 1)?, &truth)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_bias_add() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (8, 1024), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (8, 1024), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+        let bias = Tensor::randn(0., 1., 1024, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+
+        let res = ln.forward_bias(&x, &bias, Some(&r))?;
+        let truth_add = (x.broadcast_add(&bias)? + &r)?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+        assert!(max_abs_diff(&res.residual_add.unwrap(), &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+
+        // Without a residual, the sum is x + bias
+        let res = ln.forward_bias(&x, &bias, None)?;
+        let truth_add = x.broadcast_add(&bias)?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+        assert!(max_abs_diff(&res.residual_add.unwrap(), &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&res.out, &truth)? < 1e-4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_rms_norm_add_graph_safe() -> Result<()> {
+        let device = Device::new_cuda(0)?;
+
+        let x = Tensor::randn(0., 1., (8, 256), &device)?.to_dtype(DType::F32)?;
+        let r = Tensor::randn(0., 1., (8, 256), &device)?.to_dtype(DType::F32)?;
+        let g = Tensor::randn(0., 1., 256, &device)?.to_dtype(DType::F32)?;
+        let ln = LayerNorm {
+            epsilon: 1e-12,
+            gamma: g.clone(),
+            beta: None,
+            is_rms_norm: true,
+            stats: LayerNormStats::None,
+            handle: None,
+            cpu_weights: None,
+            workspace: None,
+        };
+
+        // Only the first 3 of the 8 rows are normalized, the others are left untouched
+        let rows = Tensor::new(&[3u32], &device)?;
+        let out = Tensor::zeros((8, 256), DType::F32, &device)?;
+        let residual_add = Tensor::zeros((8, 256), DType::F32, &device)?;
+        let buffers = GraphBuffers {
+            rows: &rows,
+            out: &out,
+            residual_add: Some(&residual_add),
+        };
+        ln.forward_graph_safe(&x, Some(&r), &buffers)?;
+
+        let truth_add = (&x + &r)?.narrow(0, 0, 3)?;
+        let truth = layer_norm_truth(&truth_add, &g, None, 1e-12, true)?;
+        assert!(max_abs_diff(&residual_add.narrow(0, 0, 3)?, &truth_add)? < 1e-4);
+        assert!(max_abs_diff(&out.narrow(0, 0, 3)?, &truth)? < 1e-4);
+        assert_eq!(
+            out.narrow(0, 3, 5)?.abs()?.sum_all()?.to_scalar::<f32>()?,
+            0.
+        );
+        Ok(())
+    }
 }
@@ -0,0 +1,49 @@
+//! The autotuner benchmarks every candidate shape on the launch buffers, among them the shapes
+//! with several warps per row and several rows per CTA. The environment is read once per process,
+//! so these launches run in their own test binary.
+use candle_core::{DType, Device, Result, Tensor};
+use candle_layer_norm::fused_add_layer_norm;
+
+fn layer_norm_truth(x: &Tensor, gamma: &Tensor, epsilon: f64) -> Result<Tensor> {
+    let x = x.to_dtype(DType::F32)?;
+    let x = x.broadcast_sub(&x.mean_keepdim(1)?)?;
+    let var = x.sqr()?.mean_keepdim(1)?;
+    x.broadcast_div(&(var + epsilon)?.sqrt()?)?
+        .broadcast_mul(&gamma.to_dtype(DType::F32)?)
+}
+
+fn max_abs_diff(a: &Tensor, b: &Tensor) -> Result<f32> {
+    let a = a.to_dtype(DType::F32)?;
+    let b = b.to_dtype(DType::F32)?;
+    (a - b)?.abs()?.flatten_all()?.max(0)?.to_scalar::<f32>()
+}
+
+#[test]
+fn test_tuned_shapes_odd_rows() -> Result<()> {
+    std::env::set_var("CANDLE_LAYER_NORM_AUTOTUNE", "1");
+    let device = Device::new_cuda(0)?;
+
+    // The (2, 2) and (2, 4) candidates of 1024 and 4096 columns, with an odd number of rows that
+    // is large enough for the persistent kernel, so that the last block of rows of a CTA only has
+    // a row for one of its warps.
+    for (rows, cols) in [(65537, 1024), (16385, 4096)] {
+        for dtype in [DType::F16, DType::BF16] {
+            let x = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(dtype)?;
+            let r = Tensor::randn(0f32, 1., (rows, cols), &device)?.to_dtype(dtype)?;
+            let g = Tensor::randn(0f32, 1., cols, &device)?.to_dtype(dtype)?;
+
+            let truth_add = (x.to_dtype(DType::F32)? + r.to_dtype(DType::F32)?)?;
+            let truth = layer_norm_truth(&truth_add, &g, 1e-5)?;
+            // Half an ulp of the outputs, that reach about 32.
+            let tol = if dtype == DType::F16 { 2e-2 } else { 1.5e-1 };
+
+            // The first launch tunes, the second one runs the chosen shape.
+            for _ in 0..2 {
+                let (res, res_add) = fused_add_layer_norm(&x, &r, &g, None, 1e-5)?;
+                assert!(max_abs_diff(&res_add, &truth_add.to_dtype(dtype)?)? < 1e-6);
+                assert!(max_abs_diff(&res, &truth)? < tol, "{dtype:?} {cols}");
+            }
+        }
+    }
+    Ok(())
+}